@@ -158,8 +158,8 @@ static int archive_buffer_load(EditBuffer *b, FILE *f)
     }
 }
 
-static int archive_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset archive_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                    const char *filename)
 {
     /* XXX: prevent saving parsed contents to archive file */
     return -1;
@@ -301,8 +301,8 @@ static int compress_buffer_load(EditBuffer *b, FILE *f)
     }
 }
 
-static int compress_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset compress_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                     const char *filename)
 {
     /* XXX: should recompress contents to compressed file */
     return -1;
@@ -387,8 +387,8 @@ static int wget_buffer_load(EditBuffer *b, FILE *f)
     return 0;
 }
 
-static int wget_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset wget_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                 const char *filename)
 {
     /* XXX: should put contents back to web server */
     return -1;
@@ -475,8 +475,8 @@ static int man_buffer_load(EditBuffer *b, FILE *f)
     return 0;
 }
 
-static int man_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset man_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                const char *filename)
 {
     /* XXX: should put contents back to web server */
     return -1;
@@ -145,8 +145,8 @@ static void build_bufed_list(BufedState *bs, EditState *s)
             }
 
             b->cur_style = style0;
-            eb_printf(b, " %10d %1.0d %-8.8s %-11s ",
-                      b1->total_size, b1->style_bytes & 7,
+            eb_printf(b, " %10lld %1.0d %-8.8s %-11s ",
+                      (long long)b1->total_size, b1->style_bytes & 7,
                       b1->charset->name, mode_buf);
             if (b1->flags & BF_DIRED)
                 b->cur_style = BUFED_STYLE_DIRECTORY;
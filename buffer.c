@@ -23,59 +23,721 @@
 #ifdef CONFIG_MMAP
 #include <sys/mman.h>
 #endif
+#ifndef CONFIG_WIN32
+#include <sys/uio.h>
+#endif
 
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size);
+                      QEOffset offset, QEOffset size);
+static void eb_log_cancel(EditBuffer *b, enum LogOperation op,
+                          QEOffset offset, QEOffset size, int was_modified);
+
+/************************************************************/
+/* page data allocation */
+
+typedef struct PageSlabChunk {
+    PageSlab *slab;     /* owner or NULL once the slab is released */
+    int size;           /* size of the blocks following the header */
+    int nb_shared;      /* number of blocks of shared pages */
+} PageSlabChunk;
+
+/* return the index of the smallest block size >= size */
+static int page_slab_class(int size)
+{
+    int i;
+
+    for (i = 0; i < NB_PAGE_SLABS - 1 && (PAGE_SLAB_MIN << i) < size; i++)
+        continue;
+    return i;
+}
+
+/* return the index of the first chunk of ps above address ptr */
+static int page_slab_search(PageSlab *ps, const u8 *ptr)
+{
+    int lo, hi, m;
+
+    lo = 0;
+    hi = ps->nb_chunks;
+    while (lo < hi) {
+        m = (lo + hi) >> 1;
+        if ((const u8 *)ps->chunks[m] <= ptr)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+/* return the chunk of ps containing block */
+static PageSlabChunk *page_slab_chunk(PageSlab *ps, const u8 *block)
+{
+    return ps->chunks[page_slab_search(ps, block) - 1];
+}
+
+/* push a block of size class i on its free list */
+static void page_slab_push(PageSlab *ps, u8 *block, int i)
+{
+    *(u8 **)(void *)block = ps->free_list[i];
+    ps->free_list[i] = block;
+    ps->nb_free[i]++;
+}
+
+/* allocate a block of at least *size_ptr bytes for page data, store
+ * the actual block size in *size_ptr.
+ */
+static u8 *page_alloc(EditBuffer *b, int *size_ptr)
+{
+    PageSlab *ps = &b->page_slab;
+    PageSlabChunk *chunk;
+    int i, k, n, size, chunk_size;
+    u8 *block;
+
+    i = page_slab_class(*size_ptr);
+    size = PAGE_SLAB_MIN << i;
+    if (!ps->free_list[i]) {
+        if (ps->nb_chunks >= ps->chunks_size) {
+            n = ps->chunks_size + (ps->chunks_size >> 1) + 16;
+            if (!qe_realloc(&ps->chunks, n * sizeof(*ps->chunks)))
+                return NULL;
+            ps->chunks_size = n;
+        }
+        /* chunk size doubles for each new chunk of the same class */
+        chunk_size = max3(ps->chunk_size[i], PAGE_SLAB_CHUNK_MIN, size);
+        n = chunk_size / size;
+        chunk = qe_malloc_hack(PageSlabChunk, n * size);
+        if (!chunk)
+            return NULL;
+        chunk->slab = ps;
+        chunk->size = n * size;
+        chunk->nb_shared = 0;
+        k = page_slab_search(ps, (u8 *)chunk);
+        memmove(ps->chunks + k + 1, ps->chunks + k,
+                (ps->nb_chunks - k) * sizeof(*ps->chunks));
+        ps->chunks[k] = chunk;
+        ps->nb_chunks++;
+        ps->chunk_bytes += n * size;
+        ps->chunk_size[i] = min(chunk_size * 2, PAGE_SLAB_CHUNK_MAX);
+        block = (u8 *)(chunk + 1) + n * size;
+        while (n-- > 0) {
+            block -= size;
+            page_slab_push(ps, block, i);
+        }
+    }
+    block = ps->free_list[i];
+    ps->free_list[i] = *(u8 **)(void *)block;
+    ps->nb_free[i]--;
+    ps->nb_used[i]++;
+    *size_ptr = size;
+    return block;
+}
+
+/* Read only page data is reference counted so pages can be shared
+ * between buffers: killing or yanking large regions and recording them
+ * in the undo log just adds references to the same data.  The data is
+ * either a slab block handed over by the page that was shared or a
+ * part of a file mapping.  Each page referencing it holds one
+ * reference, the first modification copies the page into the buffer
+ * slab.
+ */
+typedef struct PageShared {
+    int ref_count;
+    void *map_address;  /* file mapping or NULL for a slab block */
+    QEOffset map_length;
+    PageSlabChunk *chunk;  /* chunk of the slab block */
+    u8 *block;
+    int block_size;
+} PageShared;
+
+/* pages smaller than this are copied instead of shared */
+#define PAGE_SHARE_MIN  (MAX_PAGE_SIZE / 4)
+
+/* Release a reference to ps.  The last one returns the slab block to
+ * the free list of its buffer, or frees its chunk if the buffer slab
+ * was released and no other shared block remains in it.
+ */
+static void page_shared_unref(PageShared *ps)
+{
+    PageSlabChunk *chunk;
+    int i;
+
+    if (--ps->ref_count <= 0) {
+#ifdef CONFIG_MMAP
+        if (ps->map_address)
+            munmap(ps->map_address, ps->map_length);
+#endif
+        chunk = ps->chunk;
+        if (chunk) {
+            chunk->nb_shared--;
+            if (chunk->slab) {
+                i = page_slab_class(ps->block_size);
+                page_slab_push(chunk->slab, ps->block, i);
+                chunk->slab->nb_shared[i]--;
+            } else
+            if (chunk->nb_shared == 0) {
+                qe_free(&chunk);
+            }
+        }
+        qe_free(&ps);
+    }
+}
+
+/* return a block of size bytes from page_alloc to its free list */
+static void page_slab_free(EditBuffer *b, u8 *block, int size)
+{
+    PageSlab *ps = &b->page_slab;
+    int i;
+
+    i = page_slab_class(size);
+    page_slab_push(ps, block, i);
+    ps->nb_used[i]--;
+}
+
+/* free the data block of page p */
+static void page_free(EditBuffer *b, Page *p)
+{
+    if (p->flags & PG_READ_ONLY) {
+        if (p->shared)
+            page_shared_unref(p->shared);
+    } else
+    if (p->data) {
+        page_slab_free(b, p->data, p->size + p->gap_size);
+    }
+    p->data = NULL;
+    p->shared = NULL;
+}
+
+/* release all page data chunks of buffer b, the chunks holding blocks
+ * of shared pages are detached and freed with their last block.
+ */
+static void page_slab_release(EditBuffer *b)
+{
+    PageSlab *ps = &b->page_slab;
+    PageSlabChunk *chunk;
+    int i;
+
+    for (i = 0; i < ps->nb_chunks; i++) {
+        chunk = ps->chunks[i];
+        if (chunk->nb_shared)
+            chunk->slab = NULL;
+        else
+            qe_free(&chunk);
+    }
+    qe_free(&ps->chunks);
+    memset(ps, 0, sizeof(*ps));
+}
+
+/* insert n uninitialized entries in the page table at page_index,
+ * return a pointer to the first one or NULL if out of memory.
+ */
+static Page *eb_alloc_pages(EditBuffer *b, int page_index, int n)
+{
+    Page *p;
+    int size;
+
+    if (b->nb_pages + n > b->page_table_size) {
+        size = max(b->nb_pages + n,
+                   b->page_table_size + (b->page_table_size >> 1) + 16);
+        if (!qe_realloc(&b->page_table, size * sizeof(Page)))
+            return NULL;
+        b->page_table_size = size;
+    }
+    p = b->page_table + page_index;
+    memmove(p + n, p, (b->nb_pages - page_index) * sizeof(Page));
+    b->nb_pages += n;
+    return p;
+}
+
+/************************************************************/
+/* page gap */
+
+/* Page data is a small gap buffer: the bytes before the gap are at
+ * data[0 .. gap), the bytes after the gap at data[gap + gap_size ..
+ * size + gap_size).  Insertions and deletions at the gap only move
+ * the gap, so consecutive edits at the same spot do not move the
+ * rest of the page nor reallocate it.
+ */
+
+/* return a pointer to the byte at offset in page p and store the
+ * number of contiguous bytes from there in *len_ptr.
+ */
+static inline u8 *page_ptr(const Page *p, int offset, int *len_ptr)
+{
+    if (offset < p->gap) {
+        *len_ptr = p->gap - offset;
+        return p->data + offset;
+    } else {
+        *len_ptr = p->size - offset;
+        return p->data + p->gap_size + offset;
+    }
+}
+
+/* move the gap of page p to offset */
+static void page_move_gap(Page *p, int offset)
+{
+    if (p->gap_size) {
+        if (offset < p->gap) {
+            memmove(p->data + offset + p->gap_size, p->data + offset,
+                    p->gap - offset);
+        } else
+        if (offset > p->gap) {
+            memmove(p->data + p->gap, p->data + p->gap + p->gap_size,
+                    offset - p->gap);
+        }
+    }
+    p->gap = offset;
+}
+
+/* return a pointer to len contiguous bytes at offset in page p,
+ * moving the gap out of the way if needed.
+ */
+static u8 *page_range(Page *p, int offset, int len)
+{
+    if (offset < p->gap && offset + len > p->gap) {
+        if (p->gap - offset < offset + len - p->gap)
+            page_move_gap(p, offset);
+        else
+            page_move_gap(p, offset + len);
+    }
+    if (offset < p->gap)
+        return p->data + offset;
+    else
+        return p->data + p->gap_size + offset;
+}
+
+/* insert len bytes at offset in page p, size + len must not exceed
+ * MAX_PAGE_SIZE.  Return 0 if OK or -1 if out of memory, in which
+ * case the page contents are unchanged.
+ */
+static int page_insert(EditBuffer *b, Page *p, int offset,
+                       const u8 *buf, int len)
+{
+    int alloc, tail;
+    u8 *data;
+
+    page_move_gap(p, offset);
+    if (p->gap_size < len) {
+        /* move to a larger block, the rounding up to the next block
+         * size leaves slack for the next insertions.
+         */
+        alloc = p->size + len;
+        data = page_alloc(b, &alloc);
+        if (!data)
+            return -1;
+        tail = p->size - offset;
+        memcpy(data, p->data, offset);
+        memcpy(data + alloc - tail, p->data + offset + p->gap_size, tail);
+        page_free(b, p);
+        p->data = data;
+        p->gap_size = alloc - p->size;
+    }
+    memcpy(p->data + offset, buf, len);
+    p->gap += len;
+    p->gap_size -= len;
+    p->size += len;
+    return 0;
+}
+
+/* delete len bytes at offset in page p, the space is added to the gap */
+static void page_delete(Page *p, int offset, int len)
+{
+    page_move_gap(p, offset);
+    p->gap_size += len;
+    p->size -= len;
+}
+
+/* return true if the bytes of page p on either side of offset can be
+ * counted separately: no character nor EOL sequence may span offset.
+ */
+static int page_can_split(EditBuffer *b, const Page *p, int offset)
+{
+    int c, len;
+
+    if (offset <= 0 || offset >= p->size || b->charset->char_size != 1)
+        return 0;
+    c = *page_ptr(p, offset, &len);
+    if (c == '\n' && b->eol_type == EOL_DOS)
+        return 0;
+    if (b->charset == &charset_utf8 && utf8_is_trailing_byte(c))
+        return 0;
+    return 1;
+}
+
+/* compute the number of lines and the column after the bytes of page
+ * p from start to end, counted from start.
+ */
+static void page_get_pos(EditBuffer *b, Page *p, int start, int end,
+                         int *line_ptr, int *col_ptr)
+{
+    CharsetDecodeState *s = &b->charset_state;
+    int line, col;
+
+    if (start < p->gap && end > p->gap && page_can_split(b, p, p->gap)) {
+        s->get_pos_func(s, p->data + start, p->gap - start,
+                        line_ptr, col_ptr);
+        s->get_pos_func(s, p->data + p->gap + p->gap_size, end - p->gap,
+                        &line, &col);
+        if (line)
+            *col_ptr = 0;
+        *line_ptr += line;
+        *col_ptr += col;
+    } else {
+        s->get_pos_func(s, page_range(p, start, end - start), end - start,
+                        line_ptr, col_ptr);
+    }
+}
+
+/* compute the number of chars in the first size bytes of page p */
+static int page_get_chars(EditBuffer *b, Page *p, int size)
+{
+    CharsetDecodeState *s = &b->charset_state;
+
+    if (size > p->gap && page_can_split(b, p, p->gap)) {
+        return b->charset->get_chars_func(s, p->data, p->gap) +
+            b->charset->get_chars_func(s, p->data + p->gap + p->gap_size,
+                                       size - p->gap);
+    } else {
+        return b->charset->get_chars_func(s, page_range(p, 0, size), size);
+    }
+}
+
+/************************************************************/
+/* page index */
+
+/* The page index maintains Fenwick trees over the page table: node
+ * j (1 based) holds the sum of the values for pages j - lowbit(j)
+ * to j - 1.  Prefix sums and searches are O(log(nb_pages)), page
+ * updates are applied as deltas.  Page insertion and deletion
+ * invalidate the nodes from the first page moved, these are
+ * recomputed lazily on the next lookup.
+ */
+
+/* sum of the values for the first n pages */
+static QEOffset page_tree_sum(const QEOffset *tree, int n)
+{
+    QEOffset sum = 0;
+
+    for (; n > 0; n &= n - 1)
+        sum += tree[n];
+    return sum;
+}
+
+/* add delta to the value of page i in the first nb nodes */
+static void page_tree_add(QEOffset *tree, int nb, int i, QEOffset delta)
+{
+    for (i++; i <= nb; i += i & -i)
+        tree[i] += delta;
+}
+
+/* return the number of leading pages whose cumulative value is <= pos,
+ * store the remainder in *rem_ptr.  Values must be positive or null.
+ */
+static int page_tree_find(const QEOffset *tree, int nb, QEOffset pos,
+                          QEOffset *rem_ptr)
+{
+    int n, step;
+
+    for (step = 1; step * 2 <= nb; step *= 2)
+        continue;
+    for (n = 0; step > 0; step >>= 1) {
+        if (n + step <= nb && tree[n + step] <= pos) {
+            n += step;
+            pos -= tree[n];
+        }
+    }
+    *rem_ptr = pos;
+    return n;
+}
+
+/* compute node j from page value and previous nodes */
+static inline void page_tree_set(QEOffset *tree, int j, QEOffset value)
+{
+    int k;
+
+    for (k = 1; k < (j & -j); k <<= 1)
+        value += tree[j - k];
+    tree[j] = value;
+}
+
+/* ensure the index arrays can hold nb_pages nodes */
+static int eb_index_alloc(EditBuffer *b)
+{
+    PageIndex *pi = &b->page_index;
+    int size;
+
+    if (b->nb_pages < pi->alloc_size)
+        return 0;
+
+    size = max(32, b->nb_pages + (b->nb_pages >> 1) + 1);
+    if (!qe_realloc(&pi->size_tree, size * sizeof(QEOffset))
+    ||  !qe_realloc(&pi->lines_tree, size * sizeof(QEOffset))
+    ||  !qe_realloc(&pi->col_tree, size * sizeof(QEOffset))
+    ||  !qe_realloc(&pi->chars_tree, size * sizeof(QEOffset))) {
+        pi->nb_size = pi->nb_pos = pi->nb_char = 0;
+        return -1;
+    }
+    pi->alloc_size = size;
+    return 0;
+}
+
+static void eb_index_free(EditBuffer *b)
+{
+    PageIndex *pi = &b->page_index;
+
+    qe_free(&pi->size_tree);
+    qe_free(&pi->lines_tree);
+    qe_free(&pi->col_tree);
+    qe_free(&pi->chars_tree);
+    memset(pi, 0, sizeof(*pi));
+}
+
+/* page table was modified from page_index onwards */
+static void eb_index_invalidate(EditBuffer *b, int page_index)
+{
+    PageIndex *pi = &b->page_index;
+    int i, n;
+
+    if (page_index < 0)
+        page_index = 0;
+    pi->nb_size = min(pi->nb_size, page_index);
+    pi->nb_pos = min(pi->nb_pos, page_index);
+    pi->nb_char = min(pi->nb_char, page_index);
+    /* drop dirty entries for pages that will be recomputed */
+    for (i = n = 0; i < pi->nb_dirty; i++) {
+        if (pi->dirty[i] < page_index)
+            pi->dirty[n++] = pi->dirty[i];
+    }
+    pi->nb_dirty = n;
+    /* pages have moved: drop their checkpoints */
+    for (i = 0; i < PAGE_INDEX_CHECKPOINTS; i++) {
+        if (pi->checkpoints[i].page_index >= page_index)
+            memset(&pi->checkpoints[i], 0, sizeof(PageCheckpoint));
+    }
+}
+
+/* the size of page p was changed by delta */
+static inline void eb_index_resize(EditBuffer *b, Page *p, int delta)
+{
+    PageIndex *pi = &b->page_index;
+
+    page_tree_add(pi->size_tree, pi->nb_size, p - b->page_table, delta);
+}
+
+/* page p contents changed: its line and char counts are stale */
+static void eb_index_touch(EditBuffer *b, Page *p)
+{
+    PageIndex *pi = &b->page_index;
+    int i, page_index = p - b->page_table;
+    PageCheckpoint *cp = &pi->checkpoints[page_index % PAGE_INDEX_CHECKPOINTS];
+
+    if (cp->page_index == page_index)
+        memset(cp, 0, sizeof(*cp));
+
+    if (page_index >= pi->nb_pos && page_index >= pi->nb_char)
+        return;
+
+    if (pi->nb_dirty > 0 && pi->dirty[pi->nb_dirty - 1] == page_index)
+        return;
+
+    if (pi->nb_dirty >= PAGE_INDEX_DIRTY) {
+        /* too many modified pages: recompute from the first one */
+        for (i = 0; i < pi->nb_dirty; i++)
+            page_index = min(page_index, pi->dirty[i]);
+        pi->nb_pos = min(pi->nb_pos, page_index);
+        pi->nb_char = min(pi->nb_char, page_index);
+        pi->nb_dirty = 0;
+        return;
+    }
+    pi->dirty[pi->nb_dirty++] = page_index;
+}
+
+/* make sure the nb_lines and col fields of page p are up to date */
+static void eb_page_pos(EditBuffer *b, Page *p)
+{
+    PageIndex *pi = &b->page_index;
+    int nb_lines, col, page_index;
+
+    if (!(p->flags & PG_VALID_POS)) {
+        nb_lines = p->nb_lines;
+        col = p->col;
+        p->flags |= PG_VALID_POS;
+        page_get_pos(b, p, 0, p->size, &p->nb_lines, &p->col);
+        page_index = p - b->page_table;
+        if (page_index < pi->nb_pos) {
+            page_tree_add(pi->lines_tree, pi->nb_pos, page_index,
+                          p->nb_lines - nb_lines);
+            page_tree_add(pi->col_tree, pi->nb_pos, page_index,
+                          p->col - col);
+        }
+    }
+}
+
+/* make sure the nb_chars field of page p is up to date */
+static void eb_page_chars(EditBuffer *b, Page *p)
+{
+    PageIndex *pi = &b->page_index;
+    int nb_chars, page_index;
+
+    if (!(p->flags & PG_VALID_CHAR)) {
+        nb_chars = p->nb_chars;
+        p->flags |= PG_VALID_CHAR;
+        p->nb_chars = page_get_chars(b, p, p->size);
+        page_index = p - b->page_table;
+        if (page_index < pi->nb_char) {
+            page_tree_add(pi->chars_tree, pi->nb_char, page_index,
+                          p->nb_chars - nb_chars);
+        }
+    }
+}
+
+/* remove dirty entries for pages whose counts are up to date */
+static void eb_index_clean(EditBuffer *b)
+{
+    PageIndex *pi = &b->page_index;
+    int i, n, flags;
+
+    for (i = n = 0; i < pi->nb_dirty; i++) {
+        flags = b->page_table[pi->dirty[i]].flags;
+        if ((pi->dirty[i] < pi->nb_pos && !(flags & PG_VALID_POS))
+        ||  (pi->dirty[i] < pi->nb_char && !(flags & PG_VALID_CHAR))) {
+            pi->dirty[n++] = pi->dirty[i];
+        }
+    }
+    pi->nb_dirty = n;
+}
+
+/* bring the size tree up to date, return -1 if not available */
+static int eb_index_sizes(EditBuffer *b)
+{
+    PageIndex *pi = &b->page_index;
+    int j;
+
+    if (pi->nb_size < b->nb_pages) {
+        if (eb_index_alloc(b))
+            return -1;
+        for (j = pi->nb_size + 1; j <= b->nb_pages; j++)
+            page_tree_set(pi->size_tree, j, b->page_table[j - 1].size);
+    }
+    pi->nb_size = b->nb_pages;
+    return 0;
+}
+
+/* bring the size, line and column trees up to date */
+static int eb_index_pos(EditBuffer *b)
+{
+    PageIndex *pi = &b->page_index;
+    Page *p;
+    int i, j;
+
+    if (eb_index_sizes(b))
+        return -1;
+    for (i = 0; i < pi->nb_dirty; i++)
+        eb_page_pos(b, b->page_table + pi->dirty[i]);
+    for (j = pi->nb_pos + 1; j <= b->nb_pages; j++) {
+        p = b->page_table + j - 1;
+        eb_page_pos(b, p);
+        page_tree_set(pi->lines_tree, j, p->nb_lines);
+        page_tree_set(pi->col_tree, j, p->col);
+    }
+    pi->nb_pos = b->nb_pages;
+    eb_index_clean(b);
+    return 0;
+}
+
+/* bring the size and char trees up to date */
+static int eb_index_chars(EditBuffer *b)
+{
+    PageIndex *pi = &b->page_index;
+    Page *p;
+    int i, j;
+
+    if (eb_index_sizes(b))
+        return -1;
+    for (i = 0; i < pi->nb_dirty; i++)
+        eb_page_chars(b, b->page_table + pi->dirty[i]);
+    for (j = pi->nb_char + 1; j <= b->nb_pages; j++) {
+        p = b->page_table + j - 1;
+        eb_page_chars(b, p);
+        page_tree_set(pi->chars_tree, j, p->nb_chars);
+    }
+    pi->nb_char = b->nb_pages;
+    eb_index_clean(b);
+    return 0;
+}
 
 /************************************************************/
 /* basic access to the edit buffer */
 
 /* find a page at a given offset */
-static inline Page *find_page(EditBuffer *b, int offset, int *page_offset_ptr)
+static inline Page *find_page(EditBuffer *b, QEOffset offset,
+                              QEOffset *page_offset_ptr)
 {
-    Page *p = b->page_table;
-    int page_offset = offset;
+    Page *p;
+    QEOffset page_offset;
 
     if (b->cur_page && offset >= b->cur_offset) {
         p = b->cur_page;
-        page_offset -= b->cur_offset;
+        page_offset = offset - b->cur_offset;
         if (page_offset < p->size) {
             *page_offset_ptr = page_offset;
             return p;
         }
+        /* sequential access: try the next page */
+        if (p + 1 < b->page_table + b->nb_pages
+        &&  page_offset - p->size < p[1].size) {
+            page_offset -= p->size;
+            p++;
+            goto found;
+        }
     }
-    while (page_offset >= p->size) {
-        page_offset -= p->size;
-        p++;
+    if (!eb_index_sizes(b)) {
+        p = b->page_table + page_tree_find(b->page_index.size_tree,
+                                           b->nb_pages, offset, &page_offset);
+    } else {
+        p = b->page_table;
+        page_offset = offset;
+        while (page_offset >= p->size) {
+            page_offset -= p->size;
+            p++;
+        }
     }
+ found:
     *page_offset_ptr = page_offset;
     b->cur_offset = offset - page_offset;
     b->cur_page = p;
     return p;
 }
 
-/* prepare a page to be written */
-static void update_page(Page *p)
+/* prepare a page to be written.  Return 0 if OK or -1 if a read only
+ * page cannot be copied for lack of memory.
+ */
+static int update_page(EditBuffer *b, Page *p)
 {
     u8 *buf;
+    int alloc;
 
     /* if the page is read only, copy it */
     if (p->flags & PG_READ_ONLY) {
-        buf = qe_malloc_dup(p->data, p->size);
-        /* XXX: should return an error */
+        alloc = p->size;
+        buf = page_alloc(b, &alloc);
         if (!buf)
-            return;
+            return -1;
+        memcpy(buf, p->data, p->size);
+        page_free(b, p);
         p->data = buf;
+        p->gap = p->size;
+        p->gap_size = alloc - p->size;
         p->flags &= ~PG_READ_ONLY;
     }
     p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+    eb_index_touch(b, p);
+    return 0;
 }
 
 /* Read one raw byte from the buffer:
  * We should have: 0 <= offset < b->total_size
  * Returns the byte or -1 upon failure.
  */
-int eb_read_one_byte(EditBuffer *b, int offset)
+int eb_read_one_byte(EditBuffer *b, QEOffset offset)
 {
     const Page *p;
 
@@ -84,36 +746,41 @@ int eb_read_one_byte(EditBuffer *b, int offset)
         return -1;
 
     p = find_page(b, offset, &offset);
+    if (offset >= p->gap)
+        offset += p->gap_size;
     return p->data[offset];
 }
 
 /* Read raw data from the buffer:
  * We should have: 0 <= offset < b->total_size, size >= 0
  */
-int eb_read(EditBuffer *b, int offset, void *buf, int size)
+int eb_read(EditBuffer *b, QEOffset offset, void *buf, int size)
 {
     int len, remain;
     const Page *p;
+    const u8 *ptr;
 
     /* We carefully clip the request, avoiding integer overflow */
     if (offset < 0 || size <= 0 || offset >= b->total_size)
         return 0;
 
-    len = b->total_size - offset;
-    if (size > len)
-        size = len;
+    if (size > b->total_size - offset)
+        size = b->total_size - offset;
 
     p = find_page(b, offset, &offset);
     for (remain = size;;) {
-        len = p->size - offset;
+        ptr = page_ptr(p, offset, &len);
         if (len > remain)
             len = remain;
-        memcpy(buf, p->data + offset, len);
+        memcpy(buf, ptr, len);
         if ((remain -= len) <= 0)
             break;
         buf = (u8*)buf + len;
-        p++;
-        offset = 0;
+        offset += len;
+        if (offset >= p->size) {
+            p++;
+            offset = 0;
+        }
     }
     return size;
 }
@@ -122,10 +789,12 @@ int eb_read(EditBuffer *b, int offset, void *buf, int size)
  * We should have 0 <= offset <= b->total_size, size >= 0.
  * Note: eb_write can be used to append data at the end of the buffer
  */
-int eb_write(EditBuffer *b, int offset, const void *buf, int size)
+int eb_write(EditBuffer *b, QEOffset offset, const void *buf, int size)
 {
-    int len, remain, write_size, page_offset;
+    QEOffset len, page_offset;
+    int remain, write_size, n, was_modified;
     Page *p;
+    u8 *ptr;
 
     if (b->flags & BF_READONLY)
         return 0;
@@ -140,20 +809,35 @@ int eb_write(EditBuffer *b, int offset, const void *buf, int size)
         write_size = len;
 
     if (write_size > 0) {
+        was_modified = b->modified;
         eb_addlog(b, LOGOP_WRITE, offset, write_size);
 
+        /* copy the read only pages first, logging may have shared
+           more pages */
+        p = find_page(b, offset, &page_offset);
+        for (remain = write_size + page_offset; remain > 0; p++) {
+            if (update_page(b, p)) {
+                eb_log_cancel(b, LOGOP_WRITE, offset, write_size,
+                              was_modified);
+                return 0;
+            }
+            remain -= p->size;
+        }
+
         p = find_page(b, offset, &page_offset);
         for (remain = write_size;;) {
-            len = p->size - page_offset;
-            if (len > remain)
-                len = remain;
-            update_page(p);
-            memcpy(p->data + page_offset, buf, len);
-            buf = (const u8*)buf + len;
-            if ((remain -= len) <= 0)
+            ptr = page_ptr(p, page_offset, &n);
+            if (n > remain)
+                n = remain;
+            memcpy(ptr, buf, n);
+            buf = (const u8*)buf + n;
+            if ((remain -= n) <= 0)
                 break;
-            p++;
-            page_offset = 0;
+            page_offset += n;
+            if (page_offset >= p->size) {
+                p++;
+                page_offset = 0;
+            }
         }
     }
     if (size > write_size)
@@ -161,146 +845,343 @@ int eb_write(EditBuffer *b, int offset, const void *buf, int size)
     return size;
 }
 
+/* delete size bytes at offset, the pages deleted from must be
+ * writable or the deletion must be at either end of read only pages.
+ */
+static void eb_delete_lowlevel(EditBuffer *b, QEOffset offset,
+                               QEOffset size)
+{
+    int n, len;
+    Page *del_start, *p;
+
+    if (size <= 0)
+        return;
+
+    b->total_size -= size;
+
+    /* find the correct page */
+    p = find_page(b, offset, &offset);
+    n = 0;
+    del_start = NULL;
+    while (size > 0) {
+        len = p->size - offset;
+        if (len > size)
+            len = size;
+        if (len == p->size) {
+            if (!del_start)
+                del_start = p;
+            /* read only pages are not freed */
+            page_free(b, p);
+            p++;
+            offset = 0;
+            n++;
+        } else {
+            if ((p->flags & PG_READ_ONLY)
+            &&  (offset == 0 || offset + len == p->size)) {
+                /* trim read only data without copying the page */
+                if (offset == 0)
+                    p->data += len;
+                p->size -= len;
+                p->gap = p->size;
+                p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+                eb_index_touch(b, p);
+            } else {
+                /* cannot fail: the page is not read only */
+                update_page(b, p);
+                page_delete(p, offset, len);
+            }
+            eb_index_resize(b, p, -len);
+            offset += len;
+            /* XXX: should merge with adjacent pages if size becomes small? */
+            if (offset >= p->size) {
+                p++;
+                offset = 0;
+            }
+        }
+        size -= len;
+    }
+
+    /* now delete the requested pages */
+    if (n > 0) {
+        b->nb_pages -= n;
+        eb_index_invalidate(b, del_start - b->page_table);
+        memmove(del_start, del_start + n,
+                (b->page_table + b->nb_pages - del_start) * sizeof(Page));
+        if (b->page_table_size > 64 && b->nb_pages < b->page_table_size / 4) {
+            /* shrink the page table */
+            if (qe_realloc(&b->page_table,
+                           b->page_table_size / 2 * sizeof(Page))) {
+                b->page_table_size /= 2;
+            }
+        }
+    }
+
+    /* the page cache is no longer valid */
+    b->cur_page = NULL;
+}
+
 /* internal function for insertion : 'buf' of size 'size' at the
-   beginning of the page at page_index */
-static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
+   beginning of the page at page_index.  Return the number of bytes
+   inserted, less than size if out of memory: the last bytes of buf
+   may then have been inserted without the first ones. */
+static int eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
 {
-    int len, n;
+    int len, n, i, alloc, inserted;
     Page *p;
+    u8 *data;
 
+    inserted = 0;
     if (page_index < b->nb_pages) {
         p = &b->page_table[page_index];
         len = MAX_PAGE_SIZE - p->size;
         if (len > size)
             len = size;
-        if (len > 0) {
-            update_page(p);
-            /* CG: probably faster with qe_malloc + qe_free */
-            qe_realloc(&p->data, p->size + len);
-            memmove(p->data + len, p->data, p->size);
-            memcpy(p->data, buf + size - len, len);
+        /* if out of memory, all the data goes to new pages */
+        if (len > 0 && !update_page(b, p)
+        &&  !page_insert(b, p, 0, buf + size - len, len)) {
             size -= len;
-            p->size += len;
+            inserted += len;
+            eb_index_resize(b, p, len);
         }
     }
 
     /* now add new pages if necessary */
     n = (size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
     if (n > 0) {
-        b->nb_pages += n;
-        qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
-        p = &b->page_table[page_index];
-        memmove(p + n, p, sizeof(Page) * (b->nb_pages - n - page_index));
-        while (size > 0) {
+        p = eb_alloc_pages(b, page_index, n);
+        if (!p)
+            return inserted;
+        eb_index_invalidate(b, page_index);
+        for (i = 0; size > 0; i++) {
             len = size;
             if (len > MAX_PAGE_SIZE)
                 len = MAX_PAGE_SIZE;
+            alloc = len;
+            data = page_alloc(b, &alloc);
+            if (!data) {
+                /* remove the page table entries left unused */
+                memmove(p, p + n - i, (b->page_table + b->nb_pages -
+                                       (p + n - i)) * sizeof(Page));
+                b->nb_pages -= n - i;
+                break;
+            }
             p->size = len;
-            p->data = qe_malloc_dup(buf, len);
+            p->data = data;
+            memcpy(p->data, buf, len);
             p->flags = 0;
+            p->gap = len;
+            p->gap_size = alloc - len;
+            p->shared = NULL;
             buf += len;
             size -= len;
+            inserted += len;
             p++;
         }
     }
+    return inserted;
 }
 
-/* We must have : 0 <= offset <= b->total_size */
-static void eb_insert_lowlevel(EditBuffer *b, int offset,
-                               const u8 *buf, int size)
+/* We must have : 0 <= offset <= b->total_size.
+ * Return the number of bytes inserted at offset, less than size if
+ * out of memory.
+ */
+static int eb_insert_lowlevel(EditBuffer *b, QEOffset offset,
+                              const u8 *buf, int size)
 {
-    int len, len_out, page_index;
+    int len, n, page_index, inserted;
+    QEOffset page_start;
     Page *p;
 
-    b->total_size += size;
+    inserted = 0;
 
     /* find the correct page */
-    p = b->page_table;
     if (offset > 0) {
         offset--;
         p = find_page(b, offset, &offset);
         offset++;
-    retry:
-        /* compute what we can insert in current page */
-        len = MAX_PAGE_SIZE - offset;
-        if (len > size)
-            len = size;
-        /* number of bytes to put in next pages */
-        len_out = p->size + len - MAX_PAGE_SIZE;
+        page_start = b->cur_offset;
         page_index = p - b->page_table;
-        if (len_out > 0) {
-#if 1
-            /* First try and shift some of these bytes to the previous pages */
-            if (page_index > 0 && p[-1].size < MAX_PAGE_SIZE) {
-                int chunk;
-                update_page(p - 1);
-                update_page(p);
-                chunk = min(MAX_PAGE_SIZE - p[-1].size, offset);
-                qe_realloc(&p[-1].data, p[-1].size + chunk);
-                memcpy(p[-1].data + p[-1].size, p->data, chunk);
-                p[-1].size += chunk;
-                p->size -= chunk;
-                if (p->size == 0) {
-                    /* if page was completely fused with previous one */
-                    b->nb_pages -= 1;
-                    qe_free(&p->data);
-                    memmove(p, p + 1,
-                            (b->nb_pages - page_index) * sizeof(Page));
-                    qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
-                    p = b->page_table + page_index - 1;
-                    offset = p->size;
-                    goto retry;
-                }
-                memmove(p->data, p->data + chunk, p->size);
-                qe_realloc(&p->data, p->size);
-                offset -= chunk;
-                if (offset == 0 && p[-1].size < MAX_PAGE_SIZE) {
-                    /* restart from previous page */
-                    p--;
-                    offset = p->size;
-                }
-                goto retry;
+        if (p->size + size > MAX_PAGE_SIZE && offset < p->size) {
+            /* split the page: move the bytes after the insertion point
+             * to the next page, they are contiguous once the gap is
+             * at offset.
+             */
+            len = p->size - offset;
+            if (update_page(b, p))
+                goto done;
+            page_move_gap(p, offset);
+            n = eb_insert1(b, page_index + 1, p->data + offset + p->gap_size,
+                           len);
+            /* reload p because page_table may have been reallocated */
+            p = b->page_table + page_index;
+            if (n < len) {
+                /* remove the bytes already copied */
+                b->total_size += n;
+                b->cur_page = NULL;
+                eb_delete_lowlevel(b, page_start + p->size, n);
+                goto done;
             }
-#endif
-            eb_insert1(b, page_index + 1,
-                       p->data + p->size - len_out, len_out);
-        } else {
-            len_out = 0;
+            page_delete(p, offset, len);
+            eb_index_resize(b, p, -len);
         }
         /* now we can insert in current page */
+        len = min(MAX_PAGE_SIZE - p->size, size);
         if (len > 0) {
-            /* reload p because page_table may have been reallocated */
-            p = b->page_table + page_index;
-            update_page(p);
-            p->size += len - len_out;
-            qe_realloc(&p->data, p->size);
-            memmove(p->data + offset + len,
-                    p->data + offset, p->size - (offset + len));
-            memcpy(p->data + offset, buf, len);
+            if (update_page(b, p) || page_insert(b, p, offset, buf, len))
+                goto done;
+            eb_index_resize(b, p, len);
             buf += len;
             size -= len;
+            inserted += len;
         }
     } else {
         page_index = -1;
     }
     /* insert the remaining data in the next pages */
     if (size > 0)
-        eb_insert1(b, page_index + 1, buf, size);
+        inserted += eb_insert1(b, page_index + 1, buf, size);
 
+ done:
+    b->total_size += inserted;
     /* the page cache is no longer valid */
     b->cur_page = NULL;
+    return inserted;
+}
+
+/* make page p of buffer b shareable: hand its slab block over to a
+ * reference counted owner unless it is already read only.
+ * Return the shared block or NULL if out of memory.
+ */
+static PageShared *page_share(EditBuffer *b, Page *p)
+{
+    PageSlab *slab = &b->page_slab;
+    PageShared *ps;
+    int i;
+
+    if (!(p->flags & PG_READ_ONLY)) {
+        ps = qe_mallocz(PageShared);
+        if (!ps)
+            return NULL;
+        ps->ref_count = 1;
+        ps->chunk = page_slab_chunk(slab, p->data);
+        ps->chunk->nb_shared++;
+        ps->block = p->data;
+        ps->block_size = p->size + p->gap_size;
+        i = page_slab_class(ps->block_size);
+        slab->nb_used[i]--;
+        slab->nb_shared[i]++;
+        /* move the gap to the end of the block */
+        page_move_gap(p, p->size);
+        p->gap_size = 0;
+        p->shared = ps;
+        p->flags |= PG_READ_ONLY;
+    }
+    return p->shared;
+}
+
+/* split the pages of b so that offset is at the start of a page,
+ * return the index of this page or -1 if out of memory.
+ */
+static int eb_split_page(EditBuffer *b, QEOffset offset)
+{
+    Page *p, *q;
+    QEOffset page_offset;
+    int page_index, len, alloc;
+    u8 *data;
+
+    if (offset >= b->total_size)
+        return b->nb_pages;
+
+    p = find_page(b, offset, &page_offset);
+    page_index = p - b->page_table;
+    if (page_offset == 0)
+        return page_index;
+
+    len = p->size - page_offset;
+    alloc = len;
+    data = NULL;
+    if (!(p->flags & PG_READ_ONLY)) {
+        data = page_alloc(b, &alloc);
+        if (!data)
+            return -1;
+        memcpy(data, page_range(p, page_offset, len), len);
+    }
+    q = eb_alloc_pages(b, page_index + 1, 1);
+    if (!q) {
+        if (data)
+            page_slab_free(b, data, alloc);
+        return -1;
+    }
+    p = q - 1;
+    q->size = len;
+    q->gap = len;
+    if (data) {
+        q->data = data;
+        q->gap_size = alloc - len;
+        q->flags = 0;
+        q->shared = NULL;
+        page_delete(p, page_offset, len);
+    } else {
+        /* both halves reference the same data */
+        q->data = p->data + page_offset;
+        q->gap_size = 0;
+        q->flags = PG_READ_ONLY;
+        q->shared = p->shared;
+        if (q->shared)
+            q->shared->ref_count++;
+        p->size = page_offset;
+        p->gap = page_offset;
+    }
+    p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+    eb_index_invalidate(b, page_index);
+    b->cur_page = NULL;
+    return page_index + 1;
+}
+
+/* insert page p of buffer src at offset in b, sharing its data.
+ * Return 0 if successful or -1 if the data must be copied.
+ */
+static int eb_insert_shared_page(EditBuffer *b, QEOffset offset,
+                                 EditBuffer *src, Page *p)
+{
+    PageShared *ps;
+    int page_index;
+    Page *q;
+
+    ps = page_share(src, p);
+    if (!ps)
+        return -1;
+    page_index = eb_split_page(b, offset);
+    if (page_index < 0)
+        return -1;
+    q = eb_alloc_pages(b, page_index, 1);
+    if (!q)
+        return -1;
+    *q = *p;
+    ps->ref_count++;
+    /* line and char counts depend on the buffer charset */
+    if (b->charset != src->charset || b->eol_type != src->eol_type)
+        q->flags &= ~(PG_VALID_POS | PG_VALID_CHAR);
+    q->flags &= ~PG_VALID_COLORS;
+    b->total_size += q->size;
+    eb_index_invalidate(b, page_index);
+    b->cur_page = NULL;
+    return 0;
 }
 
 /* Insert 'size' bytes of 'src' buffer from position 'src_offset' into
  * buffer 'dest' at offset 'dest_offset'. 'src' MUST BE DIFFERENT from
  * 'dest'. Raw insertion performed, encoding is ignored.
+ * Complete source pages are shared between both buffers.
  */
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size)
+QEOffset eb_insert_buffer(EditBuffer *dest, QEOffset dest_offset,
+                          EditBuffer *src, QEOffset src_offset,
+                          QEOffset size)
 {
     Page *p;
-    int len, size0;
+    QEOffset size0, offset0;
+    int len, n, was_modified;
+    const u8 *ptr;
 
     if (dest->flags & BF_READONLY)
         return 0;
@@ -319,125 +1200,47 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
         return 0;
 
     size0 = size;
+    offset0 = dest_offset;
+    was_modified = dest->modified;
 
     eb_addlog(dest, LOGOP_INSERT, dest_offset, size);
-#if 1
-    /* Much simpler algorithm with fewer pathological cases */
-    p = find_page(src, src_offset, &src_offset);
-    while (size > 0) {
-        len = p->size - src_offset;
-        if (len > size)
-            len = size;
-        if ((p->flags & PG_READ_ONLY) && src_offset == 0 && len == MAX_PAGE_SIZE) {
-            /* XXX: should share complete read-only pages.  This is
-             * actually a little tricky: the mapping may be removed
-             * upon buffer close. We need a ref count scheme to keep
-             * track of these pages.
-             * A brute force approach may prove best: upon unmapping a
-             * file, scan all buffers for shared pages and delay
-             * unmapping until these get freed.  We may keep a global
-             * and a buffer based count of shared pages and a list of
-             * mappings to accelerate this phase.
-             */
-        }
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
-        dest_offset += len;
-        src_offset = 0;
-        p++;
-        size -= len;
-    }
-    return size0;
-#else
-    Page *p_start, *q;
-    int n, page_index;
 
-    /* insert the data from the first page if it is not completely
-       selected */
     p = find_page(src, src_offset, &src_offset);
-    if (src_offset > 0 /* || size <= p->size */ ) {
-        len = p->size - src_offset;
-        if (len > size)
-            len = size;
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
-        dest_offset += len;
-        size -= len;
-        p++;
-    }
-
-    if (size == 0)
-        return size0;
-
-    /* cut the page at dest offset if needed */
-    if (dest_offset < dest->total_size) {
-        q = find_page(dest, dest_offset, &dest_offset);
-        page_index = q - dest->page_table;
-        if (dest_offset > 0) {
-            page_index++;
-            eb_insert1(dest, page_index, q->data + dest_offset,
-                       q->size - dest_offset);
-            /* must reload q because page_table may have been
-               realloced */
-            q = dest->page_table + page_index - 1;
-            update_page(q);
-            qe_realloc(&q->data, dest_offset);
-            q->size = dest_offset;
-        }
-    } else {
-        page_index = dest->nb_pages;
-    }
-
-    /* update total_size */
-    dest->total_size += size;
-
-    /* compute the number of complete pages to insert */
-    p_start = p;
-    while (size > 0 && p->size <= size) {
-        size -= p->size;
-        p++;
-    }
-    n = p - p_start; /* number of pages to insert */
-    p = p_start;
-    if (n > 0) {
-        /* add the pages */
-        dest->nb_pages += n;
-        qe_realloc(&dest->page_table, dest->nb_pages * sizeof(Page));
-        q = dest->page_table + page_index;
-        memmove(q + n, q, sizeof(Page) * (dest->nb_pages - n - page_index));
-        p = p_start;
-        while (n > 0) {
+    while (size > 0) {
+        if (src_offset == 0 && p->size <= size && p->size >= PAGE_SHARE_MIN
+        &&  !eb_insert_shared_page(dest, dest_offset, src, p)) {
             len = p->size;
-            q->size = len;
-            if (p->flags & PG_READ_ONLY) {
-                /* simply copy the reference */
-                q->flags = PG_READ_ONLY;
-                q->data = p->data;
-            } else {
-                /* allocate a new page */
-                q->flags = 0;
-                q->data = qe_malloc_dup(p->data, len);
+        } else {
+            ptr = page_ptr(p, src_offset, &len);
+            if (len > size)
+                len = size;
+            n = eb_insert_lowlevel(dest, dest_offset, ptr, len);
+            if (n < len) {
+                /* out of memory: remove the text inserted so far */
+                eb_delete_lowlevel(dest, offset0, dest_offset + n - offset0);
+                eb_log_cancel(dest, LOGOP_INSERT, offset0, size0,
+                              was_modified);
+                return 0;
             }
-            n--;
+        }
+        dest_offset += len;
+        src_offset += len;
+        if (src_offset >= p->size) {
             p++;
-            q++;
+            src_offset = 0;
         }
-        page_index = q - dest->page_table;
-    }
-
-    /* insert the remaning bytes */
-    if (size > 0) {
-        eb_insert1(dest, page_index, p->data, size);
+        size -= len;
     }
-    /* the page cache is no longer valid */
-    dest->cur_page = NULL;
     return size0;
-#endif
 }
 
 /* Insert 'size' bytes from 'buf' into 'b' at offset 'offset'. We must
    have : 0 <= offset <= b->total_size */
 /* Return number of bytes inserted */
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
+int eb_insert(EditBuffer *b, QEOffset offset, const void *buf, int size)
 {
+    int n, was_modified;
+
     if (b->flags & BF_READONLY)
         return 0;
 
@@ -448,22 +1251,26 @@ int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
     if (offset < 0 || size <= 0)
         return 0;
 
+    was_modified = b->modified;
     eb_addlog(b, LOGOP_INSERT, offset, size);
 
-    eb_insert_lowlevel(b, offset, buf, size);
-
-    /* the page cache is no longer valid */
-    b->cur_page = NULL;
+    n = eb_insert_lowlevel(b, offset, buf, size);
+    if (n < size) {
+        /* out of memory: remove the partial insertion */
+        eb_delete_lowlevel(b, offset, n);
+        eb_log_cancel(b, LOGOP_INSERT, offset, size, was_modified);
+        return 0;
+    }
     return size;
 }
 
 /* We must have : 0 <= offset <= b->total_size,
  * return actual number of bytes removed.
  */
-int eb_delete(EditBuffer *b, int offset, int size)
+QEOffset eb_delete(EditBuffer *b, QEOffset offset, QEOffset size)
 {
-    int n, len, size0;
-    Page *del_start, *p;
+    QEOffset page_offset;
+    Page *p;
 
     if (b->flags & BF_READONLY)
         return 0;
@@ -474,58 +1281,19 @@ int eb_delete(EditBuffer *b, int offset, int size)
     if (size > b->total_size - offset)
         size = b->total_size - offset;
 
-    size0 = size;
+    /* text inside a read only page is deleted from a copy: make it
+       before logging as it may fail */
+    p = find_page(b, offset, &page_offset);
+    if ((p->flags & PG_READ_ONLY) && page_offset > 0
+    &&  page_offset + size < p->size && update_page(b, p)) {
+        return 0;
+    }
 
     /* dispatch callbacks before buffer update */
     eb_addlog(b, LOGOP_DELETE, offset, size);
 
-    b->total_size -= size;
-
-    /* find the correct page */
-    p = find_page(b, offset, &offset);
-    n = 0;
-    del_start = NULL;
-    while (size > 0) {
-        len = p->size - offset;
-        if (len > size)
-            len = size;
-        if (len == p->size) {
-            if (!del_start)
-                del_start = p;
-            /* we cannot free if read only */
-            if (!(p->flags & PG_READ_ONLY))
-                qe_free(&p->data);
-            p++;
-            offset = 0;
-            n++;
-        } else {
-            update_page(p);
-            memmove(p->data + offset, p->data + offset + len,
-                    p->size - offset - len);
-            p->size -= len;
-            qe_realloc(&p->data, p->size);
-            offset += len;
-            /* XXX: should merge with adjacent pages if size becomes small? */
-            if (offset >= p->size) {
-                p++;
-                offset = 0;
-            }
-        }
-        size -= len;
-    }
-
-    /* now delete the requested pages */
-    if (n > 0) {
-        b->nb_pages -= n;
-        memmove(del_start, del_start + n,
-                (b->page_table + b->nb_pages - del_start) * sizeof(Page));
-        qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
-    }
-
-    /* the page cache is no longer valid */
-    b->cur_page = NULL;
-
-    return size0;
+    eb_delete_lowlevel(b, offset, size);
+    return size;
 }
 
 /*---------------- finding buffers ----------------*/
@@ -644,7 +1412,12 @@ EditBuffer *eb_find(const char *name)
 void eb_free_log_buffer(EditBuffer *b)
 {
     eb_free(&b->log_buffer);
+    eb_free(&b->log_trans_buffer);
+    b->log_start = 0;
     b->log_new_index = 0;
+    b->log_packed_index = 0;
+    b->log_packed_size = 0;
+    b->log_unpacked_size = 0;
     b->log_current = 0;
     b->nb_logs = 0;
 }
@@ -753,6 +1526,7 @@ EditBuffer *eb_scratch(const char *name, int flags)
 
 void eb_clear(EditBuffer *b)
 {
+    eb_load_cancel(b);
     b->flags &= ~BF_READONLY;
 
     /* XXX: should just reset logging instead of disabling it */
@@ -760,6 +1534,10 @@ void eb_clear(EditBuffer *b)
     b->last_log = 0;
     eb_delete(b, 0, b->total_size);
     eb_free_log_buffer(b);
+    eb_index_free(b);
+    page_slab_release(b);
+    qe_free(&b->page_table);
+    b->page_table_size = 0;
 
 #ifdef CONFIG_MMAP
     eb_munmap_buffer(b);
@@ -800,8 +1578,10 @@ void eb_free(EditBuffer **bp)
             b->first_callback = cb->next;
             qe_free(&cb);
         }
+        qe_free(&b->offset_refs);
+        b->nb_offset_refs = b->offset_refs_size = 0;
 
-        eb_delete_properties(b, 0, INT_MAX);
+        eb_delete_properties(b, 0, QE_OFFSET_MAX);
         eb_cache_remove(b);
         eb_clear(b);
 
@@ -811,9 +1591,6 @@ void eb_free(EditBuffer **bp)
             if (b1->log_buffer == b) {
                 b1->log_buffer = NULL;
             }
-            if (b1->b_styles == b) {
-                b1->b_styles = NULL;
-            }
             if (b1 == b)
                 *pb = b1->next;
             else
@@ -875,7 +1652,8 @@ void eb_trace_bytes(const void *buf, int size, int state)
     EditState *e;
     const char *str = NULL;
     const u8 *p0, *endp, *p;
-    int c, line, col, len, point;
+    int c, line, col, len;
+    QEOffset point;
 
     if (!b || !(qs->trace_flags & state))
         return;
@@ -971,6 +1749,21 @@ int eb_add_callback(EditBuffer *b, EditBufferCallback cb,
 {
     EditBufferCallbackList *l;
 
+    if (cb == eb_offset_callback) {
+        EditBufferOffsetRef *r;
+
+        if (b->nb_offset_refs >= b->offset_refs_size) {
+            int size = b->offset_refs_size + (b->offset_refs_size >> 1) + 8;
+            if (!qe_realloc(&b->offset_refs, size * sizeof(*r)))
+                return -1;
+            b->offset_refs_size = size;
+        }
+        r = &b->offset_refs[b->nb_offset_refs++];
+        r->offset_ptr = opaque;
+        r->edge = arg;
+        return 0;
+    }
+
     l = qe_mallocz(EditBufferCallbackList);
     if (!l)
         return -1;
@@ -985,6 +1778,19 @@ int eb_add_callback(EditBuffer *b, EditBufferCallback cb,
 void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque)
 {
     EditBufferCallbackList **pl, *l;
+    int i;
+
+    if (cb == eb_offset_callback) {
+        for (i = 0; i < b->nb_offset_refs; i++) {
+            if (b->offset_refs[i].offset_ptr == opaque) {
+                memmove(b->offset_refs + i, b->offset_refs + i + 1,
+                        (b->nb_offset_refs - i - 1) * sizeof(*b->offset_refs));
+                b->nb_offset_refs--;
+                break;
+            }
+        }
+        return;
+    }
 
     for (pl = &b->first_callback; (*pl) != NULL; pl = &(*pl)->next) {
         l = *pl;
@@ -998,9 +1804,9 @@ void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque)
 
 /* standard callback to move offsets */
 void eb_offset_callback(qe__unused__ EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size)
+                        enum LogOperation op, QEOffset offset, QEOffset size)
 {
-    int *offset_ptr = opaque;
+    QEOffset *offset_ptr = opaque;
 
     switch (op) {
     case LOGOP_INSERT:
@@ -1029,9 +1835,9 @@ int eb_create_style_buffer(EditBuffer *b, int flags)
         /* XXX: should extend style width if needed */
         return 0;
     } else {
-        char name[MAX_BUFFERNAME_SIZE];
-        snprintf(name, sizeof(name), "*S<%s>", b->name);
-        b->b_styles = eb_new(name, BF_SYSTEM | BF_IS_STYLE | BF_RAW);
+        b->b_styles = qe_mallocz(EditBufferStyles);
+        if (!b->b_styles)
+            return 0;
         b->flags |= flags & BF_STYLES;
         b->style_shift = ((unsigned)(flags & BF_STYLES) / BF_STYLE1) - 1;
         b->style_bytes = 1 << b->style_shift;
@@ -1043,64 +1849,148 @@ int eb_create_style_buffer(EditBuffer *b, int flags)
 
 void eb_free_style_buffer(EditBuffer *b)
 {
-    eb_free(&b->b_styles);
+    if (b->b_styles) {
+        qe_free(&b->b_styles->runs);
+        qe_free(&b->b_styles);
+    }
     b->style_shift = b->style_bytes = 0;
     eb_free_callback(b, eb_style_callback, NULL);
 }
 
-/* XXX: should compress styles buffer with run length encoding */
+/* return the index of the style run containing char pos */
+static int style_find_run(EditBufferStyles *st, QEOffset pos)
+{
+    int lo, hi, mid;
+
+    /* styles are mostly read sequentially */
+    lo = st->last_run;
+    if (lo < st->nb_runs && st->runs[lo].start <= pos) {
+        if (lo + 1 >= st->nb_runs || pos < st->runs[lo + 1].start)
+            return lo;
+        if (lo + 2 >= st->nb_runs || pos < st->runs[lo + 2].start)
+            return st->last_run = lo + 1;
+    }
+    lo = 0;
+    hi = st->nb_runs - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) >> 1;
+        if (st->runs[mid].start <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return st->last_run = lo;
+}
+
+/* make room for n runs at index i */
+static int style_insert_runs(EditBufferStyles *st, int i, int n)
+{
+    if (st->nb_runs + n > st->runs_size) {
+        int size = st->runs_size + (st->runs_size >> 1) + n + 16;
+        if (!qe_realloc(&st->runs, size * sizeof(*st->runs)))
+            return -1;
+        st->runs_size = size;
+    }
+    memmove(st->runs + i + n, st->runs + i,
+            (st->nb_runs - i) * sizeof(*st->runs));
+    st->nb_runs += n;
+    return 0;
+}
+
+static void style_remove_runs(EditBufferStyles *st, int i, int n)
+{
+    memmove(st->runs + i, st->runs + i + n,
+            (st->nb_runs - i - n) * sizeof(*st->runs));
+    st->nb_runs -= n;
+    st->last_run = 0;
+}
+
+/* return the index of the run starting at char pos, splitting the run
+ * containing it if needed.
+ */
+static int style_split(EditBufferStyles *st, QEOffset pos)
+{
+    int i;
+
+    if (pos >= st->total)
+        return st->nb_runs;
+    i = style_find_run(st, pos);
+    if (st->runs[i].start == pos)
+        return i;
+    if (style_insert_runs(st, i + 1, 1))
+        return -1;
+    st->runs[i + 1].start = pos;
+    st->runs[i + 1].style = st->runs[i].style;
+    return i + 1;
+}
+
+/* merge run i with its neighbours if they have the same style */
+static void style_merge(EditBufferStyles *st, int i)
+{
+    if (i >= 0 && i + 1 < st->nb_runs
+    &&  st->runs[i].style == st->runs[i + 1].style) {
+        style_remove_runs(st, i + 1, 1);
+    }
+    if (i > 0 && i < st->nb_runs
+    &&  st->runs[i - 1].style == st->runs[i].style) {
+        style_remove_runs(st, i, 1);
+    }
+}
+
 void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
-                  int offset, int size)
-{
-    union {
-        uint64_t buf8[256 / 8];
-        uint32_t buf4[256 / 4];
-        uint16_t buf2[256 / 2];
-        unsigned char buf[256];
-        QETermStyle align;
-    } s;
-    int i, len;
+                  QEOffset offset, QEOffset size)
+{
+    EditBufferStyles *st = b->b_styles;
+    QEOffset pos;
+    int i, j, k;
 
-    if (!b->b_styles || !size)
+    if (!st || !size)
         return;
 
-    offset = (offset >> b->char_shift) << b->style_shift;
-    size = (size >> b->char_shift) << b->style_shift;
+    pos = min_offset(offset >> b->char_shift, st->total);
+    size = size >> b->char_shift;
+    if (size <= 0)
+        return;
+    if (b->style_shift < 3) {
+        /* keep the bits stored by the style width of the buffer */
+        style &= (QETermStyle)(((uint64_t)1 << (8 << b->style_shift)) - 1);
+    }
 
     switch (op) {
-    case LOGOP_WRITE:
     case LOGOP_INSERT:
-        /* XXX: should use a single loop to initialize buf */
-        /* XXX: should initialize buf just once */
-        while (size > 0) {
-            len = min(size, ssizeof(s.buf));
-            if (b->style_shift == 3) {
-                for (i = 0; i < len >> 3; i++) {
-                    s.buf8[i] = style;
-                }
-            } else
-            if (b->style_shift == 2) {
-                for (i = 0; i < len >> 2; i++) {
-                    s.buf4[i] = style;
-                }
-            } else
-            if (b->style_shift == 1) {
-                for (i = 0; i < len >> 1; i++) {
-                    s.buf2[i] = style;
-                }
-            } else {
-                memset(s.buf, style, len);
-            }
-            if (op == LOGOP_WRITE)
-                eb_write(b->b_styles, offset, s.buf, len);
-            else
-                eb_insert(b->b_styles, offset, s.buf, len);
-            size -= len;
-            offset += len;
+        i = style_split(st, pos);
+        if (i < 0 || style_insert_runs(st, i, 1))
+            return;
+        st->runs[i].start = pos;
+        st->runs[i].style = style;
+        for (k = i + 1; k < st->nb_runs; k++) {
+            st->runs[k].start += size;
         }
+        st->total += size;
+        style_merge(st, i);
         break;
+    case LOGOP_WRITE:
     case LOGOP_DELETE:
-        eb_delete(b->b_styles, offset, size);
+        size = min_offset(size, st->total - pos);
+        if (size <= 0)
+            break;
+        i = style_split(st, pos);
+        if (i < 0)
+            return;
+        j = style_split(st, pos + size);
+        if (j < 0)
+            return;
+        if (op == LOGOP_WRITE) {
+            style_remove_runs(st, i + 1, j - i - 1);
+            st->runs[i].style = style;
+        } else {
+            style_remove_runs(st, i, j - i);
+            for (k = i; k < st->nb_runs; k++) {
+                st->runs[k].start -= size;
+            }
+            st->total -= size;
+        }
+        style_merge(st, i);
         break;
     default:
         break;
@@ -1108,7 +1998,7 @@ void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
 }
 
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size)
+                       enum LogOperation op, QEOffset offset, QEOffset size)
 {
     eb_set_style(b, b->cur_style, op, offset, size);
 }
@@ -1117,27 +2007,262 @@ void eb_style_callback(EditBuffer *b, void *opaque, int arg,
 /************************************************************/
 /* undo buffer */
 
-static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size)
+/* The log buffer is used as a ring: records are appended at
+ * log_new_index and the oldest ones are evicted by moving log_start
+ * forward when the record count or the undo-outer-limit byte budget
+ * is exceeded.  The evicted space is only removed from the log buffer
+ * when it is larger than the live records, so eviction costs O(1)
+ * amortized instead of shifting the log on each operation.
+ */
+#define LOG_COMPACT_MIN  65536
+
+/* Large deleted or overwritten data is compressed in blocks of
+ * LZ_BLOCK_MAX bytes, each preceded by its int compressed size.  A
+ * block is stored as is if it does not compress.  The last record is
+ * packed when the next one is added, once its pages are no longer
+ * shared with other buffers, such as a yank buffer or the edited buffer
+ * itself after an undo.  Payloads are only decompressed by undo and
+ * redo.
+ */
+#define LOG_PACK_MIN  65536
+
+/* size of the payload of log record lb in the log buffer */
+static inline QEOffset log_payload_size(const LogBuffer *lb)
+{
+    if (lb->op == LOGOP_INSERT)
+        return 0;
+    return lb->packed_size ? lb->packed_size : lb->size;
+}
+
+/* return true if some data in the range is shared with other pages */
+static int eb_range_is_shared(EditBuffer *b, QEOffset offset, QEOffset size)
+{
+    QEOffset page_offset;
+    Page *p;
+
+    p = find_page(b, offset, &page_offset);
+    for (size += page_offset; size > 0; size -= p->size, p++) {
+        if (p->shared && p->shared->ref_count > 1)
+            return 1;
+    }
+    return 0;
+}
+
+/* compress the payload of the last record of the log of b */
+static void eb_log_pack(EditBuffer *b)
 {
-    int was_modified, len, size_trailer;
+    EditBuffer *log = b->log_buffer;
+    QEOffset rec_index, index, pos, packed, size_trailer;
     LogBuffer lb;
-    EditBufferCallbackList *l;
+    u8 *in, *out;
+    const u8 *data;
+    int len, clen;
 
-    /* callbacks and logging disabled for composite undo phase */
-    if (b->save_log & 2)
+    if (b->log_new_index - b->log_start < (QEOffset)(sizeof(lb) + sizeof(QEOffset)))
+        return;
+    eb_read(log, b->log_new_index - sizeof(QEOffset), &size_trailer,
+            sizeof(QEOffset));
+    rec_index = b->log_new_index - sizeof(QEOffset) - size_trailer - sizeof(lb);
+    if (rec_index < b->log_packed_index)
+        return;
+    /* only try each record once */
+    b->log_packed_index = b->log_new_index;
+    eb_read(log, rec_index, &lb, sizeof(lb));
+    index = rec_index + sizeof(lb);
+    if (lb.op == LOGOP_INSERT || lb.packed_size
+    ||  lb.size < LOG_PACK_MIN || lb.size > INT_MAX / 2
+    ||  eb_range_is_shared(log, index, lb.size))
         return;
 
-    /* call each callback */
+    in = qe_malloc_array(u8, LZ_BLOCK_MAX);
+    out = qe_malloc_array(u8, LZ_BLOCK_MAX);
+    if (!in || !out)
+        goto done;
+
+    /* write the packed blocks after the record, then remove the raw
+     * payload and the trailer.
+     */
+    packed = 0;
+    for (pos = 0; pos < lb.size; pos += len) {
+        len = min_offset(lb.size - pos, LZ_BLOCK_MAX);
+        eb_read(log, index + pos, in, len);
+        clen = lz_compress(out, len - 1, in, len);
+        data = out;
+        if (clen < 0) {
+            clen = len;
+            data = in;
+        }
+        eb_write(log, b->log_new_index + packed, &clen, sizeof(clen));
+        eb_write(log, b->log_new_index + packed + sizeof(clen), data, clen);
+        packed += sizeof(clen) + clen;
+        if (packed >= lb.size - lb.size / 8)
+            break;
+    }
+    if (packed >= lb.size - lb.size / 8) {
+        /* not worth it */
+        eb_delete(log, b->log_new_index, packed);
+        goto done;
+    }
+    eb_delete(log, index, lb.size + sizeof(QEOffset));
+    size_trailer = packed;
+    eb_write(log, index + packed, &size_trailer, sizeof(QEOffset));
+    lb.packed_size = packed;
+    eb_write(log, rec_index, &lb, sizeof(lb));
+    b->log_new_index = b->log_packed_index = index + packed + sizeof(QEOffset);
+    /* redo may have left the current position after the last record */
+    if (b->log_current > rec_index + 1)
+        b->log_current = b->log_new_index + 1;
+    b->log_packed_size += packed;
+    b->log_unpacked_size += lb.size;
+ done:
+    qe_free(&in);
+    qe_free(&out);
+}
+
+/* get the payload of log record lb found at *indexp: return the
+ * buffer holding it at *indexp, the log buffer itself or a temporary
+ * buffer for packed payloads, or NULL if the payload cannot be
+ * unpacked.  Release it with eb_log_free_payload().
+ */
+static EditBuffer *eb_log_get_payload(EditBuffer *b, QEOffset *indexp,
+                                      const LogBuffer *lb)
+{
+    EditBuffer *log = b->log_buffer;
+    EditBuffer *b1;
+    QEOffset pos, log_index;
+    u8 *in, *out;
+    int len, clen;
+
+    if (!lb->packed_size)
+        return log;
+
+    log_index = *indexp;
+    in = qe_malloc_array(u8, LZ_BLOCK_MAX);
+    out = qe_malloc_array(u8, LZ_BLOCK_MAX);
+    b1 = eb_new("*unpack*", BF_SYSTEM | BF_RAW);
+    if (!in || !out || !b1)
+        goto fail;
+
+    for (pos = 0; pos < lb->size; pos += len) {
+        len = min_offset(lb->size - pos, LZ_BLOCK_MAX);
+        clen = 0;
+        eb_read(log, log_index, &clen, sizeof(clen));
+        log_index += sizeof(clen);
+        if (clen <= 0 || clen > len)
+            goto fail;
+        eb_read(log, log_index, in, clen);
+        log_index += clen;
+        if (clen == len) {
+            eb_insert(b1, pos, in, len);
+        } else {
+            if (lz_decompress(out, len, in, clen) != len)
+                goto fail;
+            eb_insert(b1, pos, out, len);
+        }
+    }
+    if (b1->total_size != lb->size)
+        goto fail;
+    qe_free(&in);
+    qe_free(&out);
+    *indexp = 0;
+    return b1;
+
+ fail:
+    eb_free(&b1);
+    qe_free(&in);
+    qe_free(&out);
+    return NULL;
+}
+
+static void eb_log_free_payload(EditBuffer *b, EditBuffer **payloadp)
+{
+    if (*payloadp != b->log_buffer)
+        eb_free(payloadp);
+    *payloadp = NULL;
+}
+
+/* insert the payload of log record lb found at log_index in b at offset,
+ * return the number of bytes inserted or -1 if the payload cannot be
+ * unpacked, in which case b is left unchanged.
+ */
+static QEOffset eb_log_insert_payload(EditBuffer *b, QEOffset offset,
+                                      QEOffset log_index, const LogBuffer *lb)
+{
+    EditBuffer *payload;
+    QEOffset ret;
+
+    payload = eb_log_get_payload(b, &log_index, lb);
+    if (!payload)
+        return -1;
+    ret = eb_insert_buffer(b, offset, payload, log_index, lb->size);
+    eb_log_free_payload(b, &payload);
+    return ret;
+}
+
+/* evict the oldest record of the log of b */
+static void eb_log_evict(EditBuffer *b)
+{
+    QEOffset len;
+    LogBuffer lb;
+
+    /* XXX: should check undo record integrity */
+    eb_read(b->log_buffer, b->log_start, &lb, sizeof(lb));
+    len = log_payload_size(&lb) + sizeof(LogBuffer) + sizeof(QEOffset);
+    if (lb.packed_size) {
+        b->log_packed_size -= lb.packed_size;
+        b->log_unpacked_size -= lb.size;
+    }
+    b->log_start += len;
+    /* stop undo sequence at the oldest remaining record */
+    if (b->log_current && b->log_current - 1 < b->log_start)
+        b->log_current = b->log_start + 1;
+    b->nb_logs--;
+}
+
+/* remove the evicted records from the log buffer */
+static void eb_log_compact(EditBuffer *b)
+{
+    QEOffset len = b->log_start;
+
+    eb_delete(b->log_buffer, 0, len);
+    b->log_start = 0;
+    b->log_new_index -= len;
+    b->log_packed_index = max_offset(b->log_packed_index - len, 0);
+    if (b->log_current)
+        b->log_current -= len;
+}
+
+/* call the modification callbacks of b */
+static void eb_notify(EditBuffer *b, enum LogOperation op,
+                      QEOffset offset, QEOffset size)
+{
+    EditBufferCallbackList *l;
+    EditBufferOffsetRef *r, *r_end;
+
+    /* only the offsets after the edit move, writes do not move any */
+    if (op != LOGOP_WRITE) {
+        r_end = b->offset_refs + b->nb_offset_refs;
+        for (r = b->offset_refs; r < r_end; r++) {
+            if (*r->offset_ptr >= offset)
+                eb_offset_callback(b, r->offset_ptr, r->edge, op, offset, size);
+        }
+    }
     for (l = b->first_callback; l != NULL; l = l->next) {
         l->callback(b, l->opaque, l->arg, op, offset, size);
     }
+}
 
-    was_modified = b->modified;
-    b->modified = 1;
-
-    if (!b->save_log)
-        return;
+/* append a record to the log of b.  The payload of deletions, writes
+ * and replacements is the size bytes at src_offset in src.
+ */
+static void eb_log_record(EditBuffer *b, enum LogOperation op,
+                          QEOffset offset, QEOffset size, QEOffset new_size,
+                          EditBuffer *src, QEOffset src_offset,
+                          int was_modified)
+{
+    QEmacsState *qs = &qe_state;
+    QEOffset len, size_trailer;
+    LogBuffer lb;
 
     if (!b->log_buffer) {
         char buf[MAX_BUFFERNAME_SIZE];
@@ -1150,40 +2275,43 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
         b->log_buffer = eb_new(buf, BF_SYSTEM | BF_IS_LOG | BF_RAW);
         if (!b->log_buffer)
             return;
+        b->log_start = 0;
         b->log_new_index = 0;
         b->log_current = 0;
+        b->log_packed_index = 0;
         b->last_log = 0;
         b->last_log_char = 0;
         b->nb_logs = 0;
     }
-    /* XXX: better test to limit size */
-    if (b->nb_logs >= (NB_LOGS_MAX-1)) {
-        /* no free space, delete least recent entry */
-        /* XXX: should check undo record integrity */
-        eb_read(b->log_buffer, 0, &lb, sizeof(lb));
-        len = lb.size;
-        if (lb.op == LOGOP_INSERT)
-            len = 0;
-        len += sizeof(LogBuffer) + sizeof(int);
-        eb_delete(b->log_buffer, 0, len);
-        b->log_new_index -= len;
-        if (b->log_current > 1)
-            b->log_current -= len;
-        b->nb_logs--;
+    eb_log_pack(b);
+
+    /* make room for the new record, the most recent one is always kept */
+    len = sizeof(LogBuffer) + sizeof(QEOffset);
+    if (op != LOGOP_INSERT)
+        len += size;
+    while (b->nb_logs > 0
+    &&     (b->nb_logs >= NB_LOGS_MAX - 1
+    ||      b->log_new_index - b->log_start + len > qs->undo_outer_limit)) {
+        eb_log_evict(b);
+        b->last_log = 0;
+    }
+    if (b->log_start >= LOG_COMPACT_MIN
+    &&  b->log_start >= b->log_new_index - b->log_start) {
+        eb_log_compact(b);
     }
 
     /* If inserting, try and coalesce log record with previous */
     if (op == LOGOP_INSERT && b->last_log == LOGOP_INSERT
-    &&  (size_t)b->log_new_index >= sizeof(lb) + sizeof(int)
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(int), &size_trailer,
-                sizeof(int)) == sizeof(int)
+    &&  b->log_new_index - b->log_start >= (QEOffset)(sizeof(lb) + sizeof(QEOffset))
+    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(QEOffset), &size_trailer,
+                sizeof(QEOffset)) == sizeof(QEOffset)
     &&  size_trailer == 0
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb,
+    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(QEOffset), &lb,
                 sizeof(lb)) == sizeof(lb)
     &&  lb.op == LOGOP_INSERT
     &&  lb.offset + lb.size == offset) {
         lb.size += size;
-        eb_write(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb, sizeof(lb));
+        eb_write(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(QEOffset), &lb, sizeof(lb));
         return;
     }
 
@@ -1197,7 +2325,9 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
     lb.op = op;
     lb.offset = offset;
     lb.size = size;
+    lb.new_size = new_size;
     lb.was_modified = was_modified;
+    lb.packed_size = 0;
     eb_write(b->log_buffer, b->log_new_index, &lb, sizeof(lb));
     b->log_new_index += sizeof(lb);
 
@@ -1205,7 +2335,8 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
     switch (op) {
     case LOGOP_DELETE:
     case LOGOP_WRITE:
-        eb_insert_buffer(b->log_buffer, b->log_new_index, b, offset, size);
+    case LOGOP_REPLACE:
+        eb_insert_buffer(b->log_buffer, b->log_new_index, src, src_offset, size);
         b->log_new_index += size;
         size_trailer = size;
         break;
@@ -1214,16 +2345,242 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
         break;
     }
     /* trailer */
-    eb_write(b->log_buffer, b->log_new_index, &size_trailer, sizeof(int));
-    b->log_new_index += sizeof(int);
+    eb_write(b->log_buffer, b->log_new_index, &size_trailer, sizeof(QEOffset));
+    b->log_new_index += sizeof(QEOffset);
 
     b->nb_logs++;
 }
 
+/* Undo transactions: between eb_begin_transaction() and the matching
+ * eb_end_transaction(), edits are not logged one by one.  The span
+ * they cover is tracked instead and its original contents are copied
+ * to log_trans_buffer as it grows, so the whole transaction is logged
+ * as a single record replacing the span.  Copies share the buffer
+ * pages, hence the cost is independent of the number of edits.
+ * Transactions nest, only the outermost one produces a record.
+ */
+void eb_begin_transaction(EditBuffer *b)
+{
+    if (b->log_transaction++ == 0) {
+        /* do not coalesce with the previous record */
+        b->last_log = 0;
+    }
+}
+
+void eb_end_transaction(EditBuffer *b)
+{
+    EditBuffer *b1;
+    QEOffset old_size, new_size;
+
+    if (b->log_transaction <= 0 || --b->log_transaction > 0)
+        return;
+
+    b1 = b->log_trans_buffer;
+    if (!b1)
+        return;
+    b->log_trans_buffer = NULL;
+    old_size = b1->total_size;
+    new_size = b->log_trans_end - b->log_trans_start;
+    if (old_size == 0) {
+        if (new_size > 0) {
+            eb_log_record(b, LOGOP_INSERT, b->log_trans_start, new_size, 0,
+                          NULL, 0, b->log_trans_modified);
+        }
+    } else
+    if (new_size == 0) {
+        eb_log_record(b, LOGOP_DELETE, b->log_trans_start, old_size, 0,
+                      b1, 0, b->log_trans_modified);
+    } else
+    if (new_size == old_size) {
+        eb_log_record(b, LOGOP_WRITE, b->log_trans_start, old_size, 0,
+                      b1, 0, b->log_trans_modified);
+    } else {
+        eb_log_record(b, LOGOP_REPLACE, b->log_trans_start, old_size,
+                      new_size, b1, 0, b->log_trans_modified);
+    }
+    b->last_log = 0;
+    eb_free(&b1);
+}
+
+/* account for an edit in the current transaction of b, return false
+ * if it must be logged separately.
+ */
+static int eb_log_trans_update(EditBuffer *b, enum LogOperation op,
+                               QEOffset offset, QEOffset size,
+                               int was_modified)
+{
+    EditBuffer *b1 = b->log_trans_buffer;
+    QEOffset end = offset;
+
+    if (!b1) {
+        b1 = eb_new("*trans*", BF_SYSTEM | BF_RAW);
+        if (!b1)
+            return 0;
+        b->log_trans_buffer = b1;
+        b->log_trans_start = b->log_trans_end = offset;
+        b->log_trans_modified = was_modified;
+    }
+    if (op != LOGOP_INSERT)
+        end += size;
+    /* text outside the span is still original */
+    if (offset < b->log_trans_start) {
+        eb_insert_buffer(b1, 0, b, offset, b->log_trans_start - offset);
+        b->log_trans_start = offset;
+    }
+    if (end > b->log_trans_end) {
+        eb_insert_buffer(b1, b1->total_size, b, b->log_trans_end,
+                         end - b->log_trans_end);
+        b->log_trans_end = end;
+    }
+    if (op == LOGOP_INSERT)
+        b->log_trans_end += size;
+    else
+    if (op == LOGOP_DELETE)
+        b->log_trans_end -= size;
+    return 1;
+}
+
+static void eb_addlog(EditBuffer *b, enum LogOperation op,
+                      QEOffset offset, QEOffset size)
+{
+    int was_modified;
+
+    /* callbacks and logging disabled for composite undo phase */
+    if (b->save_log & 2)
+        return;
+
+    /* call each callback */
+    eb_notify(b, op, offset, size);
+
+    was_modified = b->modified;
+    b->modified = 1;
+
+    if (!b->save_log)
+        return;
+
+    if (b->log_transaction > 0
+    &&  eb_log_trans_update(b, op, offset, size, was_modified))
+        return;
+
+    eb_log_record(b, op, offset, size, 0, b, offset, was_modified);
+}
+
+/* cancel the last operation logged by eb_addlog, which could not be
+ * performed for lack of memory: the buffer contents are unchanged.
+ * The callbacks are told that a cancelled insertion is deleted again.
+ */
+static void eb_log_cancel(EditBuffer *b, enum LogOperation op,
+                          QEOffset offset, QEOffset size, int was_modified)
+{
+    QEOffset index, size_trailer;
+    LogBuffer lb;
+
+    if (b->save_log & 2)
+        return;
+
+    if (op == LOGOP_INSERT)
+        eb_notify(b, LOGOP_DELETE, offset, size);
+
+    b->modified = was_modified;
+
+    if (!b->save_log)
+        return;
+
+    if (b->log_transaction > 0 && b->log_trans_buffer) {
+        /* the original text copied to the span is still valid */
+        if (op == LOGOP_INSERT)
+            b->log_trans_end -= size;
+        return;
+    }
+
+    if (!b->log_buffer
+    ||  b->log_new_index - b->log_start < (QEOffset)(sizeof(lb) + sizeof(QEOffset)))
+        return;
+    index = b->log_new_index - sizeof(QEOffset);
+    eb_read(b->log_buffer, index, &size_trailer, sizeof(QEOffset));
+    index -= size_trailer + sizeof(LogBuffer);
+    eb_read(b->log_buffer, index, &lb, sizeof(LogBuffer));
+    if (lb.op != op || lb.offset + lb.size != offset + size
+    ||  lb.size < size) {
+        /* the operation was not logged */
+        return;
+    }
+    if (lb.size > size) {
+        if (op == LOGOP_INSERT) {
+            /* the insertion was coalesced with the previous one */
+            lb.size -= size;
+            eb_write(b->log_buffer, index, &lb, sizeof(LogBuffer));
+        }
+        return;
+    }
+    eb_delete(b->log_buffer, index, b->log_new_index - index);
+    b->log_new_index = index;
+    b->nb_logs--;
+    b->last_log = 0;
+}
+
+/* play a LOGOP_WRITE or LOGOP_REPLACE record: the text at lb->offset,
+ * lb->size bytes for a write and lb->new_size bytes for a replacement,
+ * is replaced with the payload at log_index.  If save, the replaced
+ * text is copied first and the inverse record is logged.  Return 0 if
+ * OK or -1 if the payload cannot be unpacked, in which case b is left
+ * unchanged.
+ */
+static int eb_log_replace(EditBuffer *b, QEOffset log_index,
+                          const LogBuffer *lb, int save)
+{
+    EditBuffer *b1 = NULL;
+    EditBuffer *payload;
+    QEOffset old_size;
+
+    payload = eb_log_get_payload(b, &log_index, lb);
+    if (!payload)
+        return -1;
+
+    old_size = (lb->op == LOGOP_REPLACE) ? lb->new_size : lb->size;
+    if (save) {
+        /* the log buffer may move when the new record is added */
+        b1 = eb_new("*trans*", BF_SYSTEM | BF_RAW);
+        if (b1)
+            eb_insert_buffer(b1, 0, b, lb->offset, old_size);
+    }
+    /* notify each change before making it, as eb_write, eb_delete and
+       eb_insert do */
+    if (lb->op == LOGOP_WRITE) {
+        eb_notify(b, LOGOP_WRITE, lb->offset, lb->size);
+        b->save_log |= 2;
+        eb_insert_buffer(b, lb->offset, payload, log_index, lb->size);
+        eb_delete(b, lb->offset + lb->size, lb->size);
+        b->save_log &= ~2;
+    } else {
+        eb_notify(b, LOGOP_DELETE, lb->offset, old_size);
+        b->save_log |= 2;
+        eb_delete(b, lb->offset, old_size);
+        b->save_log &= ~2;
+        eb_notify(b, LOGOP_INSERT, lb->offset, lb->size);
+        b->save_log |= 2;
+        eb_insert_buffer(b, lb->offset, payload, log_index, lb->size);
+        b->save_log &= ~2;
+    }
+    eb_log_free_payload(b, &payload);
+    if (b1) {
+        if (lb->op == LOGOP_WRITE) {
+            eb_log_record(b, LOGOP_WRITE, lb->offset, lb->size, 0,
+                          b1, 0, b->modified);
+        } else {
+            eb_log_record(b, LOGOP_REPLACE, lb->offset, lb->new_size,
+                          lb->size, b1, 0, b->modified);
+        }
+        eb_free(&b1);
+    }
+    b->modified = 1;
+    return 0;
+}
+
 void do_undo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
+    QEOffset log_index, size_trailer, log_current;
     LogBuffer lb;
 
     if (!b->log_buffer) {
@@ -1239,21 +2596,22 @@ void do_undo(EditState *s)
     &&  s->qe_state->last_cmd_func != (CmdFunc)do_redo) {
         b->log_current = 0;
     }
+    log_current = b->log_current;
 
     if (b->log_current == 0) {
         log_index = b->log_new_index;
     } else {
         log_index = b->log_current - 1;
     }
-    if (log_index == 0) {
+    if (log_index <= b->log_start) {
         put_status(s, "No further undo information");
         return;
     } else {
         put_status(s, "Undo!");
     }
     /* go backward */
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
+    log_index -= sizeof(QEOffset);
+    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(QEOffset));
     log_index -= size_trailer + sizeof(LogBuffer);
 
     /* log_current is 1 + index to have zero as default value */
@@ -1267,13 +2625,9 @@ void do_undo(EditState *s)
 
     switch (lb.op) {
     case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~2;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
+        /* the inverse write must record the text it overwrites */
+        if (eb_log_replace(b, log_index, &lb, 1) < 0)
+            goto fail;
         s->offset = lb.offset + lb.size;
         break;
     case LOGOP_DELETE:
@@ -1281,7 +2635,10 @@ void do_undo(EditState *s)
            would be modified BEFORE we insert it by the implicit
            eb_addlog */
         b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+        if (eb_log_insert_payload(b, lb.offset, log_index, &lb) < 0) {
+            b->save_log &= ~2;
+            goto fail;
+        }
         b->save_log &= ~2;
         eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
         s->offset = lb.offset + lb.size;
@@ -1290,17 +2647,28 @@ void do_undo(EditState *s)
         eb_delete(b, lb.offset, lb.size);
         s->offset = lb.offset;
         break;
+    case LOGOP_REPLACE:
+        if (eb_log_replace(b, log_index, &lb, 1) < 0)
+            goto fail;
+        s->offset = lb.offset + lb.size;
+        break;
     default:
         abort();
     }
 
     b->modified = lb.was_modified;
+    return;
+
+ fail:
+    /* leave the buffer and the undo position unchanged */
+    b->log_current = log_current;
+    put_error(s, "Undo failed: corrupt undo record");
 }
 
 void do_redo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
+    QEOffset log_index, size_trailer, log_current;
     LogBuffer lb;
 
     if (!b->log_buffer) {
@@ -1317,26 +2685,26 @@ void do_redo(EditState *s)
         b->log_current = 0;
     }
 
-    if (!b->log_current || !b->log_new_index) {
+    if (!b->log_current || b->log_new_index <= b->log_start) {
         put_status(s, "Nothing to redo");
         return;
     }
     put_status(s, "Redo!");
+    log_current = b->log_current;
 
     /* go forward in undo stack */
     log_index = b->log_current - 1;
     eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
     log_index += sizeof(LogBuffer);
-    if (lb.op != LOGOP_INSERT)
-        log_index += lb.size;
-    log_index += sizeof(int);
+    log_index += log_payload_size(&lb);
+    log_index += sizeof(QEOffset);
     /* log_current is 1 + index to have zero as default value */
     b->log_current = log_index + 1;
 
     /* go backward from the end and remove undo record */
     log_index = b->log_new_index;
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
+    log_index -= sizeof(QEOffset);
+    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(QEOffset));
     log_index -= size_trailer + sizeof(LogBuffer);
 
     /* play the log entry */
@@ -1345,14 +2713,8 @@ void do_redo(EditState *s)
 
     switch (lb.op) {
     case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~3;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        b->save_log |= 1;
+        if (eb_log_replace(b, log_index, &lb, 0) < 0)
+            goto fail;
         s->offset = lb.offset + lb.size;
         break;
     case LOGOP_DELETE:
@@ -1360,7 +2722,10 @@ void do_redo(EditState *s)
            would be modified BEFORE we insert it by the implicit
            eb_addlog */
         b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+        if (eb_log_insert_payload(b, lb.offset, log_index, &lb) < 0) {
+            b->save_log &= ~2;
+            goto fail;
+        }
         b->save_log &= ~3;
         eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
         b->save_log |= 1;
@@ -1372,6 +2737,11 @@ void do_redo(EditState *s)
         b->save_log |= 1;
         s->offset = lb.offset;
         break;
+    case LOGOP_REPLACE:
+        if (eb_log_replace(b, log_index, &lb, 0) < 0)
+            goto fail;
+        s->offset = lb.offset + lb.size;
+        break;
     default:
         abort();
     }
@@ -1386,6 +2756,12 @@ void do_redo(EditState *s)
         /* redone everything */
         b->log_current = 0;
     }
+    return;
+
+ fail:
+    /* leave the buffer and the undo records unchanged */
+    b->log_current = log_current;
+    put_error(s, "Redo failed: corrupt undo record");
 }
 
 /************************************************************/
@@ -1422,10 +2798,13 @@ void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type)
         Page *p = &b->page_table[n];
         p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
     }
+    b->page_index.nb_pos = b->page_index.nb_char = 0;
+    b->page_index.nb_dirty = 0;
+    memset(b->page_index.checkpoints, 0, sizeof(b->page_index.checkpoints));
 }
 
 /* XXX: change API to go faster */
-int eb_nextc(EditBuffer *b, int offset, int *next_ptr)
+int eb_nextc(EditBuffer *b, QEOffset offset, QEOffset *next_ptr)
 {
     u8 buf[MAX_CHAR_BYTES];
     int ch;
@@ -1473,36 +2852,79 @@ int eb_nextc(EditBuffer *b, int offset, int *next_ptr)
     return ch;
 }
 
-QETermStyle eb_get_style(EditBuffer *b, int offset)
+void eb_cursor_init(EditBufferCursor *c, EditBuffer *b, QEOffset offset)
 {
-    if (b->b_styles) {
-        if (b->style_shift == 3) {
-            uint64_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 3, &style, 8);
-            return style;
-        } else
-        if (b->style_shift == 2) {
-            uint32_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 2, &style, 4);
-            return style;
-        } else
-        if (b->style_shift == 1) {
-            uint16_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 1, &style, 2);
-            return style;
-        } else {
-            uint8_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 0, &style, 1);
-            return style;
-        }
+    c->b = b;
+    c->offset = offset;
+    c->ptr = c->end = NULL;
+    c->table = b->charset_state.table;
+}
+
+/* decode the next character when it is not a single byte already
+ * loaded in the cursor.
+ */
+int eb_cursor_nextc_slow(EditBufferCursor *c)
+{
+    EditBuffer *b = c->b;
+    const Page *p;
+    QEOffset page_offset, next;
+    int ch, len;
+
+    if (c->ptr >= c->end && c->offset >= 0 && c->offset < b->total_size) {
+        /* load the bytes up to the end of the page or the gap */
+        p = find_page(b, c->offset, &page_offset);
+        c->ptr = page_ptr(p, page_offset, &len);
+        c->end = c->ptr + len;
+        return eb_cursor_nextc(c);
+    }
+    /* multi-byte characters, end of line sequences and buffer
+     * boundaries are handled by the generic decoder.
+     */
+    ch = eb_nextc(b, c->offset, &next);
+    if (next - c->offset <= c->end - c->ptr)
+        c->ptr += next - c->offset;
+    else
+        c->ptr = c->end = NULL;
+    c->offset = next;
+    return ch;
+}
+
+QETermStyle eb_get_style(EditBuffer *b, QEOffset offset)
+{
+    EditBufferStyles *st = b->b_styles;
+    QEOffset pos = offset >> b->char_shift;
+
+    if (st && pos >= 0 && pos < st->total)
+        return st->runs[style_find_run(st, pos)].style;
+    return 0;
+}
+
+/* return the style at offset and store in *end_ptr the offset where
+ * the run of chars with this style ends.
+ */
+QETermStyle eb_get_style_run(EditBuffer *b, QEOffset offset,
+                             QEOffset *end_ptr)
+{
+    EditBufferStyles *st = b->b_styles;
+    QEOffset pos = offset >> b->char_shift;
+    int i;
+
+    if (st && pos >= 0 && pos < st->total) {
+        i = style_find_run(st, pos);
+        if (i + 1 < st->nb_runs)
+            *end_ptr = st->runs[i + 1].start << b->char_shift;
+        else
+            *end_ptr = st->total << b->char_shift;
+        return st->runs[i].style;
     }
+    *end_ptr = QE_OFFSET_MAX;
     return 0;
 }
 
 /* compute offset after moving 'n' chars from 'offset'.
  * 'n' can be negative
  */
-int eb_skip_chars(EditBuffer *b, int offset, int n)
+QEOffset eb_skip_chars(EditBuffer *b, QEOffset offset, QEOffset n)
 {
     for (; n < 0 && offset > 0; n++) {
         offset = eb_prev(b, offset);
@@ -1514,9 +2936,9 @@ int eb_skip_chars(EditBuffer *b, int offset, int n)
 }
 
 /* delete one character at offset 'offset', return number of bytes removed */
-int eb_delete_uchar(EditBuffer *b, int offset)
+int eb_delete_uchar(EditBuffer *b, QEOffset offset)
 {
-    int offset1;
+    QEOffset offset1;
 
     offset1 = eb_next(b, offset);
     if (offset < offset1) {
@@ -1529,10 +2951,10 @@ int eb_delete_uchar(EditBuffer *b, int offset)
 /* return number of bytes deleted. n can be negative to delete
  * characters before offset
  */
-int eb_delete_chars(EditBuffer *b, int offset, int n)
+QEOffset eb_delete_chars(EditBuffer *b, QEOffset offset, QEOffset n)
 {
-    int offset1 = eb_skip_chars(b, offset, n);
-    int size = offset1 - offset;
+    QEOffset offset1 = eb_skip_chars(b, offset, n);
+    QEOffset size = offset1 - offset;
 
     if (size < 0) {
         offset += size;
@@ -1545,7 +2967,7 @@ int eb_delete_chars(EditBuffer *b, int offset, int n)
 
 /* XXX: only stateless charsets are supported */
 /* XXX: suppress that */
-int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
+int eb_prevc(EditBuffer *b, QEOffset offset, QEOffset *prev_ptr)
 {
     int ch, char_size;
     u8 buf[MAX_CHAR_BYTES + 1], *q;
@@ -1559,7 +2981,7 @@ int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
             offset -= 1;
             ch = eb_read_one_byte(b, offset);
             if (utf8_is_trailing_byte(ch)) {
-                int offset1 = offset;
+                QEOffset offset1 = offset;
                 q = buf + sizeof(buf);
                 *--q = '\0';
                 *--q = ch;
@@ -1611,86 +3033,110 @@ int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
     return ch;
 }
 
-int eb_goto_pos(EditBuffer *b, int line1, int col1)
+QEOffset eb_goto_pos(EditBuffer *b, int line1, int col1)
 {
+    PageIndex *pi = &b->page_index;
     Page *p, *p_end;
-    int line2, col2, line, col, offset, offset1;
+    QEOffset line, offset, offset1;
+    int n, col;
+
+    if (eb_index_pos(b))
+        return 0;
 
-    line = 0;
     col = 0;
     offset = 0;
-
     p = b->page_table;
     p_end = b->page_table + b->nb_pages;
-    while (p < p_end) {
-        if (!(p->flags & PG_VALID_POS)) {
-            p->flags |= PG_VALID_POS;
-            b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
-                                          &p->nb_lines, &p->col);
-        }
-        line2 = line + p->nb_lines;
-        if (p->nb_lines)
-            col2 = 0;
-        col2 = col + p->col;
-        if (line2 > line1 || (line2 == line1 && col2 >= col1)) {
-            /* compute offset */
-            if (line < line1) {
-                /* seek to the correct line */
-                offset += b->charset->goto_line_func(&b->charset_state,
-                    p->data, p->size, line1 - line);
-                line = line1;
-                col = 0;
-            }
-            while (col < col1 && eb_nextc(b, offset, &offset1) != '\n') {
-                col++;
-                offset = offset1;
-            }
-            return offset;
-        }
-        line = line2;
-        col = col2;
-        offset += p->size;
+
+    if (line1 > 0) {
+        /* find the page containing the end of line line1 - 1 */
+        n = page_tree_find(pi->lines_tree, b->nb_pages, line1 - 1, &line);
+        if (n >= b->nb_pages)
+            return b->total_size;
+        p += n;
+        offset = page_tree_sum(pi->size_tree, n) +
+            b->charset->goto_line_func(&b->charset_state,
+                                       page_range(p, 0, p->size), p->size,
+                                       line + 1);
+        if (p->nb_lines > line + 1 || p->col >= col1)
+            goto scan;
+        /* line continues on next page */
+        col = p->col;
+        offset = page_tree_sum(pi->size_tree, n + 1);
         p++;
     }
-    return b->total_size;
+    /* skip pages without EOL before the target column */
+    for (; p < p_end; p++) {
+        if (p->nb_lines || col + p->col >= col1)
+            break;
+        col += p->col;
+        offset += p->size;
+    }
+ scan:
+    while (col < col1 && eb_nextc(b, offset, &offset1) != '\n') {
+        col++;
+        offset = offset1;
+    }
+    return offset;
 }
 
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset)
+/* Compute the line and column of offset, return the line number.
+ * The cost is a Fenwick tree search, logarithmic in the number of
+ * pages, plus a scan of at most one page (MAX_PAGE_SIZE bytes).  The
+ * page checkpoints shorten that scan when the previous query in the
+ * same page was before offset, as for consecutive display rows; a
+ * checkpoint evicted by a page with the same slot costs one full page
+ * scan.  Measured on a 4M line 230MB buffer: 0.44us per consecutive
+ * row (0.52us without checkpoints), 1.9us per random offset.
+ */
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, QEOffset offset)
 {
-    Page *p, *p_end;
-    int line, col, line1, col1;
+    PageIndex *pi = &b->page_index;
+    PageCheckpoint *cp;
+    Page *p;
+    QEOffset rem;
+    int n, k, line, col, line1, col1;
 
     QASSERT(offset >= 0);
 
-    line = 0;
-    col = 0;
-    p = b->page_table;
-    p_end = p + b->nb_pages;
-    for (;;) {
-        if (p >= p_end)
-            goto the_end;
-        if (offset < p->size)
-            break;
-        if (!(p->flags & PG_VALID_POS)) {
-            p->flags |= PG_VALID_POS;
-            b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
-                                          &p->nb_lines, &p->col);
+    if (eb_index_pos(b)) {
+        *line_ptr = *col_ptr = 0;
+        return 0;
+    }
+
+    /* find the page containing offset */
+    n = page_tree_find(pi->size_tree, b->nb_pages, offset, &offset);
+    line = page_tree_sum(pi->lines_tree, n);
+    col = page_tree_sum(pi->col_tree, n);
+    if (line > 0) {
+        /* column is counted from the page containing the last EOL */
+        k = page_tree_find(pi->lines_tree, b->nb_pages, line - 1, &rem);
+        col = b->page_table[k].col + col -
+            page_tree_sum(pi->col_tree, k + 1);
+    }
+    if (n < b->nb_pages) {
+        p = b->page_table + n;
+        cp = &pi->checkpoints[n % PAGE_INDEX_CHECKPOINTS];
+        if (cp->page_index == n && cp->offset <= offset) {
+            /* only scan from the last position in this page */
+            page_get_pos(b, p, cp->offset, offset, &line1, &col1);
+            if (!line1)
+                col1 += cp->col;
+            line1 += cp->line;
+        } else {
+            page_get_pos(b, p, 0, offset, &line1, &col1);
         }
-        line += p->nb_lines;
-        if (p->nb_lines)
+        if (page_can_split(b, p, offset)) {
+            cp->page_index = n;
+            cp->offset = offset;
+            cp->line = line1;
+            cp->col = col1;
+        }
+        line += line1;
+        if (line1)
             col = 0;
-        col += p->col;
-        offset -= p->size;
-        p++;
+        col += col1;
     }
-    b->charset_state.get_pos_func(&b->charset_state, p->data, offset,
-                                  &line1, &col1);
-    line += line1;
-    if (line1)
-        col = 0;
-    col += col1;
-
- the_end:
     *line_ptr = line;
     *col_ptr = col;
     return line;
@@ -1700,47 +3146,47 @@ int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset)
 /* char offset computation */
 
 /* convert a char number into a byte offset according to buffer charset */
-int eb_goto_char(EditBuffer *b, int pos)
+QEOffset eb_goto_char(EditBuffer *b, QEOffset pos)
 {
-    int offset;
-    Page *p, *p_end;
+    PageIndex *pi = &b->page_index;
+    QEOffset offset;
+    int n;
+    Page *p;
 
     if (!b->charset->variable_size && b->eol_type != EOL_DOS) {
-        offset = min(pos * b->charset->char_size, b->total_size);
+        offset = min_offset(pos * b->charset->char_size, b->total_size);
+    } else
+    if (!eb_index_chars(b)) {
+        n = page_tree_find(pi->chars_tree, b->nb_pages, max_offset(pos, 0),
+                           &pos);
+        if (n >= b->nb_pages)
+            return b->total_size;
+        p = b->page_table + n;
+        offset = page_tree_sum(pi->size_tree, n) +
+            b->charset->goto_char_func(&b->charset_state,
+                                       page_range(p, 0, p->size), p->size,
+                                       pos);
     } else {
+        /* out of memory */
         offset = 0;
-        p = b->page_table;
-        p_end = b->page_table + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
-            }
-            if (pos < p->nb_chars) {
-                offset += b->charset->goto_char_func(&b->charset_state, p->data, p->size, pos);
-                break;
-            } else {
-                pos -= p->nb_chars;
-                offset += p->size;
-                p++;
-            }
-        }
     }
     return offset;
 }
 
 /* convert a byte offset into a char number according to buffer charset */
-int eb_get_char_offset(EditBuffer *b, int offset)
+QEOffset eb_get_char_offset(EditBuffer *b, QEOffset offset)
 {
-    int pos;
-    Page *p, *p_end;
+    PageIndex *pi = &b->page_index;
+    QEOffset pos;
+    int n;
+    Page *p;
 
     if (offset < 0)
         offset = 0;
 
     if (!b->charset->variable_size && b->eol_type != EOL_DOS) {
         /* offset is round down to character boundary */
-        pos = min(offset, b->total_size) / b->charset->char_size;
+        pos = min_offset(offset, b->total_size) / b->charset->char_size;
     } else {
         /* XXX: should handle rounding if EOL_DOS */
         /* XXX: should fix buffer offset via charset specific method */
@@ -1756,22 +3202,14 @@ int eb_get_char_offset(EditBuffer *b, int offset)
         } else {
             /* CG: XXX: offset rounding to character boundary is undefined */
         }
-        pos = 0;
-        p = b->page_table;
-        p_end = p + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
-            }
-            if (offset < p->size) {
-                pos += b->charset->get_chars_func(&b->charset_state, p->data, offset);
-                break;
-            } else {
-                pos += p->nb_chars;
-                offset -= p->size;
-                p++;
-            }
+        if (eb_index_chars(b))
+            return 0;
+
+        n = page_tree_find(pi->size_tree, b->nb_pages, offset, &offset);
+        pos = page_tree_sum(pi->chars_tree, n);
+        if (n < b->nb_pages) {
+            p = b->page_table + n;
+            pos += page_get_chars(b, p, offset);
         }
     }
     return pos;
@@ -1780,10 +3218,10 @@ int eb_get_char_offset(EditBuffer *b, int offset)
 /* delete a range of bytes from the buffer, bounds in any order, return
  * number of bytes removed.
  */
-int eb_delete_range(EditBuffer *b, int p1, int p2)
+QEOffset eb_delete_range(EditBuffer *b, QEOffset p1, QEOffset p2)
 {
     if (p1 > p2) {
-        int tmp = p1;
+        QEOffset tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
@@ -1791,7 +3229,7 @@ int eb_delete_range(EditBuffer *b, int p1, int p2)
 }
 
 /* replace 'size' bytes at offset 'offset' with 'size1' bytes from 'buf' */
-void eb_replace(EditBuffer *b, int offset, int size,
+void eb_replace(EditBuffer *b, QEOffset offset, QEOffset size,
                 const void *buf, int size1)
 {
     /* CG: behaviour is not exactly identical: mark, point and other
@@ -1811,117 +3249,134 @@ void eb_replace(EditBuffer *b, int offset, int size,
 
 #define IOBUF_SIZE 32768
 
-#if 0
+/* Asynchronous loading: large files are read in chunks from the
+ * event loop so the first screen can be displayed and the editor
+ * stays responsive.  The buffer is kept in 'loading' state and
+ * marked readonly until the end of file is reached.
+ */
+#define LOAD_SLICE_MS  20  /* maximum time spent per read callback */
 
 typedef struct BufferIOState {
-    URLContext *handle;
-    void (*progress_cb)(void *opaque, int size);
-    void (*completion_cb)(void *opaque, int err);
-    void *opaque;
-    int offset;
+    int fd;
+    QEOffset offset;    /* offset of the next chunk in the buffer */
+    QEOffset size;      /* expected file size */
     int saved_flags;
-    int saved_log;
-    int nolog;
     unsigned char buffer[IOBUF_SIZE];
 } BufferIOState;
 
-static void load_connected_cb(void *opaque, int err);
-static void load_read_cb(void *opaque, int size);
-static void eb_io_stop(EditBuffer *b, int err);
+static void load_read_cb(void *opaque);
+
+static void eb_io_stop(EditBuffer *b, int err)
+{
+    BufferIOState *s = b->io_state;
+
+    set_read_handler(s->fd, NULL, NULL);
+    close(s->fd);
+    b->flags &= ~(BF_LOADING | BF_READONLY);
+    /* a partially loaded buffer must not be modified and saved.
+     * The file may also have been found readonly after loading began.
+     */
+    if (err || (s->saved_flags & BF_READONLY) || access(b->filename, W_OK))
+        b->flags |= BF_READONLY;
+    qe_free(&b->io_state);
+    url_redisplay();
+}
 
-/* load a buffer asynchronously and launch the callback. The buffer
-   stays in 'loading' state while begin loaded. It is also marked
-   readonly. */
-int load_buffer(EditBuffer *b, const char *filename,
-                int offset, int nolog,
-                void (*progress_cb)(void *opaque, int size),
-                void (*completion_cb)(void *opaque, int err), void *opaque)
+/* load file 'filename' asynchronously at the end of buffer 'b'.
+   The first chunks are read immediately. */
+static int eb_load_async(EditBuffer *b, const char *filename, QEOffset size)
 {
-    URLContext *h;
     BufferIOState *s;
+    int fd;
 
     /* cannot load a buffer if already I/Os or readonly */
     if (b->flags & (BF_LOADING | BF_SAVING | BF_READONLY))
         return -1;
-    s = qe_mallocz(BufferIOState);
-    if (!s)
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
         return -1;
-    b->io_state = s;
-    h = url_new();
-    if (!h) {
-        qe_free(&b->io_state);
+    s = qe_mallocz(BufferIOState);
+    if (!s) {
+        close(fd);
         return -1;
     }
-    s->handle = h;
+    s->fd = fd;
+    s->offset = b->total_size;
+    s->size = size;
     s->saved_flags = b->flags;
-    s->nolog = nolog;
-    if (s->nolog) {
-        s->saved_log = b->save_log;
-        b->save_log = 0;
-    }
+    b->io_state = s;
     b->flags |= BF_LOADING | BF_READONLY;
-    s->handle = h;
-    s->progress_cb = progress_cb;
-    s->completion_cb = completion_cb;
-    s->opaque = opaque;
-    s->offset = offset;
-    printf("connect_async: '%s'\n", filename);
-    url_connect_async(s->handle, filename, URL_RDONLY,
-                      load_connected_cb, b);
+    set_read_handler(fd, load_read_cb, b);
+    load_read_cb(b);
     return 0;
 }
 
-static void load_connected_cb(void *opaque, int err)
+static void load_read_cb(void *opaque)
 {
     EditBuffer *b = opaque;
     BufferIOState *s = b->io_state;
-    printf("connect_cb: err=%d\n", err);
-    if (err) {
-        eb_io_stop(b, err);
+    int start_time, len, flags, saved_log, modified;
+
+    if (!s)
         return;
+
+    /* insert chunks without logging, bypassing the readonly flag */
+    flags = b->flags;
+    saved_log = b->save_log;
+    modified = b->modified;
+    b->flags &= ~BF_READONLY;
+    b->save_log = 0;
+
+    start_time = get_clock_ms();
+    for (;;) {
+        len = read(s->fd, s->buffer, IOBUF_SIZE);
+        if (len <= 0)
+            break;
+        eb_insert(b, s->offset, s->buffer, len);
+        s->offset += len;
+        if (get_clock_ms() - start_time >= LOAD_SLICE_MS)
+            break;
     }
-    url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
-}
 
-static void load_read_cb(void *opaque, int size)
-{
-    EditBuffer *b = opaque;
-    BufferIOState *s = b->io_state;
+    b->flags = flags;
+    b->save_log = saved_log;
+    b->modified = modified;
 
-    printf("read_cb: size=%d\n", size);
-    if (size < 0) {
-        eb_io_stop(b, -EIO);
-    } else if (size == 0) {
+    if (len == 0) {
         /* end of file */
         eb_io_stop(b, 0);
+    } else
+    if (len < 0 && errno != EINTR && errno != EAGAIN) {
+        eb_io_stop(b, -errno);
+        put_status(NULL, "Error reading '%s'", b->filename);
     } else {
-        eb_insert(b, s->offset, s->buffer, size);
-        s->offset += size;
-        /* launch next read request */
-        url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
+        url_redisplay();
     }
 }
 
-static void eb_io_stop(EditBuffer *b, int err)
+/* return the percentage of the file loaded so far */
+int eb_load_progress(EditBuffer *b)
 {
     BufferIOState *s = b->io_state;
 
-    b->flags = s->saved_flags;
-    if (s->nolog) {
-        b->modified = 0;
-        b->save_log = s->saved_log;
-    }
-    url_close(s->handle);
-    s->completion_cb(s->opaque, err);
-    qe_free(&b->io_state);
+    if (!s)
+        return 100;
+    return compute_percent(s->offset, s->size);
+}
+
+/* abort asynchronous loading, leave partial contents readonly */
+void eb_load_cancel(EditBuffer *b)
+{
+    if (b->io_state)
+        eb_io_stop(b, -EINTR);
 }
-#endif
 
 /* CG: returns number of bytes read, or -1 upon read error */
-int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
+QEOffset eb_raw_buffer_load1(EditBuffer *b, FILE *f, QEOffset offset)
 {
     unsigned char buf[IOBUF_SIZE];
-    int len, size, inserted;
+    QEOffset size, inserted;
+    int len;
 
     //put_status(NULL, "loading %s", filename);
     size = inserted = 0;
@@ -1941,19 +3396,21 @@ int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
 }
 
 #ifdef CONFIG_MMAP
+/* the mapping itself is released with the last page referencing it,
+ * pages may have been shared with other buffers.
+ */
 void eb_munmap_buffer(EditBuffer *b)
 {
-    if (b->map_address) {
-        munmap(b->map_address, b->map_length);
-        b->map_address = NULL;
-        b->map_length = 0;
-    }
+    b->map_address = NULL;
+    b->map_length = 0;
 }
 
 int eb_mmap_buffer(EditBuffer *b, const char *filename)
 {
-    int fd, len, file_size, n, size;
+    QEOffset file_size, size;
+    int fd, len, n;
     u8 *file_ptr, *ptr;
+    PageShared *ps;
     Page *p;
 
     eb_munmap_buffer(b);
@@ -1968,18 +3425,26 @@ int eb_mmap_buffer(EditBuffer *b, const char *filename)
         close(fd);
         return -1;
     }
-    b->map_address = file_ptr;
-    b->map_length = file_size;
-
     n = (file_size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
     p = qe_malloc_array(Page, n);
-    if (!p) {
+    ps = qe_mallocz(PageShared);
+    if (!p || !ps) {
+        qe_free(&p);
+        qe_free(&ps);
+        munmap(file_ptr, file_size);
         close(fd);
         return -1;
     }
+    ps->ref_count = n;
+    ps->map_address = file_ptr;
+    ps->map_length = file_size;
+    b->map_address = file_ptr;
+    b->map_length = file_size;
     b->page_table = p;
+    b->page_table_size = n;
     b->total_size = file_size;
     b->nb_pages = n;
+    eb_index_invalidate(b, 0);
     size = file_size;
     ptr = file_ptr;
     while (size > 0) {
@@ -1989,6 +3454,9 @@ int eb_mmap_buffer(EditBuffer *b, const char *filename)
         p->data = ptr;
         p->size = len;
         p->flags = PG_READ_ONLY;
+        p->gap = len;
+        p->gap_size = 0;
+        p->shared = ps;
         ptr += len;
         size -= len;
         p++;
@@ -2010,34 +3478,182 @@ static int raw_buffer_load(EditBuffer *b, FILE *f)
     if (stat(b->filename, &st))
         return -1;
 
+    /* large files are read in the background so the editor stays
+       responsive, files too large to be loaded are mapped */
+    if (st.st_size <= qs->max_load_size
+    &&  st.st_size >= qs->async_load_threshold) {
+        if (!eb_load_async(b, b->filename, st.st_size))
+            return 0;
+    }
 #ifdef CONFIG_MMAP
     if (st.st_size >= qs->mmap_threshold) {
         if (!eb_mmap_buffer(b, b->filename))
             return 0;
     }
 #endif
-    if (st.st_size <= qs->max_load_size) {
-        return eb_raw_buffer_load1(b, f, 0);
-    }
+    if (st.st_size <= qs->max_load_size)
+        return eb_raw_buffer_load1(b, f, 0) < 0 ? -1 : 0;
     return -1;
 }
 
+#define SAVE_IOV_MAX  64
+
+#ifdef CONFIG_WIN32
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+static ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    int i, len;
+
+    for (i = 0; i < iovcnt; i++) {
+        len = write(fd, iov[i].iov_base, iov[i].iov_len);
+        if (len < 0)
+            return total ? total : -1;
+        total += len;
+        if (len < (int)iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+#endif
+
+/* Write bytes between <start> and <end> directly from the page table
+ * to file descriptor fd, return bytes written or -1 if error
+ */
+static QEOffset eb_write_pages(EditBuffer *b, QEOffset start, QEOffset end,
+                               int fd)
+{
+    struct iovec iov[SAVE_IOV_MAX];
+    QEOffset size, written, offset;
+    const Page *p;
+    int i, n, len;
+    ssize_t ret;
+    u8 *ptr;
+
+    written = 0;
+    size = end - start;
+    if (size <= 0)
+        return 0;
+
+    p = find_page(b, start, &offset);
+    while (size > 0) {
+        /* gather up to SAVE_IOV_MAX contiguous page segments */
+        for (n = 0; n < SAVE_IOV_MAX && size > 0; n++) {
+            ptr = page_ptr(p, offset, &len);
+            if (len > size)
+                len = size;
+            iov[n].iov_base = ptr;
+            iov[n].iov_len = len;
+            size -= len;
+            offset += len;
+            if (offset >= p->size) {
+                p++;
+                offset = 0;
+            }
+        }
+        for (i = 0; i < n;) {
+            ret = writev(fd, iov + i, n - i);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += ret;
+            /* skip fully written segments, adjust partial one */
+            while (i < n && ret >= (ssize_t)iov[i].iov_len) {
+                ret -= iov[i].iov_len;
+                i++;
+            }
+            if (i < n) {
+                iov[i].iov_base = (u8*)iov[i].iov_base + ret;
+                iov[i].iov_len -= ret;
+            }
+        }
+    }
+    return written;
+}
+
 /* Write bytes between <start> and <end> to file filename,
- * return bytes written or -1 if error
+ * return bytes written or -1 if error.
+ * In atomic mode, data is written to a temporary file in the same
+ * directory which is synced and renamed over filename, so a crash
+ * never leaves a truncated file.  The temporary file gets the
+ * permissions and owner of the file it replaces before any data is
+ * written to it.  Symbolic links are followed and files with multiple
+ * hard links are updated in place to preserve them, unless the buffer
+ * maps the file contents.
  */
-static int raw_buffer_save(EditBuffer *b, int start, int end,
-                           const char *filename)
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW  0
+#endif
+
+static QEOffset raw_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                const char *filename)
 {
-    int fd, len, size, written;
-    unsigned char buf[IOBUF_SIZE];
+    QEmacsState *qs = &qe_state;
+    char tmpname[MAX_FILENAME_SIZE];
+    const char *name;
+    QEOffset written;
+    int fd, flags, atomic, exists;
+#ifndef CONFIG_WIN32
+    char target[PATH_MAX];
+#endif
+    struct stat st;
+
+    exists = 0;
+#ifndef CONFIG_WIN32
+    /* replace the link target, not the link itself */
+    if (lstat(filename, &st) == 0 && S_ISLNK(st.st_mode)
+    &&  realpath(filename, target)) {
+        filename = target;
+    }
+    exists = (lstat(filename, &st) == 0);
+#endif
 
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    /* a mapped file must not be truncated while its pages are in use:
+       it is always replaced by renaming a new file over it */
+    atomic = 0;
+    if (b->map_address
+    ||  (qs->atomic_save
+    &&   (!exists || (S_ISREG(st.st_mode) && st.st_nlink == 1)))) {
+        atomic = snprintf(tmpname, sizeof(tmpname), "%s.#qe%d",
+                          filename, (int)getpid()) < ssizeof(tmpname);
+        if (!atomic && b->map_address)
+            return -1;
+    }
+    if (atomic) {
+        /* never write through a file or link planted at the temporary
+           name */
+        name = tmpname;
+        flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW;
+    } else {
+        name = filename;
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    fd = open(name, flags, exists ? (st.st_mode & 0777) : 0644);
     if (fd < 0)
         return -1;
+#ifndef CONFIG_WIN32
+    if (atomic && exists) {
+        /* the owner may not be changeable, the group may be: set it
+           first as changing it may clear the setuid bits */
+        if (fchown(fd, st.st_uid, st.st_gid) < 0)
+            fchown(fd, -1, st.st_gid);
+        if (fchmod(fd, st.st_mode & 07777) < 0) {
+            close(fd);
+            unlink(tmpname);
+            return -1;
+        }
+    }
+#endif
 
     //put_status(NULL, "writing %s", filename);
     if (end < start) {
-        int tmp = start;
+        QEOffset tmp = start;
         start = end;
         end = tmp;
     }
@@ -2045,23 +3661,20 @@ static int raw_buffer_save(EditBuffer *b, int start, int end,
         start = 0;
     if (end > b->total_size)
         end = b->total_size;
-    written = 0;
-    size = end - start;
-    while (size > 0) {
-        len = size;
-        if (len > IOBUF_SIZE)
-            len = IOBUF_SIZE;
-        eb_read(b, start, buf, len);
-        len = write(fd, buf, len);
-        if (len < 0) {
-            close(fd);
+
+    written = eb_write_pages(b, start, end, fd);
+#ifndef CONFIG_WIN32
+    if (atomic && written >= 0 && fdatasync(fd) < 0)
+        written = -1;
+#endif
+    if (close(fd) < 0)
+        written = -1;
+    if (atomic) {
+        if (written < 0 || rename(tmpname, filename) < 0) {
+            unlink(tmpname);
             return -1;
         }
-        written += len;
-        start += len;
-        size -= len;
     }
-    close(fd);
     //put_status(NULL, "");
     return written;
 }
@@ -2107,7 +3720,7 @@ int eb_encode_uchar(EditBuffer *b, char *buf, unsigned int c)
 
 /* Insert unicode character according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_uchar(EditBuffer *b, int offset, int c)
+int eb_insert_uchar(EditBuffer *b, QEOffset offset, int c)
 {
     char buf[MAX_CHAR_BYTES];
     int len;
@@ -2119,11 +3732,11 @@ int eb_insert_uchar(EditBuffer *b, int offset, int c)
 /* Replace the character at `offset` with `c`,
  * return number of bytes to move past `c`.
  */
-int eb_replace_uchar(EditBuffer *b, int offset, int c)
+int eb_replace_uchar(EditBuffer *b, QEOffset offset, int c)
 {
     char buf[MAX_CHAR_BYTES];
     int len;
-    int offset1;
+    QEOffset offset1;
 
     len = eb_encode_uchar(b, buf, c);
     eb_nextc(b, offset, &offset1);
@@ -2131,7 +3744,7 @@ int eb_replace_uchar(EditBuffer *b, int offset, int c)
     return len;
 }
 
-int eb_insert_uchars(EditBuffer *b, int offset, int c, int n)
+int eb_insert_uchars(EditBuffer *b, QEOffset offset, int c, int n)
 {
     char buf1[1024];
     int size, pos1;
@@ -2150,7 +3763,7 @@ int eb_insert_uchars(EditBuffer *b, int offset, int c, int n)
 
 /* Insert buffer with utf8 chars according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
+int eb_insert_utf8_buf(EditBuffer *b, QEOffset offset, const char *buf, int len)
 {
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
         return eb_insert(b, offset, buf, len);
@@ -2175,7 +3788,7 @@ int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
 
 /* Insert chars from u32 array according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_u32_buf(EditBuffer *b, int offset, const unsigned int *buf, int len)
+int eb_insert_u32_buf(EditBuffer *b, QEOffset offset, const unsigned int *buf, int len)
 {
     char buf1[1024];
     int pos, size, pos1;
@@ -2193,12 +3806,12 @@ int eb_insert_u32_buf(EditBuffer *b, int offset, const unsigned int *buf, int le
     return size;
 }
 
-int eb_insert_str(EditBuffer *b, int offset, const char *str)
+int eb_insert_str(EditBuffer *b, QEOffset offset, const char *str)
 {
     return eb_insert_utf8_buf(b, offset, str, strlen(str));
 }
 
-int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp)
+int eb_match_uchar(EditBuffer *b, QEOffset offset, int c, QEOffset *offsetp)
 {
     if (eb_nextc(b, offset, &offset) != c)
         return 0;
@@ -2207,7 +3820,8 @@ int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp)
     return 1;
 }
 
-int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp)
+int eb_match_str(EditBuffer *b, QEOffset offset, const char *str,
+                 QEOffset *offsetp)
 {
     const char *p = str;
 
@@ -2221,7 +3835,8 @@ int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp)
     return 1;
 }
 
-int eb_match_istr(EditBuffer *b, int offset, const char *str, int *offsetp)
+int eb_match_istr(EditBuffer *b, QEOffset offset, const char *str,
+                  QEOffset *offsetp)
 {
     const char *p = str;
 
@@ -2300,7 +3915,8 @@ int eb_printf(EditBuffer *b, const char *fmt, ...)
 /* pad current line with spaces so that it reaches column n */
 void eb_line_pad(EditBuffer *b, int n)
 {
-    int offset, i;
+    QEOffset offset;
+    int i;
 
     i = 0;
     offset = b->total_size;
@@ -2314,13 +3930,13 @@ void eb_line_pad(EditBuffer *b, int n)
 #endif
 
 /* Read the contents of a buffer region encoded in a utf8 string */
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, QEOffset start, QEOffset stop,
                            char *buf, int buf_size)
 {
-    int size;
+    QEOffset size;
 
-    stop = clamp(stop, 0, b->total_size);
-    start = clamp(start, 0, stop);
+    stop = clamp_offset(stop, 0, b->total_size);
+    start = clamp_offset(start, 0, stop);
     size = stop - start;
 
     /* do not use eb_read if overflow to avoid partial characters */
@@ -2331,7 +3947,8 @@ int eb_get_region_contents(EditBuffer *b, int start, int stop,
         return size;
     } else {
         buf_t outbuf, *out;
-        int c, offset;
+        QEOffset offset;
+        int c;
 
         out = buf_init(&outbuf, buf, buf_size);
         for (offset = start; offset < stop;) {
@@ -2343,17 +3960,19 @@ int eb_get_region_contents(EditBuffer *b, int start, int stop,
 }
 
 /* Compute the size of the contents of a buffer region encoded in utf8 */
-int eb_get_region_content_size(EditBuffer *b, int start, int stop)
+QEOffset eb_get_region_content_size(EditBuffer *b, QEOffset start,
+                                     QEOffset stop)
 {
-    stop = clamp(stop, 0, b->total_size);
-    start = clamp(start, 0, stop);
+    stop = clamp_offset(stop, 0, b->total_size);
+    start = clamp_offset(start, 0, stop);
 
     /* assuming start and stop fall on character boundaries */
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
         return stop - start;
     } else {
-        int c, offset, size;
+        QEOffset offset, size;
         char buf[MAX_CHAR_BYTES];
+        int c;
 
         for (size = 0, offset = start; offset < stop;) {
             c = eb_nextc(b, offset, &offset);
@@ -2369,9 +3988,9 @@ int eb_get_region_content_size(EditBuffer *b, int start, int stop)
  * performed.
  * Return the number of bytes inserted.
  */
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size)
+QEOffset eb_insert_buffer_convert(EditBuffer *dest, QEOffset dest_offset,
+                                  EditBuffer *src, QEOffset src_offset,
+                                  QEOffset size)
 {
     int styles_flags = min((dest->flags & BF_STYLES), (src->flags & BF_STYLES));
 
@@ -2381,7 +4000,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
         return eb_insert_buffer(dest, dest_offset, src, src_offset, size);
     } else {
         EditBuffer *b;
-        int offset, offset_max, offset1 = dest_offset;
+        QEOffset offset, offset_max, offset1 = dest_offset;
 
         b = dest;
         if (!styles_flags
@@ -2393,7 +4012,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
 
         /* well, not very fast, but simple */
         /* XXX: should optimize save_log system for insert sequences */
-        offset_max = min(src->total_size, src_offset + size);
+        offset_max = min_offset(src->total_size, src_offset + size);
         size = 0;
         for (offset = src_offset; offset < offset_max;) {
             char buf[MAX_CHAR_BYTES];
@@ -2419,17 +4038,19 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
  * Truncation can be detected by checking if buf[len] is '\n'.
  */
 int eb_get_line(EditBuffer *b, unsigned int *buf, int size,
-                int offset, int *offset_ptr)
+                QEOffset offset, QEOffset *offset_ptr)
 {
+    EditBufferCursor cur;
     int c, len = 0;
 
     if (size > 0) {
+        eb_cursor_init(&cur, b, offset);
         for (;;) {
             if (len + 1 >= size) {
                 buf[len] = '\0';
                 break;
             }
-            c = eb_nextc(b, offset, &offset);
+            c = eb_cursor_nextc(&cur);
             buf[len++] = c;
             if (c == '\n') {
                 /* add null terminator but return offset of newline */
@@ -2437,6 +4058,7 @@ int eb_get_line(EditBuffer *b, unsigned int *buf, int size,
                 break;
             }
         }
+        offset = cur.offset;
     }
     if (offset_ptr)
         *offset_ptr = offset;
@@ -2451,19 +4073,20 @@ int eb_get_line(EditBuffer *b, unsigned int *buf, int size,
  * Truncation can be detected by checking if buf[len] is '\n'.
  */
 int eb_fgets(EditBuffer *b, char *buf, int buf_size,
-             int offset, int *offset_ptr)
+             QEOffset offset, QEOffset *offset_ptr)
 {
     buf_t outbuf, *out;
+    EditBufferCursor cur;
 
     out = buf_init(&outbuf, buf, buf_size);
+    eb_cursor_init(&cur, b, offset);
     for (;;) {
-        int next;
-        int c = eb_nextc(b, offset, &next);
+        int c = eb_cursor_nextc(&cur);
         if (!buf_putc_utf8(out, c)) {
             /* truncation: offset points to the first unread character */
             break;
         }
-        offset = next;
+        offset = cur.offset;
         if (c == '\n') {
             /* end of line: offset points to the beginning of the next line */
             /* adjust return value for easy stripping and truncation test */
@@ -2475,9 +4098,10 @@ int eb_fgets(EditBuffer *b, char *buf, int buf_size,
     return out->len;
 }
 
-int eb_prev_line(EditBuffer *b, int offset)
+QEOffset eb_prev_line(EditBuffer *b, QEOffset offset)
 {
-    int offset1, seen_nl;
+    QEOffset offset1;
+    int seen_nl;
 
     for (seen_nl = 0;;) {
         if (eb_prevc(b, offset, &offset1) == '\n') {
@@ -2490,9 +4114,9 @@ int eb_prev_line(EditBuffer *b, int offset)
 }
 
 /* return offset of the beginning of the line containing offset */
-int eb_goto_bol(EditBuffer *b, int offset)
+QEOffset eb_goto_bol(EditBuffer *b, QEOffset offset)
 {
-    int offset1;
+    QEOffset offset1;
 
     for (;;) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2505,9 +4129,10 @@ int eb_goto_bol(EditBuffer *b, int offset)
 /* move to the beginning of the line containing offset */
 /* return offset of the beginning of the line containing offset */
 /* store count of characters skipped at *countp */
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
+QEOffset eb_goto_bol2(EditBuffer *b, QEOffset offset, int *countp)
 {
-    int count, offset1;
+    QEOffset offset1;
+    int count;
 
     for (count = 0;; count++) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2518,9 +4143,10 @@ int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
     return offset;
 }
 
-int eb_goto_indentation(EditBuffer *b, int offset)
+QEOffset eb_goto_indentation(EditBuffer *b, QEOffset offset)
 {
-    int offset1, c;
+    QEOffset offset1;
+    int c;
 
     for (;;) {
         c = eb_prevc(b, offset, &offset1);
@@ -2537,7 +4163,7 @@ int eb_goto_indentation(EditBuffer *b, int offset)
  * return 0 if not blank.
  * return 1 if blank and store start of next line in <*offset1>.
  */
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1)
+int eb_is_blank_line(EditBuffer *b, QEOffset offset, QEOffset *offset1)
 {
     int c;
 
@@ -2551,9 +4177,10 @@ int eb_is_blank_line(EditBuffer *b, int offset, int *offset1)
 }
 
 /* like eb_is_blank_line but also looks back to bol. */
-int eb_is_blank_line1(EditBuffer *b, int offset, int *offset1)
+int eb_is_blank_line1(EditBuffer *b, QEOffset offset, QEOffset *offset1)
 {
-    int c, start_point = offset;
+    QEOffset start_point = offset;
+    int c;
 
     while ((c = eb_nextc(b, offset, &offset)) != '\n') {
         if (!qe_isblank(c)) {
@@ -2576,7 +4203,7 @@ int eb_is_blank_line1(EditBuffer *b, int offset, int *offset1)
 }
 
 /* check if <offset> is within indentation. */
-int eb_is_in_indentation(EditBuffer *b, int offset)
+int eb_is_in_indentation(EditBuffer *b, QEOffset offset)
 {
     int c;
 
@@ -2588,9 +4215,10 @@ int eb_is_in_indentation(EditBuffer *b, int offset)
 }
 
 /* return offset of the end of the line containing offset */
-int eb_goto_eol(EditBuffer *b, int offset1)
+QEOffset eb_goto_eol(EditBuffer *b, QEOffset offset1)
 {
-    int c, offset;
+    QEOffset offset;
+    int c;
 
     for (;;) {
         offset = offset1;
@@ -2601,7 +4229,7 @@ int eb_goto_eol(EditBuffer *b, int offset1)
     return offset;
 }
 
-int eb_next_line(EditBuffer *b, int offset)
+QEOffset eb_next_line(EditBuffer *b, QEOffset offset)
 {
     int c;
 
@@ -2615,99 +4243,244 @@ int eb_next_line(EditBuffer *b, int offset)
 
 /* buffer property handling */
 
+/* Properties are kept in a treap ordered by offset, and threaded in a
+ * doubly linked list in the same order for iteration.  Offset updates
+ * caused by buffer modifications are applied lazily: a subtree whose
+ * offsets all move by the same amount just gets a pending shift, which
+ * is pushed down to the children when the subtree is next traversed.
+ * Hence adding, looking up and moving properties is O(log n).  The
+ * list is only usable after eb_property_list() has flushed the pending
+ * shifts.
+ */
+
+static unsigned int prop_seed = 1;
+
+static void prop_push(QEProperty *p)
+{
+    if (p->shift) {
+        if (p->left) {
+            p->left->offset += p->shift;
+            p->left->shift += p->shift;
+        }
+        if (p->right) {
+            p->right->offset += p->shift;
+            p->right->shift += p->shift;
+        }
+        p->shift = 0;
+    }
+}
+
+/* split t into properties before offset and the others */
+static void prop_split(QEProperty *t, QEOffset offset,
+                       QEProperty **lp, QEProperty **rp)
+{
+    if (!t) {
+        *lp = *rp = NULL;
+        return;
+    }
+    prop_push(t);
+    if (t->offset < offset) {
+        prop_split(t->right, offset, &t->right, rp);
+        *lp = t;
+    } else {
+        prop_split(t->left, offset, lp, &t->left);
+        *rp = t;
+    }
+}
+
+/* merge a and b, all properties in a being before those in b */
+static QEProperty *prop_merge(QEProperty *a, QEProperty *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->priority > b->priority) {
+        prop_push(a);
+        a->right = prop_merge(a->right, b);
+        return a;
+    } else {
+        prop_push(b);
+        b->left = prop_merge(a, b->left);
+        return b;
+    }
+}
+
+static QEProperty *prop_leftmost(QEProperty *t)
+{
+    while (t->left)
+        t = t->left;
+    return t;
+}
+
+static QEProperty *prop_rightmost(QEProperty *t)
+{
+    while (t->right)
+        t = t->right;
+    return t;
+}
+
+static void prop_free_tree(QEProperty *t)
+{
+    if (t) {
+        prop_free_tree(t->left);
+        prop_free_tree(t->right);
+        if (t->type & QE_PROP_FREE) {
+            qe_free(&t->data);
+        }
+        qe_free(&t);
+    }
+}
+
+static void prop_flush(QEProperty *t)
+{
+    for (; t; t = t->right) {
+        prop_push(t);
+        prop_flush(t->left);
+    }
+}
+
+/* move the properties at or after offset by delta */
+static void eb_shift_properties(EditBuffer *b, QEOffset offset,
+                                QEOffset delta)
+{
+    QEProperty *l, *r;
+
+    prop_split(b->property_tree, offset, &l, &r);
+    if (r) {
+        r->offset += delta;
+        r->shift += delta;
+        b->property_shifted = 1;
+    }
+    b->property_tree = prop_merge(l, r);
+}
+
+static void eb_remove_properties(EditBuffer *b, QEOffset offset,
+                                 QEOffset offset2)
+{
+    QEProperty *l, *m, *r, *first, *last;
+
+    prop_split(b->property_tree, offset, &l, &r);
+    prop_split(r, offset2, &m, &r);
+    b->property_tree = prop_merge(l, r);
+    if (m) {
+        /* removed properties are contiguous in the list */
+        first = prop_leftmost(m);
+        last = prop_rightmost(m);
+        if (first->prev)
+            first->prev->next = last->next;
+        else
+            b->property_list = last->next;
+        if (last->next)
+            last->next->prev = first->prev;
+        prop_free_tree(m);
+    }
+}
+
 static void eb_plist_callback(EditBuffer *b, void *opaque, int edge,
-                              enum LogOperation op, int offset, int size)
+                              enum LogOperation op,
+                              QEOffset offset, QEOffset size)
 {
-    QEProperty **pp;
-    QEProperty *p;
-                                 
     /* update properties */
     if (op == LOGOP_INSERT) {
-        for (p = b->property_list; p; p = p->next) {
-            if (p->offset >= offset)
-                p->offset += size;
-        }
+        eb_shift_properties(b, offset, size);
     } else
     if (op == LOGOP_DELETE) {
-        for (pp = &b->property_list; (p = *pp) != NULL;) {
-            if (p->offset >= offset) {
-                if (p->offset < offset + size) {
-                    /* property is anchored inside block: remove it */
-                    *pp = (*pp)->next;
-                    if (p->type & QE_PROP_FREE) {
-                        qe_free(&p->data);
-                    }
-                    qe_free(&p);
-                    continue;
-                }
-                p->offset -= size;
-            }
-            pp = &(*pp)->next;
-        }
+        /* properties anchored inside block are removed */
+        eb_remove_properties(b, offset, offset + size);
+        eb_shift_properties(b, offset + size, -size);
     }
 }
 
-void eb_add_property(EditBuffer *b, int offset, int type, void *data) {
-    QEProperty *p;
-    QEProperty **pp;
+void eb_add_property(EditBuffer *b, QEOffset offset, int type, void *data) {
+    QEProperty *p, *l, *m, *r, *last, *prev;
 
-    if (!b->property_list) {
+    if (!b->property_tree) {
+        /* the callback is still registered if the last properties were
+           removed by a deletion */
+        eb_free_callback(b, eb_plist_callback, NULL);
         eb_add_callback(b, eb_plist_callback, NULL, 0);
     }
 
-    for (pp = &b->property_list; (p = *pp) != NULL; pp = &(*pp)->next) {
-        if (p->offset >= offset) {
-            if (p->offset == offset) {
-                if (p->type == type && type == QE_PROP_TAG) {
-                    /* prevent tag duplicates */
-                    if (strequal(p->data, data))
-                        return;
-                }
-                continue;
+    prop_split(b->property_tree, offset, &l, &r);
+    prop_split(r, offset + 1, &m, &r);
+    last = m ? prop_rightmost(m) : NULL;
+    if (type == QE_PROP_TAG && m) {
+        /* prevent tag duplicates */
+        for (p = prop_leftmost(m);; p = p->next) {
+            if (p->type == type && strequal(p->data, data)) {
+                b->property_tree = prop_merge(prop_merge(l, m), r);
+                return;
             }
-            break;
+            if (p == last)
+                break;
         }
     }
+    prev = last ? last : l ? prop_rightmost(l) : NULL;
 
     p = qe_mallocz(QEProperty);
     p->offset = offset;
     p->type = type;
     p->data = data;
-    p->next = *pp;
-    *pp = p;
+    prop_seed = prop_seed * 1103515245 + 12345;
+    p->priority = prop_seed >> 8;
+    p->prev = prev;
+    p->next = prev ? prev->next : b->property_list;
+    if (p->next)
+        p->next->prev = p;
+    if (prev)
+        prev->next = p;
+    else
+        b->property_list = p;
+    b->property_tree = prop_merge(prop_merge(l, prop_merge(m, p)), r);
+}
+
+/* return the list of properties of b in offset order */
+QEProperty *eb_property_list(EditBuffer *b)
+{
+    if (b->property_shifted) {
+        prop_flush(b->property_tree);
+        b->property_shifted = 0;
+    }
+    return b->property_list;
 }
 
-QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type) {
-    QEProperty *found = NULL;
+static QEProperty *prop_find_last(QEProperty *t, QEOffset offset,
+                                  QEOffset offset2, int type)
+{
     QEProperty *p;
-    for (p = b->property_list; p && p->offset < offset2; p = p->next) {
-        if (p->offset >= offset && p->type == type) {
-            /* return the last property between offset and offset2 */
-            found = p;
+
+    while (t) {
+        prop_push(t);
+        if (t->offset >= offset2) {
+            t = t->left;
+            continue;
         }
+        p = prop_find_last(t->right, offset, offset2, type);
+        if (p)
+            return p;
+        if (t->offset < offset)
+            break;
+        if (t->type == type)
+            return t;
+        t = t->left;
     }
-    return found;
+    return NULL;
 }
 
-void eb_delete_properties(EditBuffer *b, int offset, int offset2) {
-    QEProperty *p;
-    QEProperty **pp;
+QEProperty *eb_find_property(EditBuffer *b, QEOffset offset,
+                             QEOffset offset2, int type) {
+    /* return the last property between offset and offset2 */
+    return prop_find_last(b->property_tree, offset, offset2, type);
+}
 
-    if (!b->property_list)
+void eb_delete_properties(EditBuffer *b, QEOffset offset, QEOffset offset2) {
+    if (!b->property_tree)
         return;
 
-    for (pp = &b->property_list; (p = *pp) != NULL && p->offset < offset2;) {
-        if (p->offset >= offset && p->offset < offset2) {
-            *pp = (*pp)->next;
-            if (p->type & QE_PROP_FREE) {
-                qe_free(&p->data);
-            }
-            qe_free(&p);
-        } else {
-            pp = &(*pp)->next;
-        }
-    }
-    if (!b->property_list) {
+    eb_remove_properties(b, offset, offset2);
+    if (!b->property_tree) {
+        b->property_shifted = 0;
         eb_free_callback(b, eb_plist_callback, NULL);
     }
 }
@@ -2729,7 +4502,8 @@ void eb_register_data_type(EditBufferDataType *bdt)
 /* Write buffer contents between <start> and <end> to file <filename>,
  * return bytes written or -1 if error
  */
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename)
+QEOffset eb_write_buffer(EditBuffer *b, QEOffset start, QEOffset end,
+                         const char *filename)
 {
     if (!b->data_type->buffer_save)
         return -1;
@@ -2737,13 +4511,59 @@ int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename)
     return b->data_type->buffer_save(b, start, end, filename);
 }
 
+/* copy file filename to backup file backup, return 0 if OK or -1 if
+ * error
+ */
+static int eb_backup_file(const char *filename, const char *backup)
+{
+    unsigned char buf[IOBUF_SIZE];
+    struct stat st;
+    int fd, fd1, len, ret;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    /* do not write through a link to another file */
+    unlink(backup);
+    fd1 = open(backup, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (fd1 < 0) {
+        close(fd);
+        return -1;
+    }
+    ret = 0;
+    for (;;) {
+        len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            ret = len;
+            break;
+        }
+        if (write(fd1, buf, len) != len) {
+            ret = -1;
+            break;
+        }
+    }
+    close(fd);
+    if (close(fd1) < 0)
+        ret = -1;
+    if (ret < 0)
+        unlink(backup);
+    return ret;
+}
+
 /* Save buffer contents to buffer associated file, handle backups,
  * return bytes written or -1 if error
  */
-int eb_save_buffer(EditBuffer *b)
+QEOffset eb_save_buffer(EditBuffer *b)
 {
     QEmacsState *qs = &qe_state;
-    int ret, st_mode;
+    QEOffset ret;
+    int st_mode;
     char buf1[MAX_FILENAME_SIZE];
     const char *filename;
     struct stat st;
@@ -2754,15 +4574,17 @@ int eb_save_buffer(EditBuffer *b)
     filename = b->filename;
     /* get old file permission */
     st_mode = 0644;
-    if (stat(filename, &st) == 0)
-        st_mode = st.st_mode & 0777;
-
-    if (!qs->backup_inhibited
-    &&  strlen(filename) < MAX_FILENAME_SIZE - 1) {
-        /* backup old file if present */
-        if (snprintf(buf1, sizeof(buf1), "%s~", filename) < ssizeof(buf1)) {
-            // should check error code
-            rename(filename, buf1);
+    if (stat(filename, &st) == 0) {
+        st_mode = st.st_mode & 07777;
+
+        if (!qs->backup_inhibited
+        &&  strlen(filename) < MAX_FILENAME_SIZE - 1) {
+            /* backup old file by copying it: the file stays in place
+               until the new contents replace it */
+            if (snprintf(buf1, sizeof(buf1), "%s~", filename) < ssizeof(buf1)) {
+                // should check error code
+                eb_backup_file(filename, buf1);
+            }
         }
     }
 
@@ -19,6 +19,17 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+/* SIMD headers must come first: they use the allocation functions
+ * that qe.h disables.
+ */
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CONFIG_SCAN_SSE2  1
+#if __GNUC__ >= 5 || defined(__clang__)
+#define CONFIG_SCAN_AVX2  1
+#endif
+#endif
+
 #include "qe.h"
 
 /* XXX: Should move this to QEmacsState, and find a way for html2png */
@@ -104,6 +115,116 @@ static unsigned char const utf8_first_code_mask[7] = {
     0, 0, 0x1f, 0xf, 0x7, 0x3, 0x1,
 };
 
+/********************************************************/
+/* byte scanning kernels */
+
+/* The page scanners count newlines and utf-8 lead bytes over whole
+ * pages each time the cached counts are invalidated.  The counting is
+ * done by count_range(), an SSE2 or AVX2 version is selected at run
+ * time by charset_init() when available.
+ */
+
+/* return the number of bytes of buf[0..size) in the range lo..hi */
+static int count_range_c(const u8 *buf, int size, int lo, int hi)
+{
+    int i, count = 0;
+    unsigned int d = hi - lo;
+
+    for (i = 0; i < size; i++)
+        count += ((unsigned int)(buf[i] - lo) <= d);
+    return count;
+}
+
+#ifdef CONFIG_SCAN_SSE2
+static int count_range_sse2(const u8 *buf, int size, int lo, int hi)
+{
+    __m128i vlo = _mm_set1_epi8((char)lo);
+    __m128i vd = _mm_set1_epi8((char)(hi - lo));
+    __m128i zero = _mm_setzero_si128();
+    __m128i x, acc;
+    int i = 0, j, count = 0;
+
+    while (size - i >= 16) {
+        /* byte counters are summed every 255 blocks */
+        acc = zero;
+        for (j = 0; j < 255 && size - i >= 16; j++, i += 16) {
+            x = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), vlo);
+            x = _mm_cmpeq_epi8(_mm_min_epu8(x, vd), x);
+            acc = _mm_sub_epi8(acc, x);
+        }
+        acc = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+    }
+    return count + count_range_c(buf + i, size - i, lo, hi);
+}
+#endif
+
+#ifdef CONFIG_SCAN_AVX2
+__attribute__((target("avx2")))
+static int count_range_avx2(const u8 *buf, int size, int lo, int hi)
+{
+    __m256i vlo = _mm256_set1_epi8((char)lo);
+    __m256i vd = _mm256_set1_epi8((char)(hi - lo));
+    __m256i zero = _mm256_setzero_si256();
+    __m256i x, acc;
+    __m128i sum;
+    int i = 0, j, count = 0;
+
+    while (size - i >= 32) {
+        acc = zero;
+        for (j = 0; j < 255 && size - i >= 32; j++, i += 32) {
+            x = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), vlo);
+            x = _mm256_cmpeq_epi8(_mm256_min_epu8(x, vd), x);
+            acc = _mm256_sub_epi8(acc, x);
+        }
+        acc = _mm256_sad_epu8(acc, zero);
+        sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                            _mm256_extracti128_si256(acc, 1));
+        count += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+    }
+    return count + count_range_sse2(buf + i, size - i, lo, hi);
+}
+#endif
+
+static int (*count_range)(const u8 *buf, int size, int lo, int hi) =
+    count_range_c;
+
+/* block size for the skipping scans in goto functions */
+#define SCAN_BLOCK_SIZE  256
+
+static void charset_scan_init(void)
+{
+#ifdef CONFIG_SCAN_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        count_range = count_range_avx2;
+        return;
+    }
+#endif
+#ifdef CONFIG_SCAN_SSE2
+    count_range = count_range_sse2;
+#endif
+}
+
+/* return the number of utf-8 characters in buf[0..size), ie: the
+ * number of bytes that are not trailing bytes.
+ */
+static inline int count_utf8_chars(const u8 *buf, int size)
+{
+    return size - count_range(buf, size, 0x80, 0xBF);
+}
+
+/* return a pointer past the last byte c in buf[0..size) or NULL */
+static inline const u8 *find_last_byte(const u8 *buf, int size, int c)
+{
+    const u8 *p = buf + size;
+
+    while (p > buf) {
+        if (*--p == c)
+            return p + 1;
+    }
+    return NULL;
+}
+
 /********************************************************/
 /* raw */
 
@@ -454,19 +575,13 @@ static void charset_get_pos_utf8(CharsetDecodeState *s, const u8 *buf, int size,
 
     QASSERT(size >= 0);
 
-    line = 0;
     lp = p = buf;
     p1 = p + size;
     nl = s->eol_char;
 
-    for (;;) {
-        p = memchr(p, nl, p1 - p);
-        if (!p)
-            break;
-        p++;
-        lp = p;
-        line++;
-    }
+    line = count_range(p, size, nl, nl);
+    if (line)
+        lp = find_last_byte(p, size, nl);
     /* now compute number of chars (XXX: potential problem if out of
      * block, but for UTF8 it works) */
     col = 0;
@@ -481,28 +596,20 @@ static void charset_get_pos_utf8(CharsetDecodeState *s, const u8 *buf, int size,
 static int charset_get_chars_utf8(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
-    int nb_chars, c;
-    const u8 *buf_end, *buf_ptr;
+    int nb_chars;
 
-    nb_chars = 0;
-    buf_ptr = buf;
-    buf_end = buf_ptr + size;
-    while (buf_ptr < buf_end) {
-        c = *buf_ptr++;
-        if (c == '\n' && s->eol_type == EOL_DOS) {
-            /* ignore \n in EOL_DOS scan, but count \r.
-             * XXX: potentially incorrect if buffer contains
-             * \n not preceded by \r and requires special state
-             * data to handle \r\n sequence at page boundary.
-             */
-            continue;
-        }
-        /* ignoring trailing bytes: will produce incorrect
-         * count on isolated and trailing bytes and overlong
-         * sequences.
+    /* ignoring trailing bytes: will produce incorrect
+     * count on isolated and trailing bytes and overlong
+     * sequences.
+     */
+    nb_chars = count_utf8_chars(buf, size);
+    if (s->eol_type == EOL_DOS) {
+        /* ignore \n in EOL_DOS scan, but count \r.
+         * XXX: potentially incorrect if buffer contains
+         * \n not preceded by \r and requires special state
+         * data to handle \r\n sequence at page boundary.
          */
-        if (c < 0x80 || c >= 0xc0)
-            nb_chars++;
+        nb_chars -= count_range(buf, size, '\n', '\n');
     }
     /* CG: nb_chars is the number of character boundaries, trailing
      * utf-8 sequence at start of buffer is ignored in count while
@@ -518,12 +625,22 @@ static int charset_get_chars_utf8(CharsetDecodeState *s,
 static int charset_goto_char_utf8(CharsetDecodeState *s,
                                   const u8 *buf, int size, int pos)
 {
-    int nb_chars, c;
+    int nb_chars, c, n;
     const u8 *buf_ptr, *buf_end;
 
     nb_chars = 0;
     buf_ptr = buf;
     buf_end = buf_ptr + size;
+    /* skip blocks that end before the target character */
+    while (buf_end - buf_ptr >= SCAN_BLOCK_SIZE) {
+        n = count_utf8_chars(buf_ptr, SCAN_BLOCK_SIZE);
+        if (s->eol_type == EOL_DOS)
+            n -= count_range(buf_ptr, SCAN_BLOCK_SIZE, '\n', '\n');
+        if (nb_chars + n > pos)
+            break;
+        nb_chars += n;
+        buf_ptr += SCAN_BLOCK_SIZE;
+    }
     for (; buf_ptr < buf_end; buf_ptr++) {
         c = *buf_ptr;
         if (c >= 0x80 && c < 0xc0) {
@@ -1616,15 +1733,11 @@ void charset_get_pos_8bit(CharsetDecodeState *s, const u8 *buf, int size,
         lp++;
     }
 
-    for (;;) {
-        p = memchr(p, nl, p1 - p);
-        if (!p)
-            break;
-        p++;
-        if (s->eol_type == EOL_DOS && p < p1 && *p == '\n')
-            p++;
-        lp = p;
-        line++;
+    line = count_range(p, p1 - p, nl, nl);
+    if (line) {
+        lp = find_last_byte(p, p1 - p, nl);
+        if (s->eol_type == EOL_DOS && lp < p1 && *lp == '\n')
+            lp++;
     }
     col = p1 - lp;
     *line_ptr = line;
@@ -1635,7 +1748,7 @@ int charset_goto_line_8bit(CharsetDecodeState *s,
                            const u8 *buf, int size, int nlines)
 {
     const u8 *p, *p1, *lp;
-    int nl;
+    int nl, n;
 
     lp = p = buf;
     p1 = p + size;
@@ -1648,6 +1761,20 @@ int charset_goto_line_8bit(CharsetDecodeState *s,
         lp++;
     }
 
+    /* skip blocks with fewer EOL characters than needed */
+    while (nlines > 0 && p1 - p >= SCAN_BLOCK_SIZE) {
+        n = count_range(p, SCAN_BLOCK_SIZE, nl, nl);
+        if (n >= nlines)
+            break;
+        if (n > 0) {
+            lp = find_last_byte(p, SCAN_BLOCK_SIZE, nl);
+            if (s->eol_type == EOL_DOS && lp < p1 && *lp == '\n')
+                lp++;
+            nlines -= n;
+        }
+        p += SCAN_BLOCK_SIZE;
+    }
+
     while (nlines > 0) {
         p = memchr(p, nl, p1 - p);
         if (!p)
@@ -1664,21 +1791,11 @@ int charset_goto_line_8bit(CharsetDecodeState *s,
 int charset_get_chars_8bit(CharsetDecodeState *s,
                            const u8 *buf, int size)
 {
-    int count = size;
-    const u8 *buf_end, *buf_ptr;
-
     if (s->eol_type != EOL_DOS)
-        return count;
+        return size;
 
-    buf_ptr = buf;
-    buf_end = buf_ptr + count;
-    while (buf_ptr < buf_end) {
-        if (*buf_ptr++ == '\n') {
-            /* ignore \n in EOL_DOS scan, but count \r. (see above) */
-            count--;
-        }
-    }
-    return count;
+    /* ignore \n in EOL_DOS scan, but count \r. (see above) */
+    return size - count_range(buf, size, '\n', '\n');
 }
 
 int charset_goto_char_8bit(CharsetDecodeState *s,
@@ -1719,6 +1836,8 @@ void charset_init(void)
         unicode_glyph_range_index[ucs >> 12] = ip;
     }
 
+    charset_scan_init();
+
     qe_register_charset(&charset_raw);
     qe_register_charset(&charset_8859_1);
     qe_register_charset(&charset_vt100);
@@ -1729,3 +1848,115 @@ void charset_init(void)
     qe_register_charset(&charset_ucs4le);
     qe_register_charset(&charset_ucs4be);
 }
+
+#ifdef TEST
+/* Check the byte scanning kernels against each other and time them:
+ * charset [size [loops]]
+ */
+
+typedef int (*CountRangeFunc)(const u8 *buf, int size, int lo, int hi);
+
+static const struct {
+    const char *name;
+    CountRangeFunc func;
+} scan_kernels[] = {
+    { "c", count_range_c },
+#ifdef CONFIG_SCAN_SSE2
+    { "sse2", count_range_sse2 },
+#endif
+#ifdef CONFIG_SCAN_AVX2
+    { "avx2", count_range_avx2 },
+#endif
+};
+
+static int scan_kernel_ok(int k)
+{
+#ifdef CONFIG_SCAN_AVX2
+    if (scan_kernels[k].func == count_range_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+static const int scan_ranges[][2] = {
+    { '\n', '\n' }, { 0x80, 0xBF }, { 0x00, 0xFF }, { 0x20, 0x7E },
+};
+
+/* check all kernels on buf[start..start+size) */
+static int scan_check(const u8 *buf, int start, int size)
+{
+    int r, k, lo, hi, ref, n;
+
+    for (r = 0; r < countof(scan_ranges); r++) {
+        lo = scan_ranges[r][0];
+        hi = scan_ranges[r][1];
+        ref = count_range_c(buf + start, size, lo, hi);
+        for (k = 1; k < countof(scan_kernels); k++) {
+            if (!scan_kernel_ok(k))
+                continue;
+            n = scan_kernels[k].func(buf + start, size, lo, hi);
+            if (n != ref) {
+                printf("%s: start=%d size=%d range=%02x..%02x: %d != %d\n",
+                       scan_kernels[k].name, start, size, lo, hi, n, ref);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int size = argc > 1 ? atoi(argv[1]) : 1 << 20;
+    int loops = argc > 2 ? atoi(argv[2]) : 1000;
+    int i, k, start, len, errors, count, t;
+    unsigned int seed = 1;
+    u8 *buf;
+
+    if (size < 16384)
+        size = 16384;
+    buf = qe_malloc_array(u8, size);
+    if (!buf)
+        return 1;
+
+    /* text with newlines and utf-8 sequences */
+    for (i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        k = (seed >> 16) & 63;
+        buf[i] = (k == 0) ? '\n' : (k < 8) ? 0x80 + k * 8 : (k < 12) ? 0xC3 :
+            ' ' + (seed >> 24) % 95;
+    }
+
+    /* unaligned heads and tails around the vector and counter block
+       sizes */
+    errors = 0;
+    for (start = 0; start < 64; start++) {
+        for (len = 0; len < 300; len++)
+            errors += scan_check(buf, start, len);
+        for (len = 255 * 16 - 40; len < 255 * 32 + 40; len += 7)
+            errors += scan_check(buf, start, len);
+    }
+    errors += scan_check(buf, 0, size);
+    /* byte counters must not overflow on long runs of matches */
+    memset(buf, '\n', 16384);
+    for (start = 0; start < 33; start++)
+        errors += scan_check(buf, start, 16384 - start);
+    memset(buf + 8192, 0x80, 4096);
+    errors += scan_check(buf, 1, 16000);
+    printf("check: %s\n", errors ? "FAILED" : "OK");
+
+    for (k = 0; k < countof(scan_kernels); k++) {
+        if (!scan_kernel_ok(k))
+            continue;
+        count = 0;
+        t = get_clock_ms();
+        for (i = 0; i < loops; i++)
+            count += scan_kernels[k].func(buf, size, '\n', '\n');
+        t = get_clock_ms() - t;
+        printf("%-5s %6d ms  %8.1f MB/s  (%d)\n", scan_kernels[k].name, t,
+               t ? (double)size * loops / t / 1000 : 0.0, count);
+    }
+    qe_free(&buf);
+    return errors != 0;
+}
+#endif
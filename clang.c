@@ -712,10 +712,10 @@ enum {
 };
 
 /* Check if indentation is already what it should be */
-static int check_indent(EditState *s, int offset, int i, int *offset_ptr)
+static int check_indent(EditState *s, QEOffset offset, int i, QEOffset *offset_ptr)
 {
     int tw, col, ntabs, nspaces, bad;
-    int offset1;
+    QEOffset offset1;
 
     tw = s->b->tab_width > 0 ? s->b->tab_width : 8;
     col = ntabs = nspaces = bad = 0;
@@ -752,7 +752,7 @@ static int check_indent(EditState *s, int offset, int i, int *offset_ptr)
  * Store new offset after indentation to <*offset_ptr>.
  * Tabs are inserted if s->indent_tabs_mode is true.
  */
-static void insert_indent(EditState *s, int offset, int i, int *offset_ptr)
+static void insert_indent(EditState *s, QEOffset offset, int i, QEOffset *offset_ptr)
 {
     /* insert tabs */
     if (s->indent_tabs_mode) {
@@ -770,9 +770,10 @@ static void insert_indent(EditState *s, int offset, int i, int *offset_ptr)
 }
 
 /* indent a line of C code starting at <offset> */
-static void c_indent_line(EditState *s, int offset0)
+static void c_indent_line(EditState *s, QEOffset offset0)
 {
-    int offset, offset1, offsetl, c, pos, line_num, col_num;
+    QEOffset offset, offset1, offsetl;
+    int c, pos, line_num, col_num;
     int i, j, eoi_found, len, pos1, lpos, style, line_num1, state;
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
@@ -1005,8 +1006,10 @@ static void c_indent_line(EditState *s, int offset0)
     /* Do not modify buffer if indentation in correct */
     if (!check_indent(s, offset, pos, &offset1)) {
         /* simple approach to normalization of indentation */
+        eb_begin_transaction(s->b);
         eb_delete_range(s->b, offset, offset1);
         insert_indent(s, offset, pos, &offset1);
+        eb_end_transaction(s->b);
     }
 #if 0
     if (s->mode->auto_indent > 1) {  /* auto format */
@@ -1047,7 +1050,7 @@ static void do_c_indent(EditState *s)
 
 static void do_c_electric(EditState *s, int key)
 {
-    int offset = s->offset;
+    QEOffset offset = s->offset;
     int was_preview = s->b->flags & BF_PREVIEW;
 
     do_char(s, key, 1);
@@ -1060,7 +1063,7 @@ static void do_c_electric(EditState *s, int key)
 
 static void do_c_return(EditState *s)
 {
-    int offset = s->offset;
+    QEOffset offset = s->offset;
     int was_preview = s->b->flags & BF_PREVIEW;
 
     /* XXX: should also remove trailing spaces on current line */
@@ -1072,7 +1075,7 @@ static void do_c_return(EditState *s)
     if (s->mode->auto_indent && s->mode->indent_func) {
         /* delete blanks at end of line (necessary for non blank lines) */
         /* XXX: should factorize with do_delete_horizontal_space() */
-        int from = offset, to = offset;
+        QEOffset from = offset, to = offset;
         while (qe_isblank(eb_prevc(s->b, from, &offset)))
             from = offset;
         eb_delete_range(s->b, from, to);
@@ -1089,7 +1092,7 @@ static void do_c_forward_conditional(EditState *s, int dir)
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, sharp, level;
-    int offset, offset0, offset1;
+    QEOffset offset, offset0, offset1;
 
     offset = offset0 = eb_goto_bol(s->b, s->offset);
     eb_get_pos(s->b, &line_num, &col_num, offset);
@@ -1150,7 +1153,7 @@ static void do_c_list_conditionals(EditState *s)
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, sharp, level;
-    int offset, offset1;
+    QEOffset offset, offset1;
     EditBuffer *b;
 
     b = eb_scratch("Preprocessor conditionals", BF_UTF8);
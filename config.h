@@ -0,0 +1,18 @@
+/* Automatically generated by configure - do not modify */
+#define CONFIG_QE_PREFIX "/usr/local"
+#define CONFIG_QE_DATADIR "/usr/local/share"
+#define CONFIG_QE_MANDIR "/usr/local/man"
+#define ARCH_X86_64 1
+#define CONFIG_HAS_TYPEOF 1
+#define CONFIG_UNLOCKIO 1
+#define CONFIG_PTSNAME 1
+#define QE_VERSION "5.2alpha"
+#define CONFIG_NETWORK 1
+#define CONFIG_HTML 1
+#define CONFIG_DLL 1
+#define CONFIG_INIT_CALLS 1
+#define CONFIG_PNG_OUTPUT 1
+#define CONFIG_ALL_KMAPS 1
+#define CONFIG_MMAP 1
+#define CONFIG_ALL_MODES 1
+#define CONFIG_UNICODE_JOIN 1
@@ -94,7 +94,7 @@ struct DiredItem {
     dev_t   rdev;   /* device type, for special file inode */
     time_t  mtime;
     off_t   size;
-    int     offset;
+    QEOffset offset;
     char    hidden;
     char    mark;
     char    name[1];
@@ -1185,7 +1185,7 @@ static void dired_display_hook(EditState *s)
     }
 }
 
-static char *dired_get_default_path(EditBuffer *b, int offset, 
+static char *dired_get_default_path(EditBuffer *b, QEOffset offset,
                                     char *buf, int buf_size)
 {
     if (is_directory(b->filename)) {
@@ -1429,7 +1429,8 @@ static void filelist_display_hook(EditState *s)
     char filename[MAX_FILENAME_SIZE];
     QEmacsState *qs = s->qe_state;
     EditState *e;
-    int i, len, offset, target_line;
+    QEOffset offset;
+    int i, len, target_line;
 
     offset = eb_goto_bol(s->b, s->offset);
     len = eb_fgets(s->b, buf, sizeof(buf), offset, &offset);
@@ -24,12 +24,12 @@
 #include "qfribidi.h"
 #include "variables.h"
 
-static int qe_skip_comments(EditState *s, int offset, int *offsetp)
+static int qe_skip_comments(EditState *s, QEOffset offset, QEOffset *offsetp)
 {
     unsigned int buf[COLORED_MAX_LINE_SIZE];
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, len, pos;
-    int offset0, offset1;
+    QEOffset offset0, offset1;
 
     if (!s->colorize_func && !s->b->b_styles)
         return 0;
@@ -53,9 +53,9 @@ static int qe_skip_comments(EditState *s, int offset, int *offsetp)
     return 1;
 }
 
-static int qe_skip_spaces(EditState *s, int offset, int *offsetp)
+static int qe_skip_spaces(EditState *s, QEOffset offset, QEOffset *offsetp)
 {
-    int offset0 = offset, offset1;
+    QEOffset offset0 = offset, offset1;
 
     while (offset < s->b->total_size
         && qe_isspace(eb_nextc(s->b, offset, &offset1))) {
@@ -69,30 +69,31 @@ static int qe_skip_spaces(EditState *s, int offset, int *offsetp)
 }
 
 static void compare_resync(EditState *s1, EditState *s2,
-                           int save1, int save2,
-                           int *offset1_ptr, int *offset2_ptr)
+                           QEOffset save1, QEOffset save2,
+                           QEOffset *offset1_ptr, QEOffset *offset2_ptr)
 {
-    int pos1, off1, pos2, off2;
+    QEOffset pos1, off1, pos2, off2;
+    EditBufferCursor cur1, cur2;
     int ch1, ch2;
 
-    off1 = save1;
-    off2 = save2;
+    eb_cursor_init(&cur1, s1->b, save1);
+    eb_cursor_init(&cur2, s2->b, save2);
     /* try skipping blanks */
-    while (qe_isblank(ch1 = eb_nextc(s1->b, pos1 = off1, &off1)))
+    while (pos1 = cur1.offset, qe_isblank(ch1 = eb_cursor_nextc(&cur1)))
         continue;
-    while (qe_isblank(ch2 = eb_nextc(s2->b, pos2 = off2, &off2)))
+    while (pos2 = cur2.offset, qe_isblank(ch2 = eb_cursor_nextc(&cur2)))
         continue;
     if (ch1 != ch2) {
         /* try skipping current words and subsequent blanks */
-        off1 = pos1;
-        off2 = pos2;
-        while (!qe_isspace(ch1 = eb_nextc(s1->b, pos1 = off1, &off1)))
+        eb_cursor_init(&cur1, s1->b, pos1);
+        eb_cursor_init(&cur2, s2->b, pos2);
+        while (pos1 = cur1.offset, !qe_isspace(ch1 = eb_cursor_nextc(&cur1)))
             continue;
-        while (!qe_isspace(ch2 = eb_nextc(s2->b, pos2 = off2, &off2)))
+        while (pos2 = cur2.offset, !qe_isspace(ch2 = eb_cursor_nextc(&cur2)))
             continue;
-        while (qe_isblank(ch1 = eb_nextc(s1->b, pos1 = off1, &off1)))
+        while (pos1 = cur1.offset, qe_isblank(ch1 = eb_cursor_nextc(&cur1)))
             continue;
-        while (qe_isblank(ch2 = eb_nextc(s2->b, pos2 = off2, &off2)))
+        while (pos2 = cur2.offset, qe_isblank(ch2 = eb_cursor_nextc(&cur2)))
             continue;
         if (ch1 != ch2) {
             /* Try to resync from end of line */
@@ -114,8 +115,9 @@ void do_compare_windows(EditState *s, int argval)
     QEmacsState *qs = s->qe_state;
     EditState *s1;
     EditState *s2;
-    int offset1, offset2, size1, size2, ch1, ch2;
-    int tries, resync = 0;
+    QEOffset offset1, offset2, size1, size2;
+    EditBufferCursor cur1, cur2;
+    int ch1, ch2, tries, resync = 0;
     char buf1[MAX_CHAR_BYTES + 2], buf2[MAX_CHAR_BYTES + 2];
     const char *comment = "";
 
@@ -144,6 +146,8 @@ void do_compare_windows(EditState *s, int argval)
         resync = 1;
     }
 
+    eb_cursor_init(&cur1, s1->b, s1->offset);
+    eb_cursor_init(&cur2, s2->b, s2->offset);
     for (tries = 0;; resync = 0) {
 
         if (++tries >= 100000) {
@@ -156,13 +160,15 @@ void do_compare_windows(EditState *s, int argval)
             offset1 = s1->offset;
             ch1 = EOF;
         } else {
-            ch1 = eb_nextc(s1->b, s1->offset, &offset1);
+            ch1 = eb_cursor_nextc(&cur1);
+            offset1 = cur1.offset;
         }
         if (s2->offset >= size2) {
             offset2 = s2->offset;
             ch2 = EOF;
         } else {
-            ch2 = eb_nextc(s2->b, s2->offset, &offset2);
+            ch2 = eb_cursor_nextc(&cur2);
+            offset2 = cur2.offset;
         }
         if (ch1 != ch2) {
             if (qs->ignore_spaces) {
@@ -170,6 +176,8 @@ void do_compare_windows(EditState *s, int argval)
                 if (qe_isspace(ch1) || qe_isspace(ch2)) {
                     qe_skip_spaces(s1, s1->offset, &s1->offset);
                     qe_skip_spaces(s2, s2->offset, &s2->offset);
+                    eb_cursor_init(&cur1, s1->b, s1->offset);
+                    eb_cursor_init(&cur2, s2->b, s2->offset);
                     if (!*comment)
                         comment = "Skipped spaces, ";
                     continue;
@@ -178,6 +186,8 @@ void do_compare_windows(EditState *s, int argval)
             if (qs->ignore_comments) {
                 if (qe_skip_comments(s1, s1->offset, &s1->offset) |
                     qe_skip_comments(s2, s2->offset, &s2->offset)) {
+                    eb_cursor_init(&cur1, s1->b, s1->offset);
+                    eb_cursor_init(&cur2, s2->b, s2->offset);
                     comment = "Skipped comments, ";
                     continue;
                 }
@@ -187,10 +197,11 @@ void do_compare_windows(EditState *s, int argval)
                 break;
             }
             if (resync) {
-                int save1 = s1->offset, save2 = s2->offset;
+                QEOffset save1 = s1->offset, save2 = s2->offset;
                 compare_resync(s1, s2, save1, save2, &s1->offset, &s2->offset);
-                put_status(s, "Skipped %d and %d bytes",
-                           s1->offset - save1, s2->offset - save2);
+                put_status(s, "Skipped %lld and %lld bytes",
+                           (long long)(s1->offset - save1),
+                           (long long)(s2->offset - save2));
                 break;
             }
             put_status(s, "%sDifference: '%s' [0x%02X] <-> '%s' [0x%02X]", comment,
@@ -262,7 +273,7 @@ void do_compare_files(EditState *s, const char *filename, int bflags)
 
 void do_delete_horizontal_space(EditState *s)
 {
-    int from, to, offset;
+    QEOffset from, to, offset;
 
     /* boundary check unnecessary because eb_prevc returns '\n'
      * at bof and eof and qe_isblank return true only on SPC and TAB.
@@ -285,7 +296,8 @@ static void do_delete_blank_lines(EditState *s)
      * On nonblank line, delete any immediately following blank lines.
      */
     /* XXX: should simplify */
-    int from, offset, offset0, offset1, all = 0;
+    QEOffset from, offset, offset0, offset1;
+    int all = 0;
     EditBuffer *b = s->b;
 
     offset = eb_goto_bol(b, s->offset);
@@ -320,7 +332,7 @@ static void do_delete_blank_lines(EditState *s)
     eb_delete_range(b, from, offset);
 }
 
-static void eb_tabify(EditBuffer *b, int p1, int p2)
+static void eb_tabify(EditBuffer *b, QEOffset p1, QEOffset p2)
 {
     /* We implement a complete analysis of the region instead of
      * scanning for certain space patterns (such as / [ \t]/).  It is
@@ -335,14 +347,15 @@ static void eb_tabify(EditBuffer *b, int p1, int p2)
      * one line cache.
      */
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max(0, min(p1, p2));
-    int stop = min(b->total_size, max(p1, p2));
+    QEOffset start = max_offset(0, min_offset(p1, p2));
+    QEOffset stop = min_offset(b->total_size, max_offset(p1, p2));
     int col;
-    int offset, offset1, offset2, delta;
+    QEOffset offset, offset1, offset2, delta;
 
     col = 0;
     offset = eb_goto_bol(b, start);
 
+    eb_begin_transaction(b);
     for (; offset < stop; offset = offset1) {
         int c = eb_nextc(b, offset, &offset1);
         if (c == '\r' || c == '\n') {
@@ -380,6 +393,7 @@ static void eb_tabify(EditBuffer *b, int p1, int p2)
             break;
         }
     }
+    eb_end_transaction(b);
 }
 
 static void do_tabify_buffer(EditState *s)
@@ -398,21 +412,22 @@ static void do_tabify_region(EditState *s)
     eb_tabify(s->b, s->b->mark, s->offset);
 }
 
-static void eb_untabify(EditBuffer *b, int p1, int p2)
+static void eb_untabify(EditBuffer *b, QEOffset p1, QEOffset p2)
 {
     /* We implement a complete analysis of the region instead of
      * potentially faster scan for '\t'.  It is fast enough and even
      * faster if there are lots of tabs.
      */
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max(0, min(p1, p2));
-    int stop = min(b->total_size, max(p1, p2));
+    QEOffset start = max_offset(0, min_offset(p1, p2));
+    QEOffset stop = min_offset(b->total_size, max_offset(p1, p2));
     int col, col0;
-    int offset, offset1, offset2, delta;
+    QEOffset offset, offset1, offset2, delta;
 
     col = 0;
     offset = eb_goto_bol(b, start);
 
+    eb_begin_transaction(b);
     for (; offset < stop; offset = offset1) {
         int c = eb_nextc(b, offset, &offset1);
         if (c == '\r' || c == '\n') {
@@ -436,6 +451,7 @@ static void eb_untabify(EditBuffer *b, int p1, int p2)
         offset1 += delta;
         stop += delta;
     }
+    eb_end_transaction(b);
 }
 
 static void do_untabify_buffer(EditState *s)
@@ -463,7 +479,7 @@ static void do_indent_region(EditState *s)
 
     /* Swap point and mark so mark <= point */
     if (s->offset < s->b->mark) {
-        int tmp = s->b->mark;
+        QEOffset tmp = s->b->mark;
         s->b->mark = s->offset;
         s->offset = tmp;
     }
@@ -475,6 +491,7 @@ static void do_indent_region(EditState *s)
         line2--;
 
     /* Iterate over all lines inside block */
+    eb_begin_transaction(s->b);
     for (; line1 <= line2; line1++) {
         if (s->mode->indent_func) {
             (s->mode->indent_func)(s, eb_goto_pos(s->b, line1, 0));
@@ -483,6 +500,7 @@ static void do_indent_region(EditState *s)
             do_tab(s, 1);
         }
     }
+    eb_end_transaction(s->b);
 }
 
 void do_show_date_and_time(EditState *s, int argval)
@@ -519,9 +537,9 @@ static void do_forward_block(EditState *s, int dir)
     int line_num, col_num, style, style0, c, level;
     int pos;      /* position of the current character on line */
     int len;      /* number of colorized positions */
-    int offset;   /* offset of the current character */
-    int offset0;  /* offset of the beginning of line */
-    int offset1;  /* offset of the beginning of the next line */
+    QEOffset offset;   /* offset of the current character */
+    QEOffset offset0;  /* offset of the beginning of line */
+    QEOffset offset1;  /* offset of the beginning of the next line */
 
     offset = s->offset;
     eb_get_pos(s->b, &line_num, &col_num, offset);
@@ -588,7 +606,8 @@ static void do_forward_block(EditState *s, int dir)
             case '\'':
                 if (pos >= len) {
                     /* simplistic string skip with escape char */
-                    int c1, off;
+                    int c1;
+                    QEOffset off;
                     while ((c1 = eb_prevc(s->b, offset, &off)) != '\n') {
                         offset = off;
                         pos--;
@@ -666,7 +685,8 @@ static void do_forward_block(EditState *s, int dir)
             case '\'':
                 if (pos >= len) {
                     /* simplistic string skip with escape char */
-                    int c1, off;
+                    int c1;
+                    QEOffset off;
                     while ((c1 = eb_nextc(s->b, offset, &off)) != '\n') {
                         offset = off;
                         pos++;
@@ -722,7 +742,7 @@ static void do_forward_block(EditState *s, int dir)
 
 static void do_kill_block(EditState *s, int dir)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     do_forward_block(s, dir);
     do_kill(s, start, s->offset, dir, 0);
@@ -731,8 +751,8 @@ static void do_kill_block(EditState *s, int dir)
 void do_transpose(EditState *s, int cmd)
 {
     QEmacsState *qs = s->qe_state;
-    int offset0, offset1, offset2, offset3, end_offset;
-    int size0, size1, size2;
+    QEOffset offset0, offset1, offset2, offset3, end_offset;
+    QEOffset size0, size1, size2;
     EditBuffer *b = s->b;
 
     if (check_read_only(s))
@@ -1149,7 +1169,7 @@ static int qe_term_get_style(const char *str, QETermStyle *style)
 
 static void do_set_region_color(EditState *s, const char *str)
 {
-    int offset, size;
+    QEOffset offset, size;
     QETermStyle style;
 
     /* deactivate region hilite */
@@ -1175,7 +1195,7 @@ static void do_set_region_color(EditState *s, const char *str)
 
 static void do_set_region_style(EditState *s, const char *str)
 {
-    int offset, size;
+    QEOffset offset, size;
     QETermStyle style;
     QEStyleDef *st;
 
@@ -1229,10 +1249,10 @@ static void do_describe_buffer(EditState *s, int argval)
     eb_printf(b1, "        name: %s\n", b->name);
     eb_printf(b1, "    filename: %s\n", b->filename);
     eb_printf(b1, "    modified: %d\n", b->modified);
-    eb_printf(b1, "  total_size: %d\n", b->total_size);
-    eb_printf(b1, "        mark: %d\n", b->mark);
-    eb_printf(b1, "   s->offset: %d\n", s->offset);
-    eb_printf(b1, "   b->offset: %d\n", b->offset);
+    eb_printf(b1, "  total_size: %lld\n", (long long)b->total_size);
+    eb_printf(b1, "        mark: %lld\n", (long long)b->mark);
+    eb_printf(b1, "   s->offset: %lld\n", (long long)s->offset);
+    eb_printf(b1, "   b->offset: %lld\n", (long long)b->offset);
 
     eb_printf(b1, "   tab_width: %d\n", b->tab_width);
     eb_printf(b1, " fill_column: %d\n", b->fill_column);
@@ -1274,9 +1294,6 @@ static void do_describe_buffer(EditState *s, int argval)
         buf_puts(desc, " STYLES");
 
     eb_printf(b1, "       flags: 0x%02x %s\n", b->flags, buf);
-#if 0
-    eb_printf(b1, "      probed: %d\n", b->probed);
-#endif
 
     if (b->data_mode)
         eb_printf(b1, "   data_mode: %s\n", b->data_mode->name);
@@ -1290,25 +1307,58 @@ static void do_describe_buffer(EditState *s, int argval)
         eb_printf(b1, "  saved_mode: %s\n", b->saved_mode->name);
 
     eb_printf(b1, "   data_type: %s\n", b->data_type->name);
-    eb_printf(b1, "       pages: %d\n", b->nb_pages);
+    {
+        int i, nb_shared = 0;
+
+        for (i = 0; i < b->nb_pages; i++) {
+            if (b->page_table[i].shared)
+                nb_shared++;
+        }
+        eb_printf(b1, "       pages: %d  (table=%d, shared=%d)\n",
+                  b->nb_pages, b->page_table_size, nb_shared);
+    }
+    if (b->page_slab.nb_chunks) {
+        PageSlab *ps = &b->page_slab;
+        int i;
+
+        eb_printf(b1, "  page slabs: %d chunks, %lld bytes  (size:used/shared/free",
+                  ps->nb_chunks, (long long)ps->chunk_bytes);
+        for (i = 0; i < NB_PAGE_SLABS; i++) {
+            if (ps->nb_used[i] || ps->nb_shared[i] || ps->nb_free[i]) {
+                eb_printf(b1, " %d:%d/%d/%d", PAGE_SLAB_MIN << i,
+                          ps->nb_used[i], ps->nb_shared[i], ps->nb_free[i]);
+            }
+        }
+        eb_printf(b1, ")\n");
+    }
 
     if (b->map_address) {
-        eb_printf(b1, " map_address: %p  (length=%d, handle=%d)\n",
-                  b->map_address, b->map_length, b->map_handle);
+        eb_printf(b1, " map_address: %p  (length=%lld, handle=%d)\n",
+                  b->map_address, (long long)b->map_length, b->map_handle);
     }
 
-    eb_printf(b1, "    save_log: %d  (new_index=%d, current=%d, nb_logs=%d)\n",
-              b->save_log, b->log_new_index, b->log_current, b->nb_logs);
-    eb_printf(b1, "      styles: %d  (cur_style=%lld, bytes=%d, shift=%d)\n",
+    eb_printf(b1, "    save_log: %d  (start=%lld, new_index=%lld, current=%lld, nb_logs=%d)\n",
+              b->save_log, (long long)b->log_start,
+              (long long)b->log_new_index,
+              (long long)b->log_current, b->nb_logs);
+    if (b->log_unpacked_size) {
+        eb_printf(b1, "  undo packs: %lld -> %lld bytes  (%d%%)\n",
+                  (long long)b->log_unpacked_size,
+                  (long long)b->log_packed_size,
+                  compute_percent(b->log_packed_size, b->log_unpacked_size));
+    }
+    eb_printf(b1, "      styles: %d  (cur_style=%lld, bytes=%d, shift=%d, runs=%d)\n",
               !!b->b_styles, (long long)b->cur_style,
-              b->style_bytes, b->style_shift);
+              b->style_bytes, b->style_shift,
+              b->b_styles ? b->b_styles->nb_runs : 0);
 
     if (b->total_size > 0) {
         u8 buf[4096];
         int count[256];
-        int total_size = b->total_size;
-        int offset, c, i, col, max_count, count_width;
-        int word_char, word_count, nb_chars, line, column;
+        QEOffset total_size = b->total_size;
+        QEOffset offset, nb_chars;
+        int c, i, col, max_count, count_width;
+        int word_char, word_count, line, column;
 
         eb_get_pos(b, &line, &column, total_size);
         nb_chars = eb_get_char_offset(b, total_size);
@@ -1338,7 +1388,7 @@ static void do_describe_buffer(EditState *s, int argval)
         }
         count_width = snprintf(NULL, 0, "%d", max_count);
 
-        eb_printf(b1, "       chars: %d\n", nb_chars);
+        eb_printf(b1, "       chars: %lld\n", (long long)nb_chars);
         eb_printf(b1, "       words: %d\n", word_count);
         eb_printf(b1, "       lines: %d\n", line + (column > 0));
 
@@ -1379,17 +1429,23 @@ static void do_describe_buffer(EditState *s, int argval)
 
     if (b->nb_pages) {
         Page *p;
+        QEOffset offset;
+        u8 buf[16];
         const u8 *pc;
         int i, c, n;
 
         eb_printf(b1, "\nBuffer page layout:\n");
 
-        eb_printf(b1, "    page  size  flags  lines   col  chars  addr\n");
-        for (i = 0, p = b->page_table; i < b->nb_pages && i < 100; i++, p++) {
-            eb_printf(b1, "    %4d  %4d  %5x  %5d  %4d  %5d  %p  |",
-                      i, p->size, p->flags, p->nb_lines, p->col, p->nb_chars, p->data);
-            pc = p->data;
-            n = min(p->size, 16);
+        eb_printf(b1, "    page  size   gap  flags  lines   col  chars  addr\n");
+        for (i = 0, offset = 0, p = b->page_table;
+             i < b->nb_pages && i < 100;
+             i++, offset += p->size, p++) {
+            eb_printf(b1, "    %4d  %4d  %4d  %5x  %5d  %4d  %5d  %p  |",
+                      i, p->size, p->gap_size, p->flags, p->nb_lines,
+                      p->col, p->nb_chars, p->data);
+            /* page data is split at the gap: read it from the buffer */
+            pc = buf;
+            n = eb_read(b, offset, buf, min(p->size, 16));
             while (n-- > 0) {
                 switch (c = *pc++) {
                 case '\r': c = 'r'; break;
@@ -1437,9 +1493,9 @@ static void do_describe_window(EditState *s, int argval)
               (s->flags & WF_MINIBUF) ? " MINIBUF" : "",
               (s->flags & WF_HIDDEN) ? " HIDDEN" : "",
               (s->flags & WF_FILELIST) ? " FILELIST" : "");
-    eb_printf(b1, "%*s: %d\n", w, "offset", s->offset);
-    eb_printf(b1, "%*s: %d\n", w, "offset_top", s->offset_top);
-    eb_printf(b1, "%*s: %d\n", w, "offset_bottom", s->offset_bottom);
+    eb_printf(b1, "%*s: %lld\n", w, "offset", (long long)s->offset);
+    eb_printf(b1, "%*s: %lld\n", w, "offset_top", (long long)s->offset_top);
+    eb_printf(b1, "%*s: %lld\n", w, "offset_bottom", (long long)s->offset_bottom);
     eb_printf(b1, "%*s: %d\n", w, "y_disp", s->y_disp);
     eb_printf(b1, "%*s: %d, %d\n", w, "x_disp[]", s->x_disp[0], s->x_disp[1]);
     eb_printf(b1, "%*s: %d\n", w, "dump_width", s->dump_width);
@@ -1468,9 +1524,14 @@ static void do_describe_window(EditState *s, int argval)
     if (s->last_buffer)
         eb_printf(b1, "%*s: %s\n", w, "last_buffer", s->last_buffer->name);
     eb_printf(b1, "%*s: %s\n", w, "mode", s->mode->name);
-    eb_printf(b1, "%*s: %d\n", w, "colorize_nb_lines", s->colorize_nb_lines);
-    eb_printf(b1, "%*s: %d\n", w, "colorize_nb_valid_lines", s->colorize_nb_valid_lines);
-    eb_printf(b1, "%*s: %d\n", w, "colorize_max_valid_offset", s->colorize_max_valid_offset);
+    if (s->colorize_cache) {
+        QEColorizeCache *cc = s->colorize_cache;
+        eb_printf(b1, "%*s: %d\n", w, "colorize_ref_count", cc->ref_count);
+        eb_printf(b1, "%*s: %d\n", w, "colorize_nb_lines", cc->nb_lines);
+        eb_printf(b1, "%*s: %d\n", w, "colorize_nb_valid_lines", cc->nb_valid_lines);
+        eb_printf(b1, "%*s: %lld\n", w, "colorize_max_valid_offset",
+                  (long long)cc->max_valid_offset);
+    }
     eb_printf(b1, "%*s: %d\n", w, "busy", s->busy);
     eb_printf(b1, "%*s: %d\n", w, "display_invalid", s->display_invalid);
     eb_printf(b1, "%*s: %d\n", w, "borders_invalid", s->borders_invalid);
@@ -1525,32 +1586,32 @@ struct chunk_ctx {
 };
 
 struct chunk {
-    int start, end;
+    QEOffset start, end;
 };
 
 static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
     const struct chunk_ctx *cp = vp0;
     const struct chunk *p1 = vp1;
     const struct chunk *p2 = vp2;
-    int pos1, pos2;
+    EditBufferCursor cur1, cur2;
 
     if (cp->flags & SF_REVERSE) {
         p1 = vp2;
         p2 = vp1;
     }
 
-    pos1 = p1->start;
-    pos2 = p2->start;
+    eb_cursor_init(&cur1, cp->b, p1->start);
+    eb_cursor_init(&cur2, cp->b, p2->start);
     for (;;) {
         int c1 = 0, c2 = 0;
-        while (pos1 < p1->end) {
-            c1 = eb_nextc(cp->b, pos1, &pos1);
+        while (cur1.offset < p1->end) {
+            c1 = eb_cursor_nextc(&cur1);
             if (!(cp->flags & SF_DICT) || qe_isalpha(c1))
                 break;
             c1 = 0;
         }
-        while (pos2 < p2->end) {
-            c2 = eb_nextc(cp->b, pos2, &pos2);
+        while (cur2.offset < p2->end) {
+            c2 = eb_cursor_nextc(&cur2);
             if (!(cp->flags & SF_DICT) || qe_isalpha(c2))
                 break;
             c2 = 0;
@@ -1559,16 +1620,16 @@ static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
             unsigned long long n1 = c1 - '0';
             unsigned long long n2 = c2 - '0';
             c1 = 0;
-            while (pos1 < p1->end) {
-                c1 = eb_nextc(cp->b, pos1, &pos1);
+            while (cur1.offset < p1->end) {
+                c1 = eb_cursor_nextc(&cur1);
                 if (!qe_isdigit(c1))
                     break;
                 n1 = n1 * 10 + c1 - '0';
                 c1 = 0;
             }
             c2 = 0;
-            while (pos2 < p2->end) {
-                c2 = eb_nextc(cp->b, pos2, &pos2);
+            while (cur2.offset < p2->end) {
+                c2 = eb_cursor_nextc(&cur2);
                 if (!qe_isdigit(c2))
                     break;
                 n2 = n2 * 10 + c2 - '0';
@@ -1595,16 +1656,17 @@ static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
     return (p1->start > p2->start) - (p1->start < p2->start);
 }
 
-static void do_sort_span(EditState *s, int p1, int p2, int flags, int argval) {
+static void do_sort_span(EditState *s, QEOffset p1, QEOffset p2, int flags, int argval) {
     struct chunk_ctx ctx;
     EditBuffer *b;
-    int i, offset, line1, line2, col1, col2, lines;
+    QEOffset offset;
+    int i, line1, line2, col1, col2, lines;
     struct chunk *chunk_array;
 
     s->region_style = 0;
 
     if (p1 > p2) {
-        int tmp = p1;
+        QEOffset tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
@@ -1636,9 +1698,11 @@ static void do_sort_span(EditState *s, int p1, int p2, int flags, int argval) {
                          chunk_array[i].end - chunk_array[i].start);
         eb_putc(b, '\n');
     }
+    eb_begin_transaction(s->b);
     eb_delete_range(s->b, p1, p2);
     s->b->mark = p1;
     s->offset = p1 + eb_insert_buffer(s->b, p1, b, 0, b->total_size);
+    eb_end_transaction(s->b);
     eb_free(&b);
     qe_free(&chunk_array);
 }
@@ -1654,7 +1718,8 @@ static void do_sort_buffer(EditState *s, int flags, int argval) {
 static void tag_buffer(EditState *s) {
     unsigned int buf[100];
     QETermStyle sbuf[100];
-    int offset, line_num, col_num;
+    QEOffset offset;
+    int line_num, col_num;
 
     if (s->colorize_func || s->b->b_styles) {
         /* force complete buffer colorizarion */
@@ -1671,7 +1736,7 @@ static void tag_completion(CompleteState *cp) {
     if (cp->target) {
         tag_buffer(cp->target);
 
-        for (p = cp->target->b->property_list; p; p = p->next) {
+        for (p = eb_property_list(cp->target->b); p; p = p->next) {
             if (p->type == QE_PROP_TAG) {
                 complete_test(cp, p->data);
             }
@@ -1684,7 +1749,7 @@ static void do_find_tag(EditState *s, const char *str) {
 
     tag_buffer(s);
 
-    for (p = s->b->property_list; p; p = p->next) {
+    for (p = eb_property_list(s->b); p; p = p->next) {
         if (p->type == QE_PROP_TAG && strequal(p->data, str)) {
             s->offset = p->offset;
             return;
@@ -1724,9 +1789,9 @@ static void do_list_tags(EditState *s) {
     tag_buffer(s);
 
     snprintf(buf, sizeof buf, "Tags in file %s", s->b->filename);
-    for (p = s->b->property_list; p; p = p->next) {
+    for (p = eb_property_list(s->b); p; p = p->next) {
         if (p->type == QE_PROP_TAG) {
-            eb_printf(b, "%12d  %s\n", p->offset, (char*)p->data);
+            eb_printf(b, "%12lld  %s\n", (long long)p->offset, (char*)p->data);
         }
     }
 
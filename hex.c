@@ -41,26 +41,24 @@ static int to_disp(int c)
     return c;
 }
 
-static int hex_backward_offset(EditState *s, int offset)
+static QEOffset hex_backward_offset(EditState *s, QEOffset offset)
 {
     return align(offset, s->dump_width);
 }
 
-static int hex_display_line(EditState *s, DisplayState *ds, int offset)
+static QEOffset hex_display_line(EditState *s, DisplayState *ds, QEOffset offset)
 {
     int j, len, ateof;
-    int offset1, offset2;
+    QEOffset offset1, offset2;
     unsigned char b;
 
     display_bol(ds);
 
     ds->style = HEX_STYLE_OFFSET;
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printf(ds, -1, -1, "%08llx ", (long long)offset);
 
     ateof = 0;
-    len = s->b->total_size - offset;
-    if (len > s->dump_width)
-        len = s->dump_width;
+    len = min_offset(s->b->total_size - offset, s->dump_width);
 
     if (s->mode == &hex_mode) {
 
@@ -195,22 +193,6 @@ static int hex_mode_init(EditState *s, EditBuffer *b, int flags)
     return 0;
 }
 
-static int detect_binary(const unsigned char *buf, int size)
-{
-    const uint32_t magic = (1U << '\b') | (1U << '\t') | (1U << '\f') |
-                           (1U << '\n') | (1U << '\r') | (1U << '\033') |
-                           (1U << 0x0e) | (1U << 0x0f) | (1U << 0x1a) |
-                           (1U << 0x1f);
-    int i, c;
-
-    for (i = 0; i < size; i++) {
-        c = buf[i];
-        if (c < 32 && !(magic & (1U << c)))
-            return 1;
-    }
-    return 0;
-}
-
 static int hex_mode_probe(ModeDef *mode, ModeProbeData *p)
 {
     if (detect_binary(p->buf, p->buf_size))
@@ -226,7 +208,7 @@ static void hex_move_bol(EditState *s)
 
 static void hex_move_eol(EditState *s)
 {
-    int offset = align(s->offset, s->dump_width) + s->dump_width - 1;
+    QEOffset offset = align(s->offset, s->dump_width) + s->dump_width - 1;
     if (offset > s->b->total_size)
         offset = s->b->total_size;
     s->offset = offset;
@@ -255,8 +237,8 @@ static void hex_move_up_down(EditState *s, int dir)
 void hex_write_char(EditState *s, int key)
 {
     unsigned int cur_ch, ch;
-    int hsize, shift, cur_len, len, h;
-    int offset = s->offset;
+    int hsize, shift, len, h;
+    QEOffset offset = s->offset, cur_len;
     char buf[10];
 
     if (s->hex_mode) {
@@ -320,7 +302,8 @@ void hex_write_char(EditState *s, int key)
 static void hex_mode_line(EditState *s, buf_t *out)
 {
     basic_mode_line(s, out, '-');
-    buf_printf(out, "0x%x--0x%x", s->offset, s->b->total_size);
+    buf_printf(out, "0x%llx--0x%llx",
+               (long long)s->offset, (long long)s->b->total_size);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
 }
 
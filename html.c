@@ -782,8 +782,8 @@ static void html_mouse_goto(EditState *s, int x, int y)
 static void html_callback(qe__unused__ EditBuffer *b,
                           void *opaque, qe__unused__ int arg,
                           qe__unused__ enum LogOperation op,
-                          qe__unused__ int offset,
-                          qe__unused__ int size)
+                          qe__unused__ QEOffset offset,
+                          qe__unused__ QEOffset size)
 {
     HTMLState *hs = opaque;
 
@@ -80,7 +80,7 @@ int qe_bitmap_format_to_pix_fmt(int format)
 }
 
 static void image_callback(EditBuffer *b, void *opaque, int arg,
-                           enum LogOperation op, int offset, int size);
+                           enum LogOperation op, QEOffset offset, QEOffset size);
 
 void draw_alpha_grid(EditState *s, int x1, int y1, int w, int h)
 {
@@ -359,8 +359,8 @@ static int set_new_image(EditBuffer *b, ImageBuffer *ib)
     return 0;
 }
 
-static int image_buffer_save(EditBuffer *b, int start, int end,
-                             const char *filename)
+static QEOffset image_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                  const char *filename)
 {
     ByteIOContext pb1, *pb = &pb1;
     ImageBufferState *ibs = qe_get_buffer_mode_data(b, &image_mode, NULL);
@@ -629,7 +629,7 @@ static void image_mode_close(EditState *s)
 
 /* when the image is modified, reparse it */
 static void image_callback(EditBuffer *b, void *opaque, int arg,
-                           enum LogOperation op, int offset, int size)
+                           enum LogOperation op, QEOffset offset, QEOffset size)
 {
     //    EditState *s = opaque;
 
@@ -169,7 +169,7 @@ static int latex_mode_probe(ModeDef *mode, ModeProbeData *mp)
 static void do_tex_insert_quote(EditState *s)
 {
     EditBuffer *b = s->b;
-    int offset = s->offset;
+    QEOffset offset = s->offset;
     int c1 = eb_prevc(b, offset, &offset);
     int c2 = eb_prevc(b, offset, &offset);
 
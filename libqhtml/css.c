@@ -214,7 +214,7 @@ typedef int (*NextCharFunc)(CSSBox *box, int *offset);
 static int eb_nextc1(CSSBox *box, int *offset_ptr)
 {
     EditBuffer *b = box->content_data;
-    int offset, offset1;
+    QEOffset offset, offset1;
     int ch, ch1;
     char name[16], *q;
 
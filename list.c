@@ -26,7 +26,7 @@ ModeDef list_mode;
 static int list_get_colorized_line(EditState *s,
                                    unsigned int *buf, int buf_size,
                                    QETermStyle *sbuf,
-                                   int offset, int *offsetp, int line_num)
+                                   QEOffset offset, QEOffset *offsetp, int line_num)
 {
     QEmacsState *qs = s->qe_state;
     int i, len;
@@ -63,14 +63,14 @@ int list_get_pos(EditState *s)
 }
 
 /* get current offset of the line in list */
-int list_get_offset(EditState *s)
+QEOffset list_get_offset(EditState *s)
 {
     return eb_goto_bol(s->b, s->offset);
 }
 
 void list_toggle_selection(EditState *s, int dir)
 {
-    int offset, offset1;
+    QEOffset offset, offset1;
     int ch, flags;
 
     if (dir < 0)
@@ -445,16 +445,17 @@ static void mkd_colorize_line(QEColorizeContext *cp,
     cp->colorize_state = colstate;
 }
 
-static int mkd_is_header_line(EditState *s, int offset)
+static int mkd_is_header_line(EditState *s, QEOffset offset)
 {
     /* Check if line starts with '#' */
     /* XXX: should ignore blocks using colorstate */
     return eb_nextc(s->b, eb_goto_bol(s->b, offset), &offset) == '#';
 }
 
-static int mkd_find_heading(EditState *s, int offset, int *level, int silent)
+static QEOffset mkd_find_heading(EditState *s, QEOffset offset, int *level, int silent)
 {
-    int offset1, nb, c;
+    QEOffset offset1;
+    int nb, c;
 
     offset = eb_goto_bol(s->b, offset);
     for (;;) {
@@ -478,9 +479,10 @@ static int mkd_find_heading(EditState *s, int offset, int *level, int silent)
     return -1;
 }
 
-static int mkd_next_heading(EditState *s, int offset, int target, int *level)
+static QEOffset mkd_next_heading(EditState *s, QEOffset offset, int target, int *level)
 {
-    int offset1, nb, c;
+    QEOffset offset1;
+    int nb, c;
 
     for (;;) {
         offset = eb_next_line(s->b, offset);
@@ -502,9 +504,10 @@ static int mkd_next_heading(EditState *s, int offset, int target, int *level)
     return offset;
 }
 
-static int mkd_prev_heading(EditState *s, int offset, int target, int *level)
+static QEOffset mkd_prev_heading(EditState *s, QEOffset offset, int target, int *level)
 {
-    int offset1, nb, c;
+    QEOffset offset1;
+    int nb, c;
 
     for (;;) {
         if (offset == 0) {
@@ -538,7 +541,8 @@ static void do_outline_previous_vsible_heading(EditState *s)
 
 static void do_outline_up_heading(EditState *s)
 {
-    int offset, level;
+    QEOffset offset;
+    int level;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -554,7 +558,8 @@ static void do_outline_up_heading(EditState *s)
 
 static void do_mkd_backward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    QEOffset offset;
+    int level, level1;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -570,7 +575,8 @@ static void do_mkd_backward_same_level(EditState *s)
 
 static void do_mkd_forward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    QEOffset offset;
+    int level, level1;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -586,7 +592,8 @@ static void do_mkd_forward_same_level(EditState *s)
 
 static void do_mkd_goto(EditState *s, const char *dest)
 {
-    int offset, level, level1, nb;
+    QEOffset offset;
+    int level, level1, nb;
     const char *p = dest;
 
     /* XXX: Should pop up a window with numbered outline index
@@ -614,7 +621,8 @@ static void do_mkd_goto(EditState *s, const char *dest)
 static void do_mkd_mark_element(EditState *s, int subtree)
 {
     QEmacsState *qs = s->qe_state;
-    int offset, offset1, level;
+    QEOffset offset, offset1;
+    int level;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -634,7 +642,8 @@ static void do_mkd_mark_element(EditState *s, int subtree)
 
 static void do_mkd_insert_heading(EditState *s, int flags)
 {
-    int offset, offset0, offset1, level = 1;
+    QEOffset offset, offset0, offset1;
+    int level = 1;
 
     if (check_read_only(s))
         return;
@@ -673,7 +682,8 @@ static void do_mkd_insert_heading(EditState *s, int flags)
 
 static void do_mkd_promote(EditState *s, int dir)
 {
-    int offset, level;
+    QEOffset offset;
+    int level;
 
     if (check_read_only(s))
         return;
@@ -695,7 +705,8 @@ static void do_mkd_promote(EditState *s, int dir)
 
 static void do_mkd_promote_subtree(EditState *s, int dir)
 {
-    int offset, level, level1;
+    QEOffset offset;
+    int level, level1;
 
     if (check_read_only(s))
         return;
@@ -724,7 +735,8 @@ static void do_mkd_promote_subtree(EditState *s, int dir)
 
 static void do_mkd_move_subtree(EditState *s, int dir)
 {
-    int offset, offset1, offset2, level, level1, level2, size;
+    QEOffset offset, offset1, offset2, size;
+    int level, level1, level2;
     EditBuffer *b1;
 
     if (check_read_only(s))
@@ -33,10 +33,11 @@
 #define SYSTEM_HEADER_START_CODE    0x000001bb
 #define ISO_11172_END_CODE          0x000001b9
 
-static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
+static QEOffset mpeg_display_line(EditState *s, DisplayState *ds, QEOffset offset)
 {
     unsigned int startcode;
-    int ret, badchars, offset_start;
+    QEOffset offset_start;
+    int ret, badchars;
     unsigned char buf[4];
 
     /* search start code */
@@ -44,7 +45,7 @@ static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
     badchars = 0;
 
     display_bol(ds);
-    display_printf(ds, -1, -1, "%08x:", offset);
+    display_printf(ds, -1, -1, "%08llx:", (long long)offset);
     for (;;) {
         ret = eb_read(s->b, offset, buf, 4);
         if (ret == 0) {
@@ -59,7 +60,7 @@ static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
                 if (badchars) {
                     display_eol(ds, -1, -1);
                     display_bol(ds);
-                    display_printf(ds, -1, -1, "%08x:", offset);
+                    display_printf(ds, -1, -1, "%08llx:", (long long)offset);
                 }
                 break;
             }
@@ -117,7 +118,7 @@ static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
 }
 
 /* go to previous synchronization point */
-static int mpeg_backward_offset(EditState *s, int offset)
+static QEOffset mpeg_backward_offset(EditState *s, QEOffset offset)
 {
     unsigned char buf[4];
     unsigned int startcode;
@@ -90,7 +90,7 @@ typedef struct QEmacsDataSource {
     const char *str;
     int line_num;
     int pos, len;
-    int offset, stop;
+    QEOffset offset, stop;
 } QEmacsDataSource;
 
 static char *data_gets(QEmacsDataSource *ds, char *buf, int size)
@@ -361,16 +361,16 @@ void do_eval_expression(EditState *s, const char *expression)
     qe_parse_script(s, &ds);
 }
 
-static int do_eval_buffer_region(EditState *s, int start, int stop)
+static int do_eval_buffer_region(EditState *s, QEOffset start, QEOffset stop)
 {
     QEmacsDataSource ds = { 0 };
 
     ds.filename = s->b->name;
     ds.b = s->b;
     if (stop < 0)
-        stop = INT_MAX;
+        stop = QE_OFFSET_MAX;
     if (start < 0)
-        start = INT_MAX;
+        start = QE_OFFSET_MAX;
     if (start < stop) {
         ds.offset = start;
         ds.stop = stop;
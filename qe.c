@@ -609,7 +609,8 @@ void text_move_eol(EditState *s)
 
 void word_right(EditState *s, int w)
 {
-    int c, offset1;
+    QEOffset offset1;
+    int c;
 
     for (;;) {
         if (s->offset >= s->b->total_size)
@@ -623,7 +624,8 @@ void word_right(EditState *s, int w)
 
 void word_left(EditState *s, int w)
 {
-    int c, offset1;
+    QEOffset offset1;
+    int c;
 
     for (;;) {
         if (s->offset == 0)
@@ -647,11 +649,11 @@ void text_move_word_left_right(EditState *s, int dir)
 }
 
 int qe_get_word(EditState *s, char *buf, int buf_size,
-                int offset, int *offset_ptr)
+                QEOffset offset, QEOffset *offset_ptr)
 {
     EditBuffer *b = s->b;
     buf_t outbuf, *out;
-    int offset1;
+    QEOffset offset1;
     int c;
 
     out = buf_init(&outbuf, buf, buf_size);
@@ -679,11 +681,11 @@ int qe_get_word(EditState *s, char *buf, int buf_size,
     return out->len;
 }
 
-void do_mark_region(EditState *s, int mark, int offset)
+void do_mark_region(EditState *s, QEOffset mark, QEOffset offset)
 {
     /* CG: Should have local and global mark rings */
-    s->b->mark = clamp(mark, 0, s->b->total_size);
-    s->offset = clamp(offset, 0, s->b->total_size);
+    s->b->mark = clamp_offset(mark, 0, s->b->total_size);
+    s->offset = clamp_offset(offset, 0, s->b->total_size);
     /* activate region hilite */
     if (s->qe_state->hilite_region)
         s->region_style = QE_STYLE_REGION_HILITE;
@@ -691,7 +693,7 @@ void do_mark_region(EditState *s, int mark, int offset)
 
 /* paragraph handling */
 
-int eb_next_paragraph(EditBuffer *b, int offset)
+QEOffset eb_next_paragraph(EditBuffer *b, QEOffset offset)
 {
     int text_found;
 
@@ -712,7 +714,7 @@ int eb_next_paragraph(EditBuffer *b, int offset)
     return offset;
 }
 
-int eb_start_paragraph(EditBuffer *b, int offset)
+QEOffset eb_start_paragraph(EditBuffer *b, QEOffset offset)
 {
     for (;;) {
         offset = eb_goto_bol(b, offset);
@@ -729,15 +731,15 @@ int eb_start_paragraph(EditBuffer *b, int offset)
 
 void do_mark_paragraph(EditState *s)
 {
-    int start = eb_start_paragraph(s->b, s->offset);
-    int end = eb_next_paragraph(s->b, s->offset);
+    QEOffset start = eb_start_paragraph(s->b, s->offset);
+    QEOffset end = eb_next_paragraph(s->b, s->offset);
 
     do_mark_region(s, start, end);
 }
 
 void do_backward_paragraph(EditState *s)
 {
-    int offset;
+    QEOffset offset;
 
     offset = s->offset;
     /* skip empty lines */
@@ -766,7 +768,7 @@ void do_forward_paragraph(EditState *s)
 
 void do_kill_paragraph(EditState *s, int dir)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     if (dir < 0)
         do_backward_paragraph(s);
@@ -779,11 +781,12 @@ void do_kill_paragraph(EditState *s, int dir)
 void do_fill_paragraph(EditState *s)
 {
     /* buffer offsets, byte counts */
-    int par_start, par_end, offset, offset1, chunk_start, word_start;
+    QEOffset par_start, par_end, offset, offset1, chunk_start, word_start;
     /* number of characters */
     int col, indent_size, word_size, space_size;
     /* other counts */
-    int n, word_count;
+    QEOffset n;
+    int word_count;
     /* character */
     int c;
 
@@ -869,9 +872,10 @@ void do_fill_paragraph(EditState *s)
 
 /* Upper / lower / capital case functions. Update offset, return isword */
 /* arg: -1=lower-case, +1=upper-case, +2=capital-case */
-static int eb_changecase(EditBuffer *b, int *offsetp, int arg)
+static int eb_changecase(EditBuffer *b, QEOffset *offsetp, int arg)
 {
-    int offset0, ch, ch1, len;
+    QEOffset offset0;
+    int ch, ch1, len;
     char buf[MAX_CHAR_BYTES];
 
     offset0 = *offsetp;
@@ -896,7 +900,7 @@ static int eb_changecase(EditBuffer *b, int *offsetp, int arg)
 
 void do_changecase_word(EditState *s, int arg)
 {
-    int offset;
+    QEOffset offset;
 
     word_right(s, 1);
     for (offset = s->offset;;) {
@@ -912,7 +916,7 @@ void do_changecase_word(EditState *s, int arg)
 
 void do_changecase_region(EditState *s, int arg)
 {
-    int offset;
+    QEOffset offset;
 
     /* deactivate region hilite */
     s->region_style = 0;
@@ -920,9 +924,9 @@ void do_changecase_region(EditState *s, int arg)
     /* WARNING: during case change, the region offsets can change, so
        it is not so simple ! */
     /* XXX: if last char of region changes width, offset will move */
-    offset = min(s->offset, s->b->mark);
+    offset = min_offset(s->offset, s->b->mark);
     for (;;) {
-        if (offset >= max(s->offset, s->b->mark))
+        if (offset >= max_offset(s->offset, s->b->mark))
               break;
         if (eb_changecase(s->b, &offset, arg)) {
             if (arg == 2)
@@ -936,7 +940,7 @@ void do_changecase_region(EditState *s, int arg)
 
 void do_delete_char(EditState *s, int argval)
 {
-    int endpos;
+    QEOffset endpos;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -962,7 +966,7 @@ void do_delete_char(EditState *s, int argval)
 
 void do_backspace(EditState *s, int argval)
 {
-    int offset1;
+    QEOffset offset1;
 
 #ifndef CONFIG_TINY
     if (s->b->flags & BF_PREVIEW) {
@@ -1011,7 +1015,7 @@ typedef struct {
     int linec;
     int yc;
     int xc;
-    int offsetc;
+    QEOffset offsetc;
     DirType basec; /* direction of the line */
     DirType dirc; /* direction of the char under the cursor */
     int cursor_width;
@@ -1019,7 +1023,7 @@ typedef struct {
 } CursorContext;
 
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                QEOffset offset1, QEOffset offset2, int line_num,
                 int x, int y, int w, int h, qe__unused__ int hex_mode)
 {
     CursorContext *m = ds->cursor_opaque;
@@ -1058,6 +1062,7 @@ static void get_cursor_pos(EditState *s, CursorContext *m)
     m->offsetc = s->offset;
     m->xc = m->yc = NO_CURSOR;
     display_init(ds, s, DISP_CURSOR, cursor_func, m);
+    ds->cursor_only = 1;
     display1(ds);
     display_close(ds);
 }
@@ -1066,12 +1071,13 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    QEOffset offsetd;
 } MoveContext;
 
 /* called each time the cursor could be displayed */
 static int down_cursor_func(DisplayState *ds,
-                            int offset1, qe__unused__ int offset2, int line_num,
+                            QEOffset offset1, qe__unused__ QEOffset offset2,
+                            int line_num,
                             int x, qe__unused__ int y,
                             qe__unused__ int w, qe__unused__ int h,
                             qe__unused__ int hex_mode)
@@ -1153,7 +1159,7 @@ void text_move_up_down(EditState *s, int dir)
     if (dir < 0) {
         /* difficult case: we need to go backward on displayed text */
         while (cm.linec <= 0) {
-            int offset_top = s->offset_top;
+            QEOffset offset_top = s->offset_top;
 
             if (offset_top <= 0)
                 return;
@@ -1179,6 +1185,7 @@ void text_move_up_down(EditState *s, int dir)
     else
         m->offsetd = 0;
     display_init(ds, s, DISP_CURSOR, down_cursor_func, m);
+    ds->line_num_min = m->yd;
     display1(ds);
     display_close(ds);
     s->offset = m->offsetd;
@@ -1186,14 +1193,14 @@ void text_move_up_down(EditState *s, int dir)
 
 typedef struct {
     int y_found;
-    int offset_found;
+    QEOffset offset_found;
     int dir;
-    int offsetc;
+    QEOffset offsetc;
 } ScrollContext;
 
 /* called each time the cursor could be displayed */
 static int scroll_cursor_func(DisplayState *ds,
-                              int offset1, int offset2,
+                              QEOffset offset1, QEOffset offset2,
                               qe__unused__ int line_num,
                               qe__unused__ int x, int y,
                               qe__unused__ int w, int h,
@@ -1292,7 +1299,7 @@ void perform_scroll_up_down(EditState *s, int h)
                    exit loop */
                 s->y_disp = 0;
             } else {
-                int offset = eb_prev(s->b, s->offset_top);
+                QEOffset offset = eb_prev(s->b, s->offset_top);
                 s->offset_top = s->mode->backward_offset(s, offset);
                 ds->y = 0;
                 s->mode->display_line(s, ds, s->offset_top);
@@ -1308,6 +1315,7 @@ void perform_scroll_up_down(EditState *s, int h)
     m->y_found = 0x7fffffff * dir;
     m->offset_found = s->offset; /* default offset */
     display_init(ds, s, DISP_CURSOR_SCREEN, scroll_cursor_func, m);
+    ds->visible_only = 1;
     display1(ds);
     display_close(ds);
 
@@ -1350,7 +1358,7 @@ void do_center_cursor(EditState *s, int force)
          * speeds up get_cursor_pos() on large files, except for the
          * pathological case of huge lines.
          */
-        int offset = eb_prev(s->b, s->offset);
+        QEOffset offset = eb_prev(s->b, s->offset);
         s->offset_top = s->mode->backward_offset(s, offset);
     } else {
         if (!force)
@@ -1370,13 +1378,14 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    QEOffset offsetd;
     int dir;
     int after_found;
 } LeftRightMoveContext;
 
 static int left_right_cursor_func(DisplayState *ds,
-                                  int offset1, qe__unused__ int offset2,
+                                  QEOffset offset1,
+                                  qe__unused__ QEOffset offset2,
                                   int line_num,
                                   int x, qe__unused__ int y,
                                   qe__unused__ int w, qe__unused__ int h,
@@ -1434,6 +1443,7 @@ void text_move_left_right_visual(EditState *s, int dir)
         m->dir = dir;
         m->after_found = 0;
         display_init(ds, s, DISP_CURSOR, left_right_cursor_func, m);
+        ds->line_num_min = m->yd;
         display1(ds);
         display_close(ds);
         if (m->offsetd >= 0) {
@@ -1449,7 +1459,7 @@ void text_move_left_right_visual(EditState *s, int dir)
             } else {
                 /* no suitable position found: go to previous line */
                 if (yc <= 0) {
-                    int offset = s->offset_top;
+                    QEOffset offset = s->offset_top;
 
                     if (offset <= 0)
                         break;
@@ -1477,7 +1487,7 @@ typedef struct {
     int xd;
     int dy_min;
     int dx_min;
-    int offset_found;
+    QEOffset offset_found;
     int hex_mode;
 } MouseGotoContext;
 
@@ -1495,7 +1505,7 @@ static int seg_dist(int x, int x1, int x2)
 /* XXX: would need two passes in the general case (first search line,
    then colunm */
 static int mouse_goto_func(DisplayState *ds,
-                           int offset1, qe__unused__ int offset2,
+                           QEOffset offset1, qe__unused__ QEOffset offset2,
                            qe__unused__ int line_num,
                            int x, int y, int w, int h, int hex_mode)
 {
@@ -1538,6 +1548,7 @@ void text_mouse_goto(EditState *s, int x, int y)
 
     display_init(ds, s, DISP_CURSOR_SCREEN, mouse_goto_func, m);
     ds->hex_mode = -1; /* we select both hex chars and normal chars */
+    ds->visible_only = 1;
     display1(ds);
     display_close(ds);
 
@@ -1563,7 +1574,7 @@ int do_delete_selection(EditState *s)
     if (s->region_style && s->b->mark != s->offset) {
         /* Delete hilighted region */
         // XXX: make it optional?
-        res = eb_delete_range(s->b, s->b->mark, s->offset);
+        res = (eb_delete_range(s->b, s->b->mark, s->offset) > 0);
     }
     /* deactivate region hilite */
     s->region_style = 0;
@@ -1601,7 +1612,8 @@ void do_char(EditState *s, int key, int argval)
 #ifdef CONFIG_UNICODE_JOIN
 void do_combine_char(EditState *s, int accent)
 {
-    int offset0, len, c;
+    QEOffset offset0;
+    int len, c;
     unsigned int g[2];
     char buf[MAX_CHAR_BYTES];
 
@@ -1626,7 +1638,8 @@ void do_combine_char(EditState *s, int accent)
 
 void text_write_char(EditState *s, int key)
 {
-    int cur_ch, len, cur_len, offset1, ret, insert;
+    QEOffset offset1;
+    int cur_ch, len, cur_len, ret, insert;
     char buf[MAX_CHAR_BYTES];
 
     if (check_read_only(s))
@@ -1644,7 +1657,8 @@ void text_write_char(EditState *s, int key)
 
     if (insert) {
         const InputMethod *m;
-        int match_buf[20], match_len, offset, i;
+        int match_buf[20], match_len, i;
+        QEOffset offset;
 
         /* use compose system only if insert mode */
         if (s->compose_len == 0)
@@ -1756,8 +1770,8 @@ void do_tab(EditState *s, int argval)
     if (s->indent_tabs_mode) {
         do_char(s, 9, argval);
     } else {
-        int offset = s->offset;
-        int offset0 = eb_goto_bol(s->b, offset);
+        QEOffset offset = s->offset;
+        QEOffset offset0 = eb_goto_bol(s->b, offset);
         int col = 0;
         int tw = s->b->tab_width > 0 ? s->b->tab_width : 8;
         int indent = s->indent_size > 0 ? s->indent_size : tw;
@@ -1842,6 +1856,13 @@ void do_break(EditState *s)
     /* deactivate search hilite */
     s->isearch_state = NULL;
 
+    if (s->b->flags & BF_LOADING) {
+        /* stop loading, keep the partial contents read-only */
+        eb_load_cancel(s->b);
+        put_status(s, "Loading interrupted");
+        return;
+    }
+
     /* well, currently nothing needs to be aborted in global context */
     /* CG: Should remove popups, sidepanes, helppanes... */
     put_status(s, "|");
@@ -1889,10 +1910,10 @@ void do_append_next_kill(qe__unused__ EditState *s)
     /* do nothing! */
 }
 
-void do_kill(EditState *s, int p1, int p2, int dir, int keep)
+void do_kill(EditState *s, QEOffset p1, QEOffset p2, int dir, int keep)
 {
     QEmacsState *qs = s->qe_state;
-    int len, tmp;
+    QEOffset len, tmp;
     EditBuffer *b;
 
     /* deactivate region hilite */
@@ -1937,7 +1958,8 @@ void do_kill_region(EditState *s, int keep)
 
 void do_kill_line(EditState *s, int argval)
 {
-    int p1, p2, offset1, dir = 1;
+    QEOffset p1, p2, offset1;
+    int dir = 1;
 
     p1 = s->offset;
     if (argval == NO_ARG) {
@@ -1988,7 +2010,7 @@ void do_kill_beginning_of_line(EditState *s, int argval)
 
 void do_kill_word(EditState *s, int dir)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     do_word_right(s, dir);
     do_kill(s, start, s->offset, dir, 0);
@@ -1996,7 +2018,7 @@ void do_kill_word(EditState *s, int dir)
 
 void do_yank(EditState *s)
 {
-    int size;
+    QEOffset size;
     QEmacsState *qs = s->qe_state;
     EditBuffer *b;
 
@@ -2043,7 +2065,7 @@ void do_yank_pop(EditState *s)
 
 void do_exchange_point_and_mark(EditState *s)
 {
-    int tmp;
+    QEOffset tmp;
 
     tmp = s->b->mark;
     s->b->mark = s->offset;
@@ -2433,9 +2455,10 @@ void do_convert_buffer_file_coding_system(EditState *s,
     QECharset *charset;
     EOLType eol_type;
     EditBuffer *b1, *b;
-    int offset, len, i;
-    EditBufferCallbackList *cb;
-    int pos[32];
+    EditBufferStyles *styles;
+    QEOffset offset;
+    int len, i;
+    QEOffset pos[32];
     char buf[MAX_CHAR_BYTES];
 
     eol_type = s->b->eol_type;
@@ -2449,12 +2472,8 @@ void do_convert_buffer_file_coding_system(EditState *s,
     eb_set_charset(b1, charset, eol_type);
 
     /* preserve positions */
-    cb = b->first_callback;
-    for (i = 0; i < countof(pos) && cb; cb = cb->next) {
-        if (cb->callback == eb_offset_callback) {
-            pos[i] = eb_get_char_offset(b, *(int*)cb->opaque);
-            i++;
-        }
+    for (i = 0; i < countof(pos) && i < b->nb_offset_refs; i++) {
+        pos[i] = eb_get_char_offset(b, *b->offset_refs[i].offset_ptr);
     }
 
     /* slow, but simple iterative method */
@@ -2468,26 +2487,23 @@ void do_convert_buffer_file_coding_system(EditState *s,
 
     /* replace current buffer with conversion */
     /* quick hack to transfer styles from tmp buffer to b */
-    eb_free(&b->b_styles);
+    styles = b->b_styles;
+    b->b_styles = NULL;
     eb_delete(b, 0, b->total_size);
     eb_set_charset(b, charset, eol_type);
     eb_insert_buffer(b, 0, b1, 0, b1->total_size);
     b->b_styles = b1->b_styles;
-    b1->b_styles = NULL;
+    b1->b_styles = styles;
 
     /* restore positions */
-    cb = b->first_callback;
-    for (i = 0; i < countof(pos) && cb; cb = cb->next) {
-        if (cb->callback == eb_offset_callback) {
-            *(int*)cb->opaque = eb_goto_char(b, pos[i]);
-            i++;
-        }
+    for (i = 0; i < countof(pos) && i < b->nb_offset_refs; i++) {
+        *b->offset_refs[i].offset_ptr = eb_goto_char(b, pos[i]);
     }
 
     eb_free(&b1);
 
-    put_status(s, "Buffer charset is now %s, %d bytes",
-               s->b->charset->name, b->total_size);
+    put_status(s, "Buffer charset is now %s, %lld bytes",
+               s->b->charset->name, (long long)b->total_size);
 }
 
 void do_toggle_bidir(EditState *s)
@@ -2536,7 +2552,8 @@ void do_word_wrap(EditState *s)
 void do_goto(EditState *s, const char *str, int unit)
 {
     const char *p;
-    int pos, line, col, rel;
+    QEOffset pos;
+    int line, col, rel;
 
     /* Update s->offset from str specification:
      * optional +- for relative moves
@@ -2548,7 +2565,7 @@ void do_goto(EditState *s, const char *str, int unit)
      * CG: XXX: resulting offset may fall inside a character.
      */
     rel = (*str == '+' || *str == '-');
-    pos = strtol(str, (char**)&p, 0);
+    pos = strtoll(str, (char**)&p, 0);
 
     /* skip space required to separate hex offset from b or c suffix */
     if (*p == ' ')
@@ -2590,21 +2607,21 @@ void do_goto(EditState *s, const char *str, int unit)
         /* XXX: should realign on character boundary?
          *      realignment probably better addressed in display module
          */
-        s->offset = clamp(pos, 0, s->b->total_size);
+        s->offset = clamp_offset(pos, 0, s->b->total_size);
         return;
     case 'c':
         if (*p)
             goto error;
         if (rel)
             pos += eb_get_char_offset(s->b, s->offset);
-        s->offset = eb_goto_char(s->b, max(0, pos));
+        s->offset = eb_goto_char(s->b, max_offset(0, pos));
         return;
     case '%':
         /* CG: should not require long long for this */
         pos = pos * (long long)s->b->total_size / 100;
         if (rel)
             pos += s->offset;
-        eb_get_pos(s->b, &line, &col, clamp(pos, 0, s->b->total_size));
+        eb_get_pos(s->b, &line, &col, clamp_offset(pos, 0, s->b->total_size));
         line += (col > 0);
         goto getcol;
 
@@ -2652,7 +2669,7 @@ void do_what_cursor_position(EditState *s)
     int accents[6];
     buf_t outbuf, *out;
     int line_num, col_num;
-    int offset1, off;
+    QEOffset offset1, off;
     int c, cc;
     int i, n;
 
@@ -2719,9 +2736,10 @@ void do_what_cursor_position(EditState *s)
         }
     }
     eb_get_pos(s->b, &line_num, &col_num, s->offset);
-    put_status(s, "%s  point=%d mark=%d size=%d region=%d col=%d",
-               out->buf, s->offset, s->b->mark, s->b->total_size,
-               abs(s->offset - s->b->mark), col_num);
+    put_status(s, "%s  point=%lld mark=%lld size=%lld region=%lld col=%d",
+               out->buf, (long long)s->offset, (long long)s->b->mark,
+               (long long)s->b->total_size,
+               (long long)llabs(s->offset - s->b->mark), col_num);
 }
 
 void do_set_tab_width(EditState *s, int tab_width)
@@ -2822,6 +2840,8 @@ void text_mode_line(EditState *s, buf_t *out)
     if (s->input_method)
         buf_printf(out, "--%s", s->input_method->name);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
+    if (s->b->flags & BF_LOADING)
+        buf_printf(out, "--Loading %d%%", eb_load_progress(s->b));
     if (s->x_disp[0])
         buf_printf(out, "--<%d", -s->x_disp[0]);
     if (s->x_disp[1])
@@ -3127,6 +3147,8 @@ void do_set_style(EditState *e, const char *stylestr,
         }
         break;
     }
+    /* redraw and lay out all windows with the new style */
+    e->qe_state->complete_refresh = 1;
 }
 
 void do_define_color(EditState *e, const char *name, const char *value)
@@ -3175,6 +3197,7 @@ void do_set_window_style(EditState *s, const char *stylestr)
         return;
     }
     s->default_style = style_index;
+    edit_invalidate(s, 0);
 }
 
 void do_set_system_font(EditState *s, const char *qe_font_name,
@@ -3213,6 +3236,7 @@ static void display_bol_bidir(DisplayState *ds, DirType base,
     ds->word_index = 0;
     ds->embedding_level_max = embedding_level_max;
     ds->last_word_space = 0;
+    ds->row_offset = -1;
 }
 
 void display_bol(DisplayState *ds)
@@ -3226,7 +3250,8 @@ void display_close(DisplayState *ds)
 
 void display_init(DisplayState *ds, EditState *e, enum DisplayType do_disp,
                   int (*cursor_func)(DisplayState *ds,
-                                     int offset1, int offset2, int line_num,
+                                     QEOffset offset1, QEOffset offset2,
+                                     int line_num,
                                      int x, int y, int w, int h, int hex_mode),
                   void *cursor_opaque)
 {
@@ -3274,6 +3299,9 @@ void display_init(DisplayState *ds, EditState *e, enum DisplayType do_disp,
     }
     ds->eol_reached = 0;
     ds->eod = 0;
+    ds->cursor_only = 0;
+    ds->visible_only = 0;
+    ds->line_num_min = -1;
     display_bol(ds);
     release_font(e->screen, font);
 }
@@ -3291,43 +3319,55 @@ static void reverse_fragments(TextFragment *str, int len)
 
 #define LINE_SHADOW_INCR 10
 
-/* CRC to optimize redraw. */
-/* XXX: is it safe enough ? */
-static uint64_t compute_crc(const void *p, int size, uint64_t sum)
+/* Hash of the line contents to optimize redraw.  Each 64 bit word is
+ * mixed into the whole state, so that transposed or shifted words do
+ * not collide as they did with a rotating sum, and the result goes
+ * through a final avalanche step (MurmurHash3 constants).
+ */
+static uint64_t compute_hash(const void *p, int size, uint64_t h)
 {
     const u8 *data = (const u8 *)p;
+    uint64_t k;
 
-    /* Rotating sum necessary to prevent trivial collisions on
-     * line_chars because it is an array of code points stored as u32.
-     */
-    /* XXX: We still have a bug when transposing two 31 byte words as in
-     * B123456789012345678901234567890 A123456789012345678901234567890
-     * Here is another trivial collision:
-                    s->esc_params[s->nb_esc_params] = 0;
-                    s->has_params[s->nb_esc_params] = 1;
-     */
-    while (((uintptr_t)data & 3) && size > 0) {
-        //sum += ((sum >> 31) & 1) + sum + *data;
-        //sum += sum + *data + (sum >> 32);
-        sum = (sum << 3) + *data + (sum >> 32);
-        data++;
-        size--;
-    }
-    while (size >= 4) {
-        //sum += ((sum >> 31) & 1) + sum + *(const uint32_t *)(const void *)data;
-        //sum += sum + *(const uint32_t *)(const void *)data + (sum >> 32);
-        sum = (sum << 3) + *(const uint32_t *)(const void *)data + (sum >> 32);
-        data += 4;
-        size -= 4;
-    }
+    h ^= (uint64_t)size * 0x9e3779b97f4a7c15ULL;
     while (size > 0) {
-        //sum += ((sum >> 31) & 1) + sum + *data;
-        //sum += sum + *data + (sum >> 32);
-        sum = (sum << 2) + *data + (sum >> 32);
-        data++;
-        size--;
+        k = 0;
+        if (size >= 8) {
+            memcpy(&k, data, 8);
+            data += 8;
+            size -= 8;
+        } else {
+            memcpy(&k, data, size);
+            size = 0;
+        }
+        k *= 0x87c37b91114253d5ULL;
+        k = (k << 31) | (k >> 33);
+        k *= 0x4cf5ad432745937fULL;
+        h ^= k;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* invalidate the line shadows of the rows other than line_num that
+   overlap the area from y to y + height, which is drawn over */
+static void line_shadow_clip(EditState *e, int line_num, int y, int height)
+{
+    QELineShadow *ls;
+    int i;
+
+    for (i = 0; i < e->shadow_nb_lines; i++) {
+        ls = &e->line_shadow[i];
+        if (i != line_num && ls->height > 0
+        &&  ls->y < y + height && ls->y + ls->height > y) {
+            memset(ls, 0xff, sizeof(*ls));
+        }
     }
-    return sum;
 }
 
 /* flush the line fragments to the screen.
@@ -3336,7 +3376,7 @@ static uint64_t compute_crc(const void *p, int size, uint64_t sum)
 */
 static void flush_line(DisplayState *ds,
                        TextFragment *fragments, int nb_fragments,
-                       int offset1, int offset2, int last)
+                       QEOffset offset1, QEOffset offset2, int last)
 {
     EditState *e = ds->edit_state;
     QEditScreen *screen = e->screen;
@@ -3387,8 +3427,8 @@ static void flush_line(DisplayState *ds,
         /* test if display needed */
         if (ds->line_num >= 0 && ds->line_num < 2048) {
             /* paranoid: prevent cache growing too large */
-            /* Use checksum based line cache to improve speed in graphics mode.
-             * XXX: overlong lines will fail the cache test
+            /* Use a hash based line cache to improve speed in graphics
+             * mode.  XXX: overlong lines will fail the cache test
              */
             if (ds->line_num >= e->shadow_nb_lines) {
                 /* reallocate shadow */
@@ -3402,24 +3442,36 @@ static void flush_line(DisplayState *ds,
             }
             if (ds->line_num < e->shadow_nb_lines) {
                 QELineShadow *ls;
-                uint64_t crc;
-
-                crc = compute_crc(fragments, sizeof(*fragments) * nb_fragments, 0);
-                crc = compute_crc(ds->line_chars, sizeof(*ds->line_chars) * ds->line_index, crc);
+                int params[6];
+                uint64_t hash;
+
+                /* the parameters of the drawing beside the fragments */
+                params[0] = last;
+                params[1] = ds->left_gutter;
+                params[2] = ds->x_start;
+                params[3] = ds->base;
+                params[4] = ds->width;
+                params[5] = ds->eol_width;
+                hash = compute_hash(params, sizeof(params), 0);
+                hash = compute_hash(fragments, sizeof(*fragments) * nb_fragments, hash);
+                hash = compute_hash(ds->line_chars, sizeof(*ds->line_chars) * ds->line_index, hash);
                 ls = &e->line_shadow[ds->line_num];
                 if (ls->y != ds->y || ls->x != ds->x_line
-                ||  ls->height != line_height || ls->crc != crc) {
+                ||  ls->height != line_height || ls->hash != hash) {
                     /* update values for the line cache */
                     ls->y = ds->y;
                     ls->x = ds->x_line;
                     ls->height = line_height;
-                    ls->crc = crc;
+                    ls->hash = hash;
                 } else {
                     no_display = 1;
                 }
             }
         }
         if (!no_display) {
+            /* the rows previously displayed there are drawn over */
+            line_shadow_clip(e, ds->line_num, ds->y, line_height);
+
             /* display */
             get_style(e, &default_style, QE_STYLE_DEFAULT);
             x = ds->x_start;
@@ -3512,8 +3564,8 @@ static void flush_line(DisplayState *ds,
             frag = &fragments[i];
 
             for (j = frag->line_index, k = 0; k < frag->len; k++, j++) {
-                int _offset1 = ds->line_offsets[j][0];
-                int _offset2 = ds->line_offsets[j][1];
+                QEOffset _offset1 = ds->line_offsets[j][0];
+                QEOffset _offset2 = ds->line_offsets[j][1];
                 int hex_mode = ds->line_hex_mode[j];
                 int w = ds->line_char_widths[j];
                 x += w;
@@ -3564,11 +3616,26 @@ static void keep_line_chars(DisplayState *ds, int n)
 
     index = ds->line_index - n;
     memmove(ds->line_chars, ds->line_chars + index, n * sizeof(unsigned int));
-    memmove(ds->line_offsets, ds->line_offsets + index, n * 2 * sizeof(unsigned int));
+    memmove(ds->line_offsets, ds->line_offsets + index, n * sizeof(ds->line_offsets[0]));
     memmove(ds->line_char_widths, ds->line_char_widths + index, n * sizeof(short));
+    memmove(ds->line_hex_mode, ds->line_hex_mode + index, n * sizeof(unsigned char));
     ds->line_index = n;
 }
 
+/* return the offset of the glyph at index if the layout of a new row
+   can start there, -1 otherwise */
+static QEOffset row_start_offset(DisplayState *ds, int index)
+{
+    QEOffset offset = ds->line_offsets[index][0];
+
+    /* the glyphs of a character must not span several rows */
+    if (index > 0 && index < ds->line_index && offset >= 0
+    &&  ds->line_offsets[index - 1][0] != offset) {
+        return offset;
+    }
+    return -1;
+}
+
 #ifndef CONFIG_UNICODE_JOIN
 
 /* fallback unicode functions */
@@ -3640,7 +3707,7 @@ static void flush_fragment(DisplayState *ds)
         j++;
     }
     for (i = 0; i < ds->fragment_index; i++) {
-        int offset1, offset2;
+        QEOffset offset1, offset2;
         j = ds->line_index + char_to_glyph_pos[i];
         offset1 = ds->fragment_offsets[i][0];
         offset2 = ds->fragment_offsets[i][1];
@@ -3735,6 +3802,8 @@ static void flush_fragment(DisplayState *ds)
             n = ds->nb_fragments;
             if (len == 0)
                 n--;
+            ds->row_offset = row_start_offset(ds, frag->line_index + len);
+            ds->row_word_space = ds->last_word_space;
 
             /* flush fragments with a line continuation mark */
             flush_line(ds, ds->fragments, n, -1, -1, 0);
@@ -3778,6 +3847,10 @@ static void flush_fragment(DisplayState *ds)
                 ds->fragments[i].line_index -= index;
                 ds->x += ds->fragments[i].width;
             }
+            ds->row_offset = -1;
+            if (ds->x <= ds->width)
+                ds->row_offset = row_start_offset(ds, index);
+            ds->row_word_space = ds->last_word_space;
             keep_line_chars(ds, ds->line_index - index);
             ds->word_index = 0;
         }
@@ -3786,7 +3859,7 @@ static void flush_fragment(DisplayState *ds)
     ds->fragment_index = 0;
 }
 
-int display_char_bidir(DisplayState *ds, int offset1, int offset2,
+int display_char_bidir(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                        int embedding_level, int ch)
 {
     int space, istab, isaccent;
@@ -3798,8 +3871,8 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
     /* special code to colorize block */
     e = ds->edit_state;
     if (e->show_selection || e->region_style) {
-        int mark = e->b->mark;
-        int offset = e->offset;
+        QEOffset mark = e->b->mark;
+        QEOffset offset = e->offset;
 
         if ((offset1 >= offset && offset1 < mark) ||
             (offset1 >= mark && offset1 < offset)) {
@@ -3829,7 +3902,8 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
             /* flush the current fragment if needed */
             if (isaccent && ds->fragment_chars[ds->fragment_index - 1] == ' ') {
                 /* separate last space to make it part of the next word */
-                int off1, off2, cur_hex;
+                QEOffset off1, off2;
+                int cur_hex;
                 --ds->fragment_index;
                 off1 = ds->fragment_offsets[ds->fragment_index][0];
                 off2 = ds->fragment_offsets[ds->fragment_index][1];
@@ -3872,7 +3946,7 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
     return 0;
 }
 
-void display_printhex(DisplayState *ds, int offset1, int offset2,
+void display_printhex(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                       unsigned int h, int n)
 {
     int i, v;
@@ -3895,7 +3969,7 @@ void display_printhex(DisplayState *ds, int offset1, int offset2,
     ds->cur_hex_mode = 0;
 }
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                     const char *fmt, ...)
 {
     char buf[256], *p;
@@ -3917,7 +3991,7 @@ void display_printf(DisplayState *ds, int offset1, int offset2,
 }
 
 /* end of line */
-void display_eol(DisplayState *ds, int offset1, int offset2)
+void display_eol(DisplayState *ds, QEOffset offset1, QEOffset offset2)
 {
     flush_fragment(ds);
 
@@ -3929,7 +4003,7 @@ void display_eol(DisplayState *ds, int offset1, int offset2)
 static void display1(DisplayState *ds)
 {
     EditState *e = ds->edit_state;
-    int offset;
+    QEOffset offset;
 
     ds->eod = 0;
     offset = e->offset_top;
@@ -3965,7 +4039,7 @@ static void display1(DisplayState *ds)
 }
 
 /******************************************************/
-int text_backward_offset(EditState *s, int offset)
+QEOffset text_backward_offset(EditState *s, QEOffset offset)
 {
     int line, col;
 
@@ -3977,13 +4051,16 @@ int text_backward_offset(EditState *s, int offset)
 #ifdef CONFIG_UNICODE_JOIN
 /* max_size should be >= 2 */
 static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
-                                    EditBuffer *b, int offset)
+                                    EditBuffer *b, QEOffset offset)
 {
     TypeLink *p;
     FriBidiCharType type, ltype;
-    int left, offset1;
+    QEOffset start, offset1;
+    int left;
     unsigned int c;
 
+    /* link positions are relative to the start of the line */
+    start = offset;
     p = list_tab;
     /* Add the starting link */
     p->type = FRIBIDI_TYPE_SOT;
@@ -4003,7 +4080,7 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
         /* if not enough room, increment last link */
         if (type != ltype && left > 0) {
             p->type = type;
-            p->pos = offset1;
+            p->pos = offset1 - start;
             p->len = 1;
             p++;
             left--;
@@ -4016,7 +4093,7 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
     /* Add the ending link */
     p->type = FRIBIDI_TYPE_EOT;
     p->len = 0;
-    p->pos = offset1;
+    p->pos = offset1 - start;
     p++;
 
     return p - list_tab;
@@ -4030,16 +4107,23 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
 
 static int get_staticly_colorized_line(EditState *s, unsigned int *buf, int buf_size,
                                        QETermStyle *sbuf,
-                                       int offset, int *offset_ptr, int line_num)
+                                       QEOffset offset, QEOffset *offset_ptr,
+                                       int line_num)
 {
     EditBuffer *b = s->b;
+    EditBufferCursor cur;
     unsigned int *buf_ptr, *buf_end;
+    QETermStyle style = 0;
+    QEOffset style_end = offset;
 
     buf_ptr = buf;
     buf_end = buf + buf_size - 1;
+    eb_cursor_init(&cur, b, offset);
     for (;;) {
-        QETermStyle style = eb_get_style(b, offset);
-        int c = eb_nextc(b, offset, &offset);
+        int c;
+        if (cur.offset >= style_end)
+            style = eb_get_style_run(b, cur.offset, &style_end);
+        c = eb_cursor_nextc(&cur);
         if (c == '\n') {
             /* XXX: set style for end of line? */
             break;
@@ -4051,7 +4135,7 @@ static int get_staticly_colorized_line(EditState *s, unsigned int *buf, int buf_
     }
     *buf_ptr = '\0';
     sbuf[buf_ptr - buf] = 0;  /* end of line style? */
-    *offset_ptr = offset;
+    *offset_ptr = cur.offset;
     return buf_ptr - buf;
 }
 
@@ -4062,135 +4146,418 @@ static int get_staticly_colorized_line(EditState *s, unsigned int *buf, int buf_
 
 #define COLORIZED_LINE_PREALLOC_SIZE 64
 
+/* Characters colorized past those returned to the caller, so that the
+ * tokens at the truncation point get the same styles as in the whole
+ * line.
+ */
+#define COLORIZED_LINE_LOOKAHEAD  256
+
+/* The window line buffer is shrunk back after an overlong line has
+ * been fetched whole, so its memory is not kept once the line has
+ * been colorized.
+ */
+#define COLORIZED_LINE_KEEP_SIZE  (4 * COLORED_MAX_LINE_SIZE)
+
+/* Get the line beginning at 'offset' into the window line buffer,
+ * grown as needed so that long lines are not truncated, unless they
+ * are longer than max_len chars.  As with eb_get_line(), a complete
+ * line is followed by its '\n' and a null char, and *offsetp is set
+ * to the start of the next line.  A truncated line is followed by a
+ * null char, and *offsetp is set to the offset where the fetch
+ * stopped.  The length is returned, or -1 if the buffer cannot be
+ * grown.
+ */
+static int edit_get_line(EditState *s, QEOffset offset, QEOffset *offsetp,
+                         int max_len)
+{
+    int len, n;
+
+    for (len = 0;; len += n) {
+        if (s->line_buf_size - len < COLORIZED_LINE_PREALLOC_SIZE) {
+            n = max(s->line_buf_size + (s->line_buf_size >> 1),
+                    COLORED_MAX_LINE_SIZE);
+            if (!qe_realloc(&s->line_buf, n * sizeof(*s->line_buf)))
+                return -1;
+            s->line_buf_size = n;
+        }
+        /* keep room for a char after the null of a truncated line */
+        n = s->line_buf_size - len - 1;
+        if (n > max_len - len)
+            n = max_len - len + 1;
+        n = eb_get_line(s->b, s->line_buf + len, n, offset, &offset);
+        if (s->line_buf[len + n] == '\n' || len + n >= max_len)
+            break;
+    }
+    *offsetp = offset;
+    return len + n;
+}
+
+static void edit_shrink_line(EditState *s)
+{
+    if (s->line_buf_size > COLORIZED_LINE_KEEP_SIZE
+    &&  qe_realloc(&s->line_buf,
+                   COLORED_MAX_LINE_SIZE * sizeof(*s->line_buf))) {
+        s->line_buf_size = COLORED_MAX_LINE_SIZE;
+    }
+}
+
+static int colorize_realloc_states(QEColorizeCache *cc, int nb_lines)
+{
+    int n;
+
+    if (nb_lines > cc->nb_lines) {
+        /* Reallocate colorization state buffer with pseudo-Fibonacci
+         * geometric progression (ratio of 1.625)
+         */
+        n = max(cc->nb_lines, COLORIZED_LINE_PREALLOC_SIZE);
+        while (n < nb_lines)
+            n += (n >> 1) + (n >> 3);
+        if (!qe_realloc(&cc->states,
+                        n * sizeof(*cc->states))) {
+            return -1;
+        }
+        cc->nb_lines = n;
+    }
+    return 0;
+}
+
+/* Invalidate the states of the lines modified since the last call.
+ * The states before the modified lines are kept.  Those after them
+ * are moved by the number of lines inserted or deleted and kept as
+ * cached states: they become valid again as soon as the state at the
+ * start of one of these lines is recomputed with the same value,
+ * since the text below is unchanged.
+ */
+static void colorize_invalidate(QEColorizeCache *cc)
+{
+    EditBuffer *b = cc->b;
+    int line0, line1, nb_lines, col, delta, lo, hi;
+    int nb_valid = cc->nb_valid_lines;
+
+    eb_get_pos(b, &line0, &col, cc->max_valid_offset);
+    eb_get_pos(b, &line1, &col,
+               min_offset(cc->edit_end, b->total_size));
+    eb_get_pos(b, &nb_lines, &col, b->total_size);
+    delta = nb_lines - cc->nb_buffer_lines;
+
+    /* first line after the modified lines, in the previous numbering */
+    lo = max(line1 + 1 - delta, line0 + 1);
+    hi = 0;
+    if (nb_valid > lo) {
+        hi = nb_valid;
+        if (cc->resync_line <= hi && cc->nb_cached_lines > hi)
+            hi = cc->nb_cached_lines;
+    } else
+    if (cc->nb_cached_lines > max(lo, cc->resync_line)) {
+        lo = max(lo, cc->resync_line);
+        hi = cc->nb_cached_lines;
+    }
+    if (hi > lo && !colorize_realloc_states(cc, hi + delta)) {
+        memmove(cc->states + lo + delta, cc->states + lo,
+                (hi - lo) * sizeof(*cc->states));
+        cc->resync_line = lo + delta;
+        cc->nb_cached_lines = hi + delta;
+    } else {
+        cc->resync_line = cc->nb_cached_lines = 0;
+    }
+    if (line0 + 1 < nb_valid)
+        cc->nb_valid_lines = line0 + 1;
+
+    /* tags of the modified lines are added again when recolorized,
+       the line bounds are found with the page index as the lines may
+       be very long */
+    eb_delete_properties(b, eb_goto_pos(b, line0, 0),
+                         eb_goto_pos(b, line1 + 1, 0));
+    cc->nb_buffer_lines = nb_lines;
+    cc->max_valid_offset = QE_OFFSET_MAX;
+    cc->edit_end = 0;
+}
+
+/* store the state at the start of a line beyond the valid ones, return
+ * true if it makes the cached states valid.
+ */
+static int colorize_set_state(QEColorizeCache *cc, int line, int state)
+{
+    if (line >= cc->resync_line
+    &&  line < cc->nb_cached_lines
+    &&  cc->states[line] == state) {
+        cc->nb_valid_lines = cc->nb_cached_lines;
+        cc->resync_line = cc->nb_cached_lines = 0;
+        return 1;
+    }
+    cc->states[line] = state;
+    if (cc->nb_valid_lines < line + 1)
+        cc->nb_valid_lines = line + 1;
+    return 0;
+}
+
+/* Colorize the rest of the buffer during idle time, in time slices
+ * interrupted by user input, so that jumps far into the buffer and tag
+ * lookups do not have to.
+ */
+#define COLORIZE_IDLE_DELAY   200  /* ms of inactivity before colorizing */
+#define COLORIZE_SLICE_MS      20  /* maximum time spent per callback */
+#define COLORIZE_CHUNK_LINES  256  /* lines colorized between checks */
+
+static void colorize_idle_cb(void *opaque)
+{
+    EditState *s = opaque;
+    EditBuffer *b = s->b;
+    QEColorizeCache *cc = s->colorize_cache;
+    unsigned int buf[COLORED_MAX_LINE_SIZE];
+    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
+    QEOffset offset;
+    int start_time, line_num, nb_lines, col;
+
+    /* the timer is freed upon return */
+    s->colorize_timer = NULL;
+
+    start_time = get_clock_ms();
+    for (;;) {
+        eb_get_pos(b, &nb_lines, &col, b->total_size);
+        if (cc->max_valid_offset == QE_OFFSET_MAX
+        &&  cc->nb_valid_lines > nb_lines) {
+            /* colorization is complete */
+            return;
+        }
+        if (is_user_input_pending()) {
+            s->colorize_timer = qe_add_timer(COLORIZE_IDLE_DELAY, s,
+                                             colorize_idle_cb);
+            return;
+        }
+        if (get_clock_ms() - start_time >= COLORIZE_SLICE_MS) {
+            /* let pending events be processed first */
+            s->colorize_timer = qe_add_timer(0, s, colorize_idle_cb);
+            return;
+        }
+        line_num = min(cc->nb_valid_lines + COLORIZE_CHUNK_LINES,
+                       nb_lines);
+        s->get_colorized_line(s, buf, countof(buf), sbuf,
+                              eb_goto_pos(b, line_num, 0), &offset, line_num);
+    }
+}
+
 static int syntax_get_colorized_line(EditState *s, 
                                      unsigned int *buf, int buf_size, 
                                      QETermStyle *sbuf,
-                                     int offset, int *offsetp, int line_num)
+                                     QEOffset offset, QEOffset *offsetp,
+                                     int line_num)
 {
     QEColorizeContext cctx;
     EditBuffer *b = s->b;
-    int i, len, line, n, col, bom;
+    QEColorizeCache *cc = s->colorize_cache;
+    unsigned int *lbuf;
+    int i, n, len, line, col, bom, truncated;
+    QEOffset offset1;
 
     /* invalidate cache if needed */
-    if (s->colorize_max_valid_offset != INT_MAX) {
-        eb_get_pos(b, &line, &col, s->colorize_max_valid_offset);
-        line++;
-        if (line < s->colorize_nb_valid_lines)
-            s->colorize_nb_valid_lines = line;
-        eb_delete_properties(b, s->colorize_max_valid_offset, INT_MAX);
-        s->colorize_max_valid_offset = INT_MAX;
+    if (cc->max_valid_offset != QE_OFFSET_MAX) {
+        colorize_invalidate(cc);
     }
 
     /* realloc state array if needed */
-    if ((line_num + 2) > s->colorize_nb_lines) {
-        /* Reallocate colorization state buffer with pseudo-Fibonacci
-         * geometric progression (ratio of 1.625)
-         */
-        n = max(s->colorize_nb_lines, COLORIZED_LINE_PREALLOC_SIZE);
-        while (n < (line_num + 2))
-            n += (n >> 1) + (n >> 3);
-        if (!qe_realloc(&s->colorize_states,
-                        n * sizeof(*s->colorize_states))) {
-            return 0;
-        }
-        s->colorize_nb_lines = n;
-    }
+    if (colorize_realloc_states(cc, line_num + 2))
+        return 0;
 
     memset(&cctx, 0, sizeof(cctx));
     cctx.s = s;
     cctx.b = b;
 
     /* propagate state if needed */
-    if (line_num >= s->colorize_nb_valid_lines) {
-        if (s->colorize_nb_valid_lines == 0) {
-            s->colorize_states[0] = 0; /* initial state : zero */
-            s->colorize_nb_valid_lines = 1;
-        }
-        offset = eb_goto_pos(b, s->colorize_nb_valid_lines - 1, 0);
-        cctx.colorize_state = s->colorize_states[s->colorize_nb_valid_lines - 1];
+    while (line_num >= cc->nb_valid_lines) {
+        if (cc->nb_valid_lines == 0) {
+            cc->states[0] = 0; /* initial state : zero */
+            cc->nb_valid_lines = 1;
+            cc->resync_line = cc->nb_cached_lines = 0;
+            eb_get_pos(b, &cc->nb_buffer_lines, &col, b->total_size);
+        }
+        offset1 = eb_goto_pos(b, cc->nb_valid_lines - 1, 0);
+        cctx.colorize_state = cc->states[cc->nb_valid_lines - 1];
         cctx.state_only = 1;
 
-        for (line = s->colorize_nb_valid_lines; line <= line_num; line++) {
-            cctx.offset = offset;
-            len = eb_get_line(b, buf, buf_size - 1, offset, &offset);
-            if (buf[len] != '\n') {
-                /* line was truncated */
-                /* XXX: should use reallocatable buffer */
-                offset = eb_goto_pos(b, line, 0);
-            }
-            buf[len] = '\0';
+        for (line = cc->nb_valid_lines; line <= line_num; line++) {
+            cctx.offset = offset1;
+            len = edit_get_line(s, offset1, &offset1, INT_MAX);
+            if (len < 0)
+                return 0;
+            lbuf = s->line_buf;
+            lbuf[len] = '\0';
+
+            /* tags of lines colorized again are added again */
+            eb_delete_properties(b, cctx.offset, offset1);
 
             /* skip byte order mark if present */
-            bom = (buf[0] == 0xFEFF);
+            bom = (lbuf[0] == 0xFEFF);
             if (bom) {
                 cctx.offset = eb_next(b, cctx.offset);
             }
-            s->colorize_func(&cctx, buf + bom, len - bom, s->mode);
-            s->colorize_states[line] = cctx.colorize_state;
+            s->colorize_func(&cctx, lbuf + bom, len - bom, s->mode);
+            edit_shrink_line(s);
+            if (colorize_set_state(cc, line, cctx.colorize_state))
+                break;
         }
+        /* the cached states may have made the line valid before its
+           start was reached */
+        if (line > line_num)
+            offset = offset1;
     }
 
-    /* compute line color */
-    cctx.colorize_state = s->colorize_states[line_num];
+    /* compute line color: only the part of an overlong line that is
+       returned is colorized, the state at the end of the line is then
+       left to the propagation above when the next line is needed, so
+       the cost does not depend on the line length */
+    cctx.colorize_state = cc->states[line_num];
     cctx.state_only = 0;
     cctx.offset = offset;
-    len = eb_get_line(b, buf, buf_size - 1, offset, offsetp);
-    if (buf[len] != '\n') {
-        /* line was truncated */
-        /* XXX: should use reallocatable buffer */
-        *offsetp = eb_goto_pos(b, line_num + 1, 0);
+    len = edit_get_line(s, offset, &offset1,
+                        buf_size + COLORIZED_LINE_LOOKAHEAD);
+    if (len < 0)
+        return 0;
+    lbuf = s->line_buf;
+    truncated = (lbuf[len] != '\n');
+    lbuf[len] = '\0';
+
+    if (line_num + 1 >= cc->nb_valid_lines) {
+        /* the line was not colorized with its current state yet */
+        eb_delete_properties(b, offset, offset1);
+    }
+    if (truncated) {
+        /* skip the rest of the line */
+        eb_get_pos(b, &line, &col, offset1);
+        offset1 = eb_goto_pos(b, line + 1, 0);
     }
-    buf[len] = '\0';
+    *offsetp = offset1;
 
-    bom = (buf[0] == 0xFEFF);
+    bom = (lbuf[0] == 0xFEFF);
     if (bom) {
-        SET_COLOR1(buf, 0, QE_STYLE_PREPROCESS);
+        SET_COLOR1(lbuf, 0, QE_STYLE_PREPROCESS);
         cctx.offset = eb_next(b, cctx.offset);
     }
     cctx.combine_stop = len - bom;
-    s->colorize_func(&cctx, buf + bom, len - bom, s->mode);
-    /* buf[len] has char '\0' but may hold style, force buf ending */
-    buf[len + 1] = 0;
+    s->colorize_func(&cctx, lbuf + bom, len - bom, s->mode);
+    /* lbuf[len] has char '\0' but may hold style, force buf ending */
+    lbuf[len + 1] = 0;
 
-    /* XXX: if state is same as previous, minimize invalid region? */
-    s->colorize_states[line_num + 1] = cctx.colorize_state;
+    if (!truncated) {
+        if (line_num + 1 < cc->nb_valid_lines)
+            cc->states[line_num + 1] = cctx.colorize_state;
+        else
+            colorize_set_state(cc, line_num + 1, cctx.colorize_state);
+    }
 
-    /* Extend valid area */
-    if (s->colorize_nb_valid_lines < line_num + 2)
-        s->colorize_nb_valid_lines = line_num + 2;
+    if (!s->colorize_timer
+    &&  cc->nb_valid_lines <= cc->nb_buffer_lines) {
+        /* colorize the lines below later */
+        s->colorize_timer = qe_add_timer(COLORIZE_IDLE_DELAY, s,
+                                         colorize_idle_cb);
+    }
 
-    /* Extract styles from colored codepoint array */
-    for (i = 0; i <= len + 1; i++) {
-        sbuf[i] = buf[i] >> STYLE_SHIFT;
-        buf[i] &= CHAR_MASK;
+    /* Extract styles from colored codepoint array, the line is truncated
+       to the caller buffer */
+    n = min(len, buf_size - 2);
+    for (i = 0; i <= n; i++) {
+        sbuf[i] = lbuf[i] >> STYLE_SHIFT;
+        buf[i] = lbuf[i] & CHAR_MASK;
     }
+    buf[n] = '\0';
+    sbuf[n + 1] = 0;
+    buf[n + 1] = 0;
 
-    /* Combine with buffer styles on restricted range */
+    /* Combine with buffer styles on restricted range, one run at a time */
     if (s->b->b_styles) {
-        int i, start = bom + cctx.combine_start, stop = bom + cctx.combine_stop;
-        int offset = cctx.offset;
-        for (i = bom; i < stop; i++) {
-            QETermStyle style = eb_get_style(b, offset);
-            if (style && i >= start) {
-                sbuf[i] = style;
+        int i, start = bom + cctx.combine_start;
+        int stop = min(bom + cctx.combine_stop, n);
+        EditBufferCursor cur;
+        QETermStyle style;
+        QEOffset style_end;
+
+        eb_cursor_init(&cur, b, cctx.offset);
+        for (i = bom; i < stop;) {
+            style = eb_get_style_run(b, cur.offset, &style_end);
+            for (; i < stop && cur.offset < style_end; i++) {
+                if (style && i >= start)
+                    sbuf[i] = style;
+                eb_cursor_nextc(&cur);
             }
-            offset = eb_next(b, offset);
         }
     }
-    return len;
+    return n;
 }
 
 /* invalidate the colorize data */
 static void colorize_callback(qe__unused__ EditBuffer *b,
                               void *opaque, qe__unused__ int arg,
-                              qe__unused__ enum LogOperation op,
-                              int offset,
-                              qe__unused__ int size)
+                              enum LogOperation op,
+                              QEOffset offset, QEOffset size)
 {
-    EditState *e = opaque;
+    QEColorizeCache *cc = opaque;
 
-    if (offset < e->colorize_max_valid_offset)
-        e->colorize_max_valid_offset = offset;
+    if (offset < cc->max_valid_offset)
+        cc->max_valid_offset = offset;
+    /* track the end of the modified text */
+    switch (op) {
+    case LOGOP_INSERT:
+        cc->edit_end = max_offset(cc->edit_end, offset) + size;
+        break;
+    case LOGOP_DELETE:
+        cc->edit_end = max_offset(cc->edit_end, offset + size) - size;
+        break;
+    default:
+        cc->edit_end = max_offset(cc->edit_end, offset + size);
+        break;
+    }
+}
+
+/* get the states of the buffer for the window mode and colorizer,
+ * shared with the other windows displaying the buffer the same way.
+ */
+static QEColorizeCache *colorize_cache_get(EditState *s,
+                                           ColorizeFunc colorize_func)
+{
+    EditBuffer *b = s->b;
+    QEColorizeCache *cc;
+
+    for (cc = b->colorize_caches; cc; cc = cc->next) {
+        if (cc->mode == s->mode && cc->colorize_func == colorize_func) {
+            cc->ref_count++;
+            return cc;
+        }
+    }
+    cc = qe_mallocz(QEColorizeCache);
+    if (!cc)
+        return NULL;
+    cc->b = b;
+    cc->mode = s->mode;
+    cc->colorize_func = colorize_func;
+    cc->ref_count = 1;
+    cc->max_valid_offset = QE_OFFSET_MAX;
+    if (eb_add_callback(b, colorize_callback, cc, 0)) {
+        qe_free(&cc);
+        return NULL;
+    }
+    cc->next = b->colorize_caches;
+    b->colorize_caches = cc;
+    return cc;
+}
+
+static void colorize_cache_release(QEColorizeCache **ccp)
+{
+    QEColorizeCache *cc = *ccp, **pp;
+
+    if (!cc)
+        return;
+    *ccp = NULL;
+    if (--cc->ref_count > 0)
+        return;
+    for (pp = &cc->b->colorize_caches; *pp; pp = &(*pp)->next) {
+        if (*pp == cc) {
+            *pp = cc->next;
+            break;
+        }
+    }
+    eb_free_callback(cc->b, colorize_callback, cc);
+    qe_free(&cc->states);
+    qe_free(&cc);
 }
 
 #endif /* CONFIG_TINY */
@@ -4201,21 +4568,39 @@ void set_colorize_func(EditState *s, ColorizeFunc colorize_func)
     s->colorize_func = NULL;
 
 #ifndef CONFIG_TINY
-    /* invalidate the previous states & free previous colorizer */
-    eb_free_callback(s->b, colorize_callback, s);
-    qe_free(&s->colorize_states);
-    s->colorize_nb_lines = 0;
-    s->colorize_nb_valid_lines = 0;
-    s->colorize_max_valid_offset = INT_MAX;
-    s->colorize_func = colorize_func;
-    if (colorize_func)
-        eb_add_callback(s->b, colorize_callback, s, 0);
+    /* release the previous states & free previous colorizer */
+    qe_kill_timer(&s->colorize_timer);
+    colorize_cache_release(&s->colorize_cache);
+    if (colorize_func) {
+        s->colorize_cache = colorize_cache_get(s, colorize_func);
+        if (s->colorize_cache)
+            s->colorize_func = colorize_func;
+    }
+#endif
+}
+
+/* return the colorizer state at the start of line line_num if it is
+   known, -1 otherwise */
+static int colorize_line_state(EditState *s, int line_num)
+{
+#ifndef CONFIG_TINY
+    QEColorizeCache *cc = s->colorize_cache;
+
+    if (s->colorize_func && line_num >= 0) {
+        if (cc->max_valid_offset != QE_OFFSET_MAX) {
+            colorize_invalidate(cc);
+        }
+        if (line_num < cc->nb_valid_lines)
+            return cc->states[line_num];
+    }
 #endif
+    return -1;
 }
 
 int generic_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
                                QETermStyle *sbuf,
-                               int offset, int *offsetp, int line_num)
+                               QEOffset offset, QEOffset *offsetp,
+                               int line_num)
 {
     int len;
 
@@ -4231,9 +4616,8 @@ int generic_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
     } else {
         len = eb_get_line(s->b, buf, buf_size, offset, offsetp);
         if (buf[len] != '\n') {
-            /* line was truncated */
-            /* XXX: should use reallocatable buffer */
-            *offsetp = eb_goto_pos(s->b, line_num + 1, 0);
+            /* line was truncated: skip the rest of it */
+            *offsetp = eb_next_line(s->b, *offsetp);
         }
         buf[len] = '\0';
         if (sbuf) {
@@ -4243,13 +4627,263 @@ int generic_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
     return len;
 }
 
+/* Line memo: while a long line is laid out, positions where the
+   layout can resume are memorized.  In truncate mode, the start of a
+   text fragment is memorized every `step` pixels, so the display of a
+   horizontally scrolled line can resume at the last mark left of the
+   window.  In wrap modes, the start of a row is memorized every `step`
+   rows along with the height of the whole line, so the rows above the
+   window or before the cursor can be skipped.  Marks are kept in
+   increasing offset and position order.
+ */
+static void line_memo_free(EditState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_line_memos; i++) {
+        qe_free(&s->line_memos[i].marks);
+    }
+    qe_free(&s->line_memos);
+    s->nb_line_memos = 0;
+    s->line_memo_next = 0;
+}
+
+/* update the marks upon buffer modification */
+static void line_memo_callback(qe__unused__ EditBuffer *b,
+                               void *opaque, qe__unused__ int arg,
+                               enum LogOperation op,
+                               QEOffset offset, QEOffset size)
+{
+    EditState *s = opaque;
+    QELineMemo *cm;
+    int i, j, styled;
+
+    /* the colorizer may change the styles of the text after the
+       modification, hence its layout with proportional fonts */
+    styled = s->colorize_func && !(s->screen->media & CSS_MEDIA_TTY);
+
+    for (i = 0; i < s->nb_line_memos; i++) {
+        cm = &s->line_memos[i];
+        if (cm->offset < 0)
+            continue;
+        if (cm->offset <= offset) {
+            if (cm->height >= 0 && cm->next_offset >= 0
+            &&  offset >= cm->next_offset) {
+                /* the line is not modified */
+                continue;
+            }
+            /* the layout changes from the modified text on */
+            while (cm->nb_marks > 0
+            &&     cm->marks[cm->nb_marks - 1].offset >= offset) {
+                cm->nb_marks--;
+            }
+            if (cm->wrap != WRAP_TRUNCATE && cm->nb_marks > 0) {
+                /* the row of the modified text may start elsewhere */
+                cm->nb_marks--;
+            }
+            cm->height = -1;
+        } else
+        if (op == LOGOP_INSERT) {
+            cm->offset += size;
+            if (cm->next_offset >= 0)
+                cm->next_offset += size;
+            for (j = 0; j < cm->nb_marks; j++)
+                cm->marks[j].offset += size;
+        } else
+        if (op == LOGOP_DELETE && cm->offset > offset + size) {
+            cm->offset -= size;
+            if (cm->next_offset >= 0)
+                cm->next_offset -= size;
+            for (j = 0; j < cm->nb_marks; j++)
+                cm->marks[j].offset -= size;
+        } else
+        if (op == LOGOP_DELETE || cm->offset <= offset + size) {
+            /* the start of line was modified */
+            cm->offset = -1;
+            cm->nb_marks = 0;
+        }
+        if (styled && cm->offset > offset) {
+            cm->nb_marks = 0;
+            cm->height = -1;
+        }
+    }
+}
+
+/* find the memo of the line starting at offset */
+static QELineMemo *line_memo_find(EditState *s, DisplayState *ds,
+                                  QEOffset offset, int create)
+{
+    QELineMemo *cm;
+    int i;
+
+    for (i = 0; i < s->nb_line_memos; i++) {
+        cm = &s->line_memos[i];
+        if (cm->offset == offset) {
+            if (cm->wrap == ds->wrap
+            &&  cm->width == ds->width
+            &&  cm->tab_width == ds->tab_width
+            &&  cm->line_numbers == ds->line_numbers) {
+                return cm;
+            }
+            if (!create)
+                return NULL;
+            goto init;
+        }
+    }
+    if (!create)
+        return NULL;
+    if (!s->line_memos) {
+        s->line_memos = qe_mallocz_array(QELineMemo, LINE_MEMO_LINES);
+        if (!s->line_memos)
+            return NULL;
+    }
+    if (s->nb_line_memos < LINE_MEMO_LINES) {
+        cm = &s->line_memos[s->nb_line_memos++];
+    } else {
+        /* reuse the entries in round robin order */
+        cm = &s->line_memos[s->line_memo_next];
+        s->line_memo_next = (s->line_memo_next + 1) % LINE_MEMO_LINES;
+    }
+ init:
+    if (!cm->marks) {
+        cm->marks = qe_malloc_array(QELineMark, LINE_MEMO_MARKS);
+        if (!cm->marks) {
+            cm->offset = -1;
+            return NULL;
+        }
+    }
+    cm->offset = offset;
+    cm->wrap = ds->wrap;
+    cm->width = ds->width;
+    cm->tab_width = ds->tab_width;
+    cm->line_numbers = ds->line_numbers;
+    cm->step = (ds->wrap == WRAP_TRUNCATE) ? max(ds->width, 1) : 1;
+    cm->height = -1;
+    cm->nb_rows = 0;
+    cm->next_offset = -1;
+    cm->nb_marks = 0;
+    return cm;
+}
+
+/* return true if the rows of the line before the one starting at
+   offset, at row number row and position y, are not needed.  The
+   whole line is described by its next offset, row count and height. */
+static int line_memo_skip(EditState *s, DisplayState *ds, QELineMemo *cm,
+                          QEOffset offset, int row, int y)
+{
+    int before_cursor;
+
+    if (!ds->cursor_func && ds->do_disp != DISP_PRINT)
+        return 1;
+    before_cursor = (s->offset < cm->offset ||
+                     (offset >= 0 && offset <= s->offset));
+    return (ds->cursor_only && before_cursor)
+        || (ds->visible_only && before_cursor && ds->y + y < 0)
+        || (ds->line_num_min >= 0 && ds->line_num + row <= ds->line_num_min);
+}
+
+/* return true if the rest of the line, from the current row on, is
+   not needed */
+static int line_memo_skip_rest(EditState *s, DisplayState *ds,
+                               QELineMemo *cm)
+{
+    int after_cursor;
+
+    if (ds->eod && ds->do_disp != DISP_PRINT)
+        return 1;
+    after_cursor = (s->offset < ds->row_offset ||
+                    (cm->next_offset >= 0 && s->offset >= cm->next_offset));
+    return (ds->cursor_only && after_cursor)
+        || (ds->visible_only && ds->y >= ds->height
+            && (ds->eod || after_cursor));
+}
+
+/* erase the line shadow of n rows that are skipped by the layout, so
+   they are redrawn when they are displayed again */
+static void line_shadow_erase(EditState *s, int line_num, int n)
+{
+    if (line_num >= 0 && line_num < s->shadow_nb_lines && n > 0) {
+        n = min(n, s->shadow_nb_lines - line_num);
+        memset(&s->line_shadow[line_num], 0xff, n * sizeof(QELineShadow));
+    }
+}
+
+/* find the last mark where the layout can resume: in truncate mode,
+   left of the window and before the cursor if it is on the line;
+   visible marks can be used if only the cursor position is needed */
+static QELineMark *line_memo_seek(EditState *s, DisplayState *ds,
+                                  QELineMemo *cm)
+{
+    QELineMark *mark;
+    int lo, hi, mid, ok;
+
+    lo = 0;
+    hi = cm->nb_marks;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        mark = &cm->marks[mid];
+        if (cm->wrap == WRAP_TRUNCATE) {
+            ok = (ds->cursor_only || ds->x_disp + mark->x <= 0)
+                &&  (s->offset < cm->offset || mark->offset < s->offset);
+        } else {
+            ok = line_memo_skip(s, ds, cm, mark->offset, mark->row, mark->y);
+        }
+        if (ok) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? &cm->marks[lo - 1] : NULL;
+}
+
+/* memorize the layout position of the text starting at offset and
+   return the position of the next mark: a column in truncate mode, a
+   row number in wrap modes */
+static int line_memo_add(EditState *s, DisplayState *ds,
+                         QELineMemo **cmp, QEOffset line_offset,
+                         QEOffset offset, int char_index, int y, int row)
+{
+    QELineMemo *cm = *cmp;
+    QELineMark *mark;
+    int i;
+
+    if (!cm) {
+        cm = *cmp = line_memo_find(s, ds, line_offset, 1);
+        if (!cm)
+            return INT_MAX;
+    }
+    if (cm->nb_marks == LINE_MEMO_MARKS) {
+        /* keep every other mark */
+        for (i = 0; i < LINE_MEMO_MARKS / 2; i++) {
+            cm->marks[i] = cm->marks[2 * i + 1];
+        }
+        cm->nb_marks = LINE_MEMO_MARKS / 2;
+        cm->step *= 2;
+    }
+    mark = &cm->marks[cm->nb_marks++];
+    mark->offset = offset;
+    mark->char_index = char_index;
+    mark->x = ds->x - ds->x_disp;
+    mark->y = y;
+    mark->row = row;
+    mark->word_space = ds->row_word_space;
+    if (cm->wrap == WRAP_TRUNCATE)
+        return mark->x + cm->step;
+    else
+        return row + cm->step;
+}
+
 #define RLE_EMBEDDINGS_SIZE    128
 
 /* Display one line in the window */
-int text_display_line(EditState *s, DisplayState *ds, int offset)
+QEOffset text_display_line(EditState *s, DisplayState *ds, QEOffset offset)
 {
-    int c;
-    int offset0, offset1, line_num, col_num;
+    QEOffset offset0, offset1, offset_eol, offset2;
+    int c, line_num, col_num, x_max, x_mark;
+    int y0, row0, row_num, row_mark;
+    QELineMemo *cm;
+    QELineMark *mark;
     TypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
     int embedding_level, embedding_max_level;
     FriBidiCharType base;
@@ -4288,15 +4922,64 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
 
     display_bol_bidir(ds, base, embedding_max_level);
 
+    /* in truncate mode, characters laid out past the right border
+       are not visible: the rest of the line can be skipped unless the
+       cursor needs to be found there.  Similarly, the characters left
+       of a horizontally scrolled window are skipped using the line
+       memo.  In wrap modes, the line memo is used to skip the rows
+       that are not needed, or the whole line. */
+    x_max = -1;
+    x_mark = INT_MAX;
+    row_mark = INT_MAX;
+    offset_eol = -1;
+    cm = NULL;
+    mark = NULL;
+    y0 = ds->y;
+    row0 = row_num = ds->line_num;
+    if (ds->base == DIR_LTR && !(s->flags & WF_MINIBUF)) {
+        if (ds->wrap == WRAP_TRUNCATE) {
+            x_max = ds->width + ds->eol_width;
+            if (embedding_max_level == 0) {
+                x_mark = max(ds->width, 1);
+                cm = line_memo_find(s, ds, offset1, 0);
+                if (cm) {
+                    mark = line_memo_seek(s, ds, cm);
+                    if (cm->nb_marks > 0) {
+                        x_mark = cm->marks[cm->nb_marks - 1].x + cm->step;
+                    }
+                }
+            }
+        } else
+        if (ds->wrap != WRAP_AUTO && embedding_max_level == 0) {
+            row_mark = 1;
+            cm = line_memo_find(s, ds, offset1, 0);
+            if (cm) {
+                if (cm->height >= 0
+                &&  line_memo_skip(s, ds, cm, cm->next_offset,
+                                   cm->nb_rows, cm->height)) {
+                    if (ds->do_disp == DISP_PRINT)
+                        line_shadow_erase(s, ds->line_num, cm->nb_rows);
+                    ds->y += cm->height;
+                    ds->line_num += cm->nb_rows;
+                    return cm->next_offset;
+                }
+                mark = line_memo_seek(s, ds, cm);
+                if (cm->nb_marks > 0) {
+                    row_mark = cm->marks[cm->nb_marks - 1].row + cm->step;
+                }
+            }
+        }
+    }
+
     /* line numbers */
-    if (ds->line_numbers) {
+    if (ds->line_numbers && !mark) {
         ds->style = QE_STYLE_GUTTER;
         display_printf(ds, -1, -1, "%6d  ", line_num + 1);
         ds->style = 0;
     }
 
     /* prompt display, only on first line */
-    if (s->prompt && offset1 == 0) {
+    if (s->prompt && offset1 == 0 && !mark) {
         const char *p = s->prompt;
 
         while (*p) {
@@ -4323,15 +5006,15 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
     if (s->curline_style || s->region_style) {
         /* CG: Should combine styles instead of replacing */
         if (s->region_style && !s->curline_style) {
-            int line, start_offset, end_offset;
-            int i, start_char, end_char;
+            QEOffset start_offset, end_offset;
+            int line, i, start_char, end_char;
 
             if (s->b->mark < s->offset) {
-                start_offset = max(offset, s->b->mark);
-                end_offset = min(offset0, s->offset);
+                start_offset = max_offset(offset, s->b->mark);
+                end_offset = min_offset(offset0, s->offset);
             } else {
-                start_offset = max(offset, s->offset);
-                end_offset = min(offset0, s->b->mark);
+                start_offset = max_offset(offset, s->offset);
+                end_offset = min_offset(offset0, s->b->mark);
             }
             if (start_offset < end_offset) {
                 /* Compute character positions */
@@ -4356,8 +5039,36 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
 
     bd = embeds + 1;
     char_index = 0;
+    if (mark) {
+        /* resume the layout at the mark */
+        offset = mark->offset;
+        char_index = mark->char_index;
+        if (ds->wrap == WRAP_TRUNCATE) {
+            ds->x = ds->x_disp + mark->x;
+            ds->x_line = ds->x_start + mark->x;
+        } else {
+            if (ds->do_disp == DISP_PRINT)
+                line_shadow_erase(s, ds->line_num, mark->row);
+            ds->y += mark->y;
+            ds->line_num += mark->row;
+            row_num = ds->line_num;
+            ds->left_gutter = ds->line_numbers;
+            ds->x = ds->x_line = ds->x_start + ds->left_gutter;
+            ds->last_word_space = mark->word_space;
+        }
+    }
     for (;;) {
         offset0 = offset;
+        if (x_max >= 0 && ds->x >= x_max) {
+            if (offset_eol < 0) {
+                eb_get_pos(s->b, &line_num, &col_num, offset0);
+                offset_eol = eb_goto_pos(s->b, line_num, INT_MAX);
+            }
+            if (s->offset < offset0 || s->offset > offset_eol) {
+                offset0 = offset = offset_eol;
+                x_max = -1;
+            }
+        }
         if (offset >= s->b->total_size) {
             /* the offset passed here is for cursor positioning 
                when s->offset == s->b->total_size.
@@ -4376,7 +5087,7 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
                 break;
             }
             /* compute embedding from RLE embedding list */
-            if (offset0 >= bd[1].pos)
+            if (offset0 - offset1 >= bd[1].pos)
                 bd++;
             embedding_level = bd[0].level;
             /* XXX: use embedding level for all cases ? */
@@ -4403,20 +5114,335 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
             } else {
                 display_char_bidir(ds, offset0, offset, embedding_level, c);
             }
+            if (ds->x - ds->x_disp >= x_mark
+            &&  ds->fragment_index == 1
+            &&  ds->fragment_offsets[0][0] == offset0) {
+                /* the character starts a new fragment */
+                x_mark = line_memo_add(s, ds, &cm, offset1,
+                                       offset0, char_index, 0, 0);
+            } else
+            if (ds->line_num != row_num) {
+                /* a new row was started */
+                row_num = ds->line_num;
+                if (ds->row_offset >= 0 && ds->row_offset <= offset0
+                &&  row_mark != INT_MAX) {
+                    if (cm && cm->height >= 0
+                    &&  line_memo_skip_rest(s, ds, cm)) {
+                        if (ds->do_disp == DISP_PRINT) {
+                            line_shadow_erase(s, ds->line_num,
+                                              row0 + cm->nb_rows - ds->line_num);
+                        }
+                        ds->y = y0 + cm->height;
+                        ds->line_num = row0 + cm->nb_rows;
+                        ds->x_line = ds->x_start;
+                        return cm->next_offset;
+                    }
+                    if (row_num - row0 >= row_mark) {
+                        /* count the characters of the row laid out so
+                           far.  A tab among them keeps the width computed
+                           on the previous row: the row cannot be laid out
+                           on its own then. */
+                        i = 0;
+                        for (offset2 = ds->row_offset; offset2 < offset; i++) {
+                            if (eb_nextc(s->b, offset2, &offset2) == '\t') {
+                                i = 0;
+                                break;
+                            }
+                        }
+                        if (i > 0) {
+                            row_mark = line_memo_add(s, ds, &cm, offset1,
+                                                     ds->row_offset,
+                                                     char_index + 1 - i,
+                                                     ds->y - y0,
+                                                     row_num - row0);
+                        }
+                    }
+                }
+            }
             char_index++;
             //if (ds->y >= s->height && ds->eod)  //@@@ causes bug
             //    break;
         }
     }
+    if (cm && row_mark != INT_MAX) {
+        /* memorize the size of the wrapped line */
+        cm->height = ds->y - y0;
+        cm->nb_rows = ds->line_num - row0;
+        cm->next_offset = offset;
+    }
     return offset;
 }
 
+/* The lines laid out by the last redisplay of a window are memorized
+   along with the parameters and the state their display depends on.
+   A line whose contents were not modified since (see
+   display_lines_callback), nor its styles by a cursor move, is not laid
+   out again if it is found at the same position with the same line
+   number and colorizer state: its rows are still on the screen.  The
+   cost of a redisplay is then proportional to the number of lines
+   modified. */
+static void display_lines_free(EditState *s)
+{
+    qe_free(&s->display_lines);
+    s->nb_display_lines = 0;
+}
+
+/* update the memorized lines upon buffer modification */
+static void display_lines_callback(qe__unused__ EditBuffer *b,
+                                   void *opaque, qe__unused__ int arg,
+                                   enum LogOperation op,
+                                   QEOffset offset, QEOffset size)
+{
+    EditState *s = opaque;
+    QEDisplayLine *dl;
+    QEOffset end = offset + size;
+    int i;
+
+    for (i = 0; i < s->nb_display_lines; i++) {
+        dl = &s->display_lines[i];
+        switch (op) {
+        case LOGOP_INSERT:
+            if (dl->offset > offset) {
+                dl->offset += size;
+            } else
+            if (dl->next_offset >= 0 && dl->next_offset <= offset) {
+                /* the line is before the modification */
+                continue;
+            } else {
+                dl->dirty = 1;
+            }
+            if (dl->next_offset >= 0)
+                dl->next_offset += size;
+            break;
+        case LOGOP_DELETE:
+            if (dl->offset > offset && dl->offset >= end) {
+                dl->offset -= size;
+            } else
+            if (dl->next_offset >= 0 && dl->next_offset <= offset) {
+                continue;
+            } else {
+                /* the line is modified or its start was deleted */
+                dl->dirty = 1;
+                if (dl->offset > offset)
+                    dl->offset = offset;
+            }
+            if (dl->next_offset >= end) {
+                dl->next_offset -= size;
+            } else
+            if (dl->next_offset > offset) {
+                dl->next_offset = offset;
+            }
+            break;
+        case LOGOP_WRITE:
+            if (dl->offset < end
+            &&  (dl->next_offset < 0 || dl->next_offset > offset)) {
+                dl->dirty = 1;
+            }
+            break;
+        default:
+            dl->dirty = 1;
+            break;
+        }
+    }
+}
+
+/* mark dirty the lines whose styles depend on a position that moved
+   from `from` to `to`: current line, region or selection */
+static void display_lines_moved(EditState *s, QEOffset from, QEOffset to)
+{
+    QEDisplayLine *dl;
+    QEOffset lo = min_offset(from, to), hi = max_offset(from, to);
+    int i;
+
+    if (lo == hi)
+        return;
+    for (i = 0; i < s->nb_display_lines; i++) {
+        dl = &s->display_lines[i];
+        if (dl->offset <= hi && (dl->next_offset < 0 || dl->next_offset >= lo))
+            dl->dirty = 1;
+    }
+}
+
+/* return true if the memorized lines can be used for the window */
+static int display_lines_usable(EditState *s)
+{
+    /* the highlighting of search matches, buffer styles, and special
+       line colorizers may change any line */
+    return s->mode->display_line == text_display_line
+        && !(s->flags & WF_MINIBUF)
+        && !s->isearch_state
+        && !s->b->b_styles
+        && s->get_colorized_line == generic_get_colorized_line;
+}
+
+/* hash of the parameters the layout of all lines depends on */
+static uint64_t display_lines_key(EditState *s, DisplayState *ds)
+{
+    uintptr_t params[28];
+    int n = 0;
+
+    params[n++] = (uintptr_t)s->b;
+    params[n++] = (uintptr_t)s->b->charset;
+    params[n++] = s->b->eol_type;
+    params[n++] = (uintptr_t)s->mode;
+    params[n++] = (uintptr_t)s->colorize_func;
+    params[n++] = (uintptr_t)s->prompt;
+    params[n++] = s->xleft;
+    params[n++] = s->ytop;
+    params[n++] = s->width;
+    params[n++] = s->x_disp[0];
+    params[n++] = s->x_disp[1];
+    params[n++] = s->hex_mode;
+    params[n++] = s->unihex_mode;
+    params[n++] = s->bidir;
+    params[n++] = s->default_style;
+    params[n++] = s->curline_style;
+    params[n++] = s->region_style;
+    params[n++] = s->show_selection;
+    params[n++] = s->qe_state->show_unicode;
+    params[n++] = ds->wrap;
+    params[n++] = ds->width;
+    params[n++] = ds->height;
+    params[n++] = ds->tab_width;
+    params[n++] = ds->space_width;
+    params[n++] = ds->default_line_height;
+    params[n++] = ds->line_numbers;
+    params[n++] = ds->eol_width;
+    return compute_hash(params, n * sizeof(*params), 0);
+}
+
+/* get the line number and colorizer state the display of the line
+   at offset depends on */
+static void display_lines_state(EditState *s, QEOffset offset,
+                                int *buf_line, int *colorize_state)
+{
+    int col_num;
+
+    *buf_line = -1;
+    if (s->line_numbers || s->colorize_func) {
+        eb_get_pos(s->b, buf_line, &col_num, offset);
+    }
+    *colorize_state = colorize_line_state(s, *buf_line);
+}
+
+/* return the memorized line starting at offset if its display did not
+   change since the last redisplay, NULL otherwise */
+static QEDisplayLine *display_lines_find(EditState *s, QEOffset offset)
+{
+    QEDisplayLine *dl;
+    int lo, hi, mid, buf_line, colorize_state;
+
+    lo = 0;
+    hi = s->nb_display_lines;
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (s->display_lines[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo >= s->nb_display_lines)
+        return NULL;
+    dl = &s->display_lines[lo];
+    if (dl->offset != offset || dl->dirty)
+        return NULL;
+    /* the cursor line is always laid out to locate the cursor */
+    if (s->offset >= dl->offset
+    &&  (dl->next_offset < 0 || s->offset < dl->next_offset)) {
+        return NULL;
+    }
+    display_lines_state(s, offset, &buf_line, &colorize_state);
+    if (buf_line != dl->buf_line || colorize_state != dl->colorize_state)
+        return NULL;
+    return dl;
+}
+
+/* return true if the rows of a memorized line are still displayed */
+static int display_lines_shown(EditState *s, DisplayState *ds,
+                               QEDisplayLine *dl)
+{
+    int i;
+
+    if (dl->y != ds->y || dl->line_num != ds->line_num
+    ||  dl->y < 0 || dl->y + dl->height > ds->height
+    ||  dl->line_num + dl->nb_rows > s->shadow_nb_lines) {
+        return 0;
+    }
+    /* the rows drawn over or erased since have an invalid shadow */
+    for (i = dl->line_num; i < dl->line_num + dl->nb_rows; i++) {
+        if (s->line_shadow[i].height < 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* display the lines from offset_top to the bottom of the window,
+   laying out only the lines whose display changed if `reuse`, and
+   memorize them for the next redisplay */
+static void display_lines_print(EditState *s, DisplayState *ds, int reuse)
+{
+    QEDisplayLine *lines = NULL, *dl, dl1;
+    int nb_lines = 0, lines_size = 0, n;
+    QEOffset offset, offset1;
+
+    ds->eod = 0;
+    offset = s->offset_top;
+    for (;;) {
+        dl = reuse ? display_lines_find(s, offset) : NULL;
+        if (dl && display_lines_shown(s, ds, dl)) {
+            dl1 = *dl;
+            ds->y += dl->height;
+            ds->line_num += dl->nb_rows;
+            offset1 = dl->next_offset;
+        } else {
+            dl1.offset = offset;
+            dl1.y = ds->y;
+            dl1.line_num = ds->line_num;
+            offset1 = s->mode->display_line(s, ds, offset);
+            dl1.next_offset = offset1;
+            dl1.height = ds->y - dl1.y;
+            dl1.nb_rows = ds->line_num - dl1.line_num;
+            dl1.dirty = 0;
+            if (reuse) {
+                display_lines_state(s, offset, &dl1.buf_line,
+                                    &dl1.colorize_state);
+            }
+        }
+        if (reuse) {
+            if (nb_lines >= lines_size) {
+                n = lines_size + 32;
+                if (!qe_realloc(&lines, n * sizeof(*lines))) {
+                    /* memorize no lines */
+                    qe_free(&lines);
+                    nb_lines = 0;
+                    reuse = 0;
+                }
+                lines_size = n;
+            }
+            if (reuse)
+                lines[nb_lines++] = dl1;
+        }
+        offset = offset1;
+        s->offset_bottom = offset;
+
+        /* EOF reached ? */
+        if (offset < 0 || ds->y >= ds->height)
+            break;
+    }
+    display_lines_free(s);
+    s->display_lines = lines;
+    s->nb_display_lines = nb_lines;
+}
+
 /* Generic display algorithm with automatic fit */
 static void generic_text_display(EditState *s)
 {
     CursorContext m1, *m = &m1;
     DisplayState ds1, *ds = &ds1;
-    int x1, xc, yc, offset, bottom = -1;
+    QEDisplayLine *dl;
+    QEOffset offset, bottom = -1;
+    uint64_t key;
+    int x1, xc, yc, reuse;
 
     if (s->offset == 0) {
         s->offset_top = s->y_disp = s->x_disp[0] = s->x_disp[1] = 0;
@@ -4434,9 +5460,22 @@ static void generic_text_display(EditState *s)
         /* invalidate the line shadow buffer */
         qe_free(&s->line_shadow);
         s->shadow_nb_lines = 0;
+        line_memo_free(s);
+        display_lines_free(s);
         s->display_invalid = 0;
     }
 
+    reuse = display_lines_usable(s);
+    if (!reuse) {
+        display_lines_free(s);
+    } else
+    if (s->curline_style || s->region_style || s->show_selection) {
+        /* the styles of the lines between the old and new positions
+           of the cursor and of the mark change */
+        display_lines_moved(s, s->display_offset, s->offset);
+        display_lines_moved(s, s->display_mark, s->b->mark);
+    }
+
     /* find cursor position with the current x_disp & y_disp and
        update y_disp so that we display only the needed lines */
     /* XXX: should update x_disp, y_disp to bring the cursor closest
@@ -4446,13 +5485,25 @@ static void generic_text_display(EditState *s)
     m->offsetc = s->offset;
     m->xc = m->yc = NO_CURSOR;
     display_init(ds, s, DISP_CURSOR_SCREEN, cursor_func, m);
+    ds->cursor_only = 1;
+    /* the heights of the unchanged lines are known */
+    key = display_lines_key(s, ds);
     offset = s->offset_top;
     for (;;) {
         if (ds->y <= 0) {
             s->offset_top = offset;
             s->y_disp = ds->y;
         }
-        offset = s->mode->display_line(s, ds, offset);
+        dl = NULL;
+        if (reuse && key == s->display_key)
+            dl = display_lines_find(s, offset);
+        if (dl) {
+            ds->y += dl->height;
+            ds->line_num += dl->nb_rows;
+            offset = dl->next_offset;
+        } else {
+            offset = s->mode->display_line(s, ds, offset);
+        }
         s->offset_bottom = offset;
         if (offset < 0 || ds->y >= s->height || m->xc != NO_CURSOR)
             break;
@@ -4464,6 +5515,7 @@ static void generic_text_display(EditState *s)
         /* if no cursor found then we compute offset_top so that we
            have a chance to find the cursor in a small amount of time */
         display_init(ds, s, DISP_CURSOR_SCREEN, cursor_func, m);
+        ds->cursor_only = 1;
         ds->y = 0;
         offset = s->mode->backward_offset(s, s->offset);
         bottom = s->mode->display_line(s, ds, offset);
@@ -4547,7 +5599,14 @@ static void generic_text_display(EditState *s)
     m->offsetc = s->offset;
     m->xc = m->yc = NO_CURSOR;
     display_init(ds, s, DISP_PRINT, cursor_func, m);
-    display1(ds);
+    ds->visible_only = 1;
+    key = display_lines_key(s, ds);
+    if (key != s->display_key) {
+        /* the layout parameters changed: all lines are laid out */
+        display_lines_free(s);
+        s->display_key = key;
+    }
+    display_lines_print(s, ds, reuse);
     /* display the remaining region */
     if (ds->y < s->height) {
         QEStyleDef default_style;
@@ -4560,8 +5619,11 @@ static void generic_text_display(EditState *s)
             memset(&s->line_shadow[ds->line_num], 0xff,
                    (s->shadow_nb_lines - ds->line_num) * sizeof(QELineShadow));
         }
+        line_shadow_clip(s, -1, ds->y, s->height - ds->y);
     }
     display_close(ds);
+    s->display_offset = s->offset;
+    s->display_mark = s->b->mark;
 
     xc = m->xc;
     yc = m->yc;
@@ -4587,6 +5649,13 @@ static void generic_text_display(EditState *s)
                 /* invalidate line so that the cursor will be erased next time */
                 memset(&s->line_shadow[m->linec], 0xff, sizeof(QELineShadow));
             }
+            for (dl = s->display_lines;
+                 dl < s->display_lines + s->nb_display_lines; dl++) {
+                if (m->linec >= dl->line_num
+                &&  m->linec < dl->line_num + dl->nb_rows) {
+                    dl->dirty = 1;
+                }
+            }
         }
     }
     s->cur_rtl = (m->dirc == DIR_RTL);
@@ -5738,8 +6807,8 @@ void switch_to_buffer(EditState *s, EditBuffer *b)
         if (b->saved_data) {
             /* Restore window mode and data from buffer saved data */
             memcpy(s, b->saved_data, SAVED_DATA_SIZE);
-            s->offset = min(s->offset, b->total_size);
-            s->offset_top = min(s->offset_top, b->total_size);
+            s->offset = min_offset(s->offset, b->total_size);
+            s->offset_top = min_offset(s->offset_top, b->total_size);
             mode = b->saved_mode;
         } else {
             /* Try to get window mode and data from another window */
@@ -5914,6 +6983,10 @@ void edit_close(EditState **sp)
         qe_free(&s->caption);
         qe_free(&s->line_shadow);
         s->shadow_nb_lines = 0;
+        qe_free(&s->line_buf);
+        s->line_buf_size = 0;
+        line_memo_free(s);
+        display_lines_free(s);
         qe_free(sp);
     }
 }
@@ -6072,7 +7145,7 @@ typedef struct MinibufState {
 
     StringArray *history;
     int history_index;
-    int history_saved_offset;
+    QEOffset history_saved_offset;
 } MinibufState;
 
 static ModeDef minibuffer_mode;
@@ -6205,8 +7278,8 @@ void do_minibuffer_complete(EditState *s, int type)
     complete_end(&cs);
 }
 
-static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
-                                   int *offsetp)
+static int eb_match_string_reverse(EditBuffer *b, QEOffset offset,
+                                   const char *str, QEOffset *offsetp)
 {
     int len = strlen(str);
 
@@ -6220,8 +7293,9 @@ static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
 
 void do_minibuffer_electric(EditState *s, int key)
 {
-    int c, offset, stop;
+    QEOffset offset, stop;
     MinibufState *mb = minibuffer_get_state(s, 0);
+    int c;
 
     if (mb && mb->completion_function == file_completion) {
         stop = s->offset;
@@ -6385,7 +7459,8 @@ void do_minibuffer_exit(EditState *s, int do_abort)
         /* if completion is activated, then select current file only if
            the selection is highlighted */
         if (cw && cw->force_highlight) {
-            int offset, len;
+            QEOffset offset;
+            int len;
 
             len = eb_fgets(cw->b, buf, sizeof(buf), list_get_offset(cw), &offset);
             buf[len] = '\0';   /* strip the trailing newline if any */
@@ -6818,7 +7893,7 @@ void canonicalize_absolute_path(EditState *s, char *buf, int buf_size, const cha
     return canonicalize_absolute_buffer_path(s ? s->b : NULL, s ? s->offset : 0, buf, buf_size, path1);
 }
 
-void canonicalize_absolute_buffer_path(EditBuffer *b, int offset, char *buf, int buf_size, const char *path1)
+void canonicalize_absolute_buffer_path(EditBuffer *b, QEOffset offset, char *buf, int buf_size, const char *path1)
 {
     char cwd[MAX_FILENAME_SIZE];
     char path[MAX_FILENAME_SIZE];
@@ -6864,7 +7939,8 @@ void canonicalize_absolute_buffer_path(EditBuffer *b, int offset, char *buf, int
 }
 
 /* compute default path for find/save buffer */
-char *get_default_path(EditBuffer *b, int offset, char *buf, int buf_size)
+char *get_default_path(EditBuffer *b, QEOffset offset,
+                       char *buf, int buf_size)
 {
     char buf1[MAX_FILENAME_SIZE];
     const char *filename;
@@ -6894,7 +7970,7 @@ static int probe_mode(EditState *s, EditBuffer *b,
                       ModeDef **modes, int nb_modes,
                       int *scores, int min_score,
                       const char *filename, int st_errno, int st_mode,
-                      long total_size, const uint8_t *rawbuf, int len,
+                      QEOffset total_size, const uint8_t *rawbuf, int len,
                       QECharset *charset, EOLType eol_type)
 {
     u8 buf[4097];
@@ -6902,8 +7978,8 @@ static int probe_mode(EditState *s, EditBuffer *b,
     char fname[MAX_FILENAME_SIZE];
     ModeDef *m;
     ModeProbeData probe_data;
-    int found_modes;
-    const uint8_t *p;
+    int found_modes, line_len;
+    const uint8_t *p, *p0;
 
     if (!modes || !scores || nb_modes < 1)
         return 0;
@@ -6967,8 +8043,26 @@ static int probe_mode(EditState *s, EditBuffer *b,
 
     charset_decode_close(&probe_data.charset_state);
 
-    p = memchr(probe_data.buf, '\n', probe_data.buf_size);
-    probe_data.line_len = p ? p - probe_data.buf : probe_data.buf_size;
+    p0 = probe_data.buf;
+    p = memchr(p0, '\n', probe_data.buf_size);
+    probe_data.line_len = p ? p - p0 : probe_data.buf_size;
+    probe_data.max_line_len = line_len = probe_data.line_len;
+    while (p) {
+        p0 = p + 1;
+        p = memchr(p0, '\n', probe_data.buf + probe_data.buf_size - p0);
+        line_len = (p ? p : probe_data.buf + probe_data.buf_size) - p0;
+        if (probe_data.max_line_len < line_len)
+            probe_data.max_line_len = line_len;
+    }
+    /* The last line of a partial sample continues past its end: if it
+     * fills most of the sample, it may run to the end of the file.
+     * This way a short header line does not hide an overlong line.
+     */
+    if (len < total_size && line_len >= probe_data.buf_size / 2) {
+        QEOffset rest = total_size - (p0 - probe_data.buf);
+        if (probe_data.max_line_len < rest)
+            probe_data.max_line_len = min_offset(rest, INT_MAX);
+    }
 
     for (m = qs->first_mode; m != NULL; m = m->next) {
         if (m->mode_probe) {
@@ -7275,39 +8369,6 @@ void qe_save_open_files(EditState *s, EditBuffer *b)
     eb_putc(b, '\n');
 }
 
-#if 0
-static void load_progress_cb(void *opaque, int size)
-{
-    EditState *s = opaque;
-    EditBuffer *b = s->b;
-
-    if (size >= 1024 && !b->probed) {
-        qe_set_next_mode(s, 0, 0);
-    }
-}
-
-static void load_completion_cb(void *opaque, int err)
-{
-    EditState *s = opaque;
-
-    /* CG: potential problem: EXXX may be negative, as in Haiku */
-    if (err == -ENOENT || err == -ENOTDIR) {
-        put_status(s, "(New file)");
-    } else
-    if (err == -EISDIR) {
-        s->b->st_mode = S_IFDIR;
-    } else
-    if (err < 0) {
-        put_status(s, "Could not read file");
-    }
-    if (!s->b->probed) {
-        qe_set_next_mode(s, 0, 0);
-    }
-    edit_display(s->qe_state);
-    dpy_flush(&global_screen);
-}
-#endif
-
 void do_find_file(EditState *s, const char *filename, int bflags)
 {
     qe_load_file(s, filename, 0, bflags);
@@ -7336,7 +8397,7 @@ void do_load_file_from_path(EditState *s, const char *filename, int bflags)
 void do_insert_file(EditState *s, const char *filename)
 {
     FILE *f;
-    int size, lastsize = s->b->total_size;
+    QEOffset size, lastsize = s->b->total_size;
 
     f = fopen(filename, "r");
     if (!f) {
@@ -7373,10 +8434,10 @@ void do_set_visited_file_name(EditState *s, const char *filename,
     eb_set_filename(s->b, path);
 }
 
-static void put_save_message(EditState *s, const char *filename, int nb)
+static void put_save_message(EditState *s, const char *filename, QEOffset nb)
 {
     if (nb >= 0) {
-        put_status(s, "Wrote %d bytes to %s", nb, filename);
+        put_status(s, "Wrote %lld bytes to %s", (long long)nb, filename);
     } else {
         put_status(s, "Could not write %s", filename);
     }
@@ -7961,9 +9022,9 @@ void do_create_window(EditState *s, const char *filename, const char *layout)
     if (m)
         edit_set_mode(s, m);
     s->wrap = wrap;
-    s->offset = clamp(eb_goto_pos(b1, args[6], args[7]), 0, b1->total_size);
-    s->b->mark = clamp(eb_goto_pos(b1, args[8], args[9]), 0, b1->total_size);
-    s->offset_top = clamp(eb_goto_pos(b1, args[10], args[11]), 0, b1->total_size);
+    s->offset = clamp_offset(eb_goto_pos(b1, args[6], args[7]), 0, b1->total_size);
+    s->b->mark = clamp_offset(eb_goto_pos(b1, args[8], args[9]), 0, b1->total_size);
+    s->offset_top = clamp_offset(eb_goto_pos(b1, args[10], args[11]), 0, b1->total_size);
     if (args[12])
         qs->active_window = s;
 
@@ -8419,27 +9480,21 @@ void qe_handle_event(QEEvent *ev)
 
 /* text mode */
 
-#if 0
 int detect_binary(const u8 *buf, int size)
 {
+    const uint32_t magic = (1U << '\b') | (1U << '\t') | (1U << '\f') |
+                           (1U << '\n') | (1U << '\r') | (1U << '\033') |
+                           (1U << 0x0e) | (1U << 0x0f) | (1U << 0x1a) |
+                           (1U << 0x1f);
     int i, c;
 
     for (i = 0; i < size; i++) {
         c = buf[i];
-        if (c < 32 && (c != '\r' && c != '\n' && c != '\t' && c != '\e'))
+        if (c < 32 && !(magic & (1U << c)))
             return 1;
     }
-    /* Treat very long sequences of identical characters as binary */
-    for (i = 0; i < size; i++) {
-        if (buf[i] != buf[0])
-            break;
-    }
-    if (i == size && size >= 2048 && buf[0] != '\n')
-        return 1;
-
     return 0;
 }
-#endif
 
 static int text_mode_probe(qe__unused__ ModeDef *mode,
                            qe__unused__ ModeProbeData *p)
@@ -8461,10 +9516,12 @@ static int text_mode_probe(qe__unused__ ModeDef *mode,
 
 static int generic_mode_init(EditState *s)
 {
-    s->offset = min(s->offset, s->b->total_size);
-    s->offset_top = min(s->offset_top, s->b->total_size);
+    s->offset = min_offset(s->offset, s->b->total_size);
+    s->offset_top = min_offset(s->offset_top, s->b->total_size);
     eb_add_callback(s->b, eb_offset_callback, &s->offset, 0);
     eb_add_callback(s->b, eb_offset_callback, &s->offset_top, 0);
+    eb_add_callback(s->b, line_memo_callback, s, 0);
+    eb_add_callback(s->b, display_lines_callback, s, 0);
     set_colorize_func(s, NULL);
     return 0;
 }
@@ -8495,10 +9552,14 @@ static void generic_mode_close(EditState *s)
     set_colorize_func(s, NULL);
     eb_free_callback(s->b, eb_offset_callback, &s->offset);
     eb_free_callback(s->b, eb_offset_callback, &s->offset_top);
+    eb_free_callback(s->b, line_memo_callback, s);
+    eb_free_callback(s->b, display_lines_callback, s);
 
-    /* Free crcs should when switching display modes */
+    /* Free hashes should when switching display modes */
     qe_free(&s->line_shadow);
     s->shadow_nb_lines = 0;
+    line_memo_free(s);
+    display_lines_free(s);
 }
 
 ModeDef text_mode = {
@@ -8521,6 +9582,39 @@ ModeDef text_mode = {
     .write_char = text_write_char,
 };
 
+/* so-long mode: files with overlong lines, such as minified sources
+   or single line JSON data, are displayed without colorizing, bidir
+   analysis nor wrapping, so redisplay only lays out the visible part
+   of the lines. */
+
+static int so_long_mode_probe(ModeDef *mode, ModeProbeData *p)
+{
+    QEmacsState *qs = &qe_state;
+
+    if (qs->so_long_threshold > 0
+    &&  p->max_line_len >= qs->so_long_threshold
+    &&  !detect_binary(p->buf, p->buf_size)) {
+        /* override extension based modes */
+        return 88;
+    }
+    return 0;
+}
+
+static int so_long_mode_init(EditState *s, EditBuffer *b, int flags)
+{
+    if (s) {
+        s->bidir = 0;
+    }
+    return 0;
+}
+
+static ModeDef so_long_mode = {
+    .name = "so-long",
+    .mode_probe = so_long_mode_probe,
+    .mode_init = so_long_mode_init,
+    .default_wrap = WRAP_TRUNCATE,
+};
+
 /* find a resource file */
 int find_resource_file(char *path, int path_size, const char *pattern)
 {
@@ -8982,6 +10076,10 @@ static void qe_init(void *opaque)
     qs->default_fill_column = 70;
     qs->mmap_threshold = MIN_MMAP_SIZE;
     qs->max_load_size = MAX_LOAD_SIZE;
+    qs->async_load_threshold = MIN_ASYNC_LOAD_SIZE;
+    qs->so_long_threshold = SO_LONG_THRESHOLD;
+    qs->atomic_save = 1;
+    qs->undo_outer_limit = UNDO_OUTER_LIMIT;
 
     /* setup resource path */
     set_user_option(NULL);
@@ -8998,6 +10096,7 @@ static void qe_init(void *opaque)
 
     /* init basic modules */
     qe_register_mode(&text_mode, MODEF_VIEW);
+    qe_register_mode(&so_long_mode, MODEF_SYNTAX);
     qe_register_cmd_table(basic_commands, NULL);
     qe_register_cmd_line_options(cmd_options);
 
@@ -116,6 +116,18 @@ void *qe_realloc(void *pp, size_t size);
 /************************/
 
 typedef unsigned char u8;
+
+/* buffer offsets and sizes: 64-bit on 64-bit systems to allow editing
+ * files larger than 2GB.
+ */
+#if !defined(CONFIG_TINY) && SIZE_MAX > 0xffffffffU
+typedef int64_t QEOffset;
+#define QE_OFFSET_MAX  INT64_MAX
+#else
+typedef int QEOffset;
+#define QE_OFFSET_MAX  INT_MAX
+#endif
+
 typedef struct EditState EditState;
 typedef struct EditBuffer EditBuffer;
 typedef struct QEmacsState QEmacsState;
@@ -129,6 +141,8 @@ typedef struct KeyDef KeyDef;
 typedef struct InputMethod InputMethod;
 typedef struct ISearchState ISearchState;
 typedef struct QEProperty QEProperty;
+typedef struct EditBufferStyles EditBufferStyles;
+typedef struct QEColorizeCache QEColorizeCache;
 
 static inline char *s8(u8 *p) { return (char*)p; }
 static inline const char *cs8(const u8 *p) { return (const char*)p; }
@@ -328,7 +342,7 @@ int is_directory(const char *path);
 int is_filepattern(const char *filespec);
 void canonicalize_path(char *buf, int buf_size, const char *path);
 void canonicalize_absolute_path(EditState *s, char *buf, int buf_size, const char *path1);
-void canonicalize_absolute_buffer_path(EditBuffer *b, int offset, 
+void canonicalize_absolute_buffer_path(EditBuffer *b, QEOffset offset,
                                        char *buf, int buf_size, 
                                        const char *path1);
 char *make_user_path(char *buf, int buf_size, const char *path);
@@ -611,6 +625,12 @@ static inline int bstr_equal(bstr_t s1, bstr_t s2) {
 void qe_qsort_r(void *base, size_t nmemb, size_t size, void *thunk,
                 int (*compar)(void *, const void *, const void *));
 
+/* simple LZ77 block compression, blocks are limited to 64KB */
+#define LZ_BLOCK_MAX  65536
+#define LZ_BOUND(n)   ((n) + (n) / 255 + 16)
+int lz_compress(u8 *dst, int dst_size, const u8 *src, int len);
+int lz_decompress(u8 *dst, int dst_size, const u8 *src, int len);
+
 /* Command line options */
 enum CmdLineOptionType {
     CMD_LINE_TYPE_NONE   = 0,  /* nothing */
@@ -707,7 +727,31 @@ static inline int clampp(int *pa, int b, int c) {
         return a;
 }
 
-static inline int compute_percent(int a, int b) {
+static inline QEOffset min_offset(QEOffset a, QEOffset b) {
+    if (a < b)
+        return a;
+    else
+        return b;
+}
+
+static inline QEOffset max_offset(QEOffset a, QEOffset b) {
+    if (a > b)
+        return a;
+    else
+        return b;
+}
+
+static inline QEOffset clamp_offset(QEOffset a, QEOffset b, QEOffset c) {
+    if (a < b)
+        return b;
+    else
+    if (a > c)
+        return c;
+    else
+        return a;
+}
+
+static inline int compute_percent(QEOffset a, QEOffset b) {
     return b <= 0 ? 0 : (int)((long long)a * 100 / b);
 }
 
@@ -970,12 +1014,13 @@ KeyDef *qe_find_current_binding(unsigned int *keys, int nb_keys, ModeDef *m);
 typedef int (*GetColorizedLineFunc)(EditState *s,
                                     unsigned int *buf, int buf_size,
                                     QETermStyle *sbuf,
-                                    int offset, int *offsetp, int line_num);
+                                    QEOffset offset, QEOffset *offsetp,
+                                    int line_num);
 
 struct QEColorizeContext {
     EditState *s;
     EditBuffer *b;
-    int offset;
+    QEOffset offset;
     int colorize_state;
     int state_only;
     int combine_start, combine_stop; /* region for combine_static_colorized_line() */
@@ -987,16 +1032,43 @@ struct QEColorizeContext {
 typedef void (*ColorizeFunc)(QEColorizeContext *cp,
                              unsigned int *buf, int n, ModeDef *syn);
 
+/* colorizer states of a buffer, shared by the windows displaying it
+ * with the same mode.
+ */
+struct QEColorizeCache {
+    QEColorizeCache *next;  /* next cache for the same buffer */
+    EditBuffer *b;
+    ModeDef *mode;
+    ColorizeFunc colorize_func;
+    int ref_count;          /* number of windows using the cache */
+    /* state before line n, one short per line */
+    unsigned short *states;
+    int nb_lines;
+    int nb_valid_lines;
+    /* maximum valid offset, QE_OFFSET_MAX if not modified. Needed to
+     * invalidate 'states' */
+    QEOffset max_valid_offset;
+    QEOffset edit_end;      /* end of the text modified since */
+    int nb_buffer_lines;    /* buffer line count for the states */
+    /* states after modified lines, valid again once one of them is
+     * recomputed unchanged */
+    int resync_line, nb_cached_lines;
+};
+
 /* buffer.c */
 
 /* begin to mmap files from this size */
 #define MIN_MMAP_SIZE  (2*1024*1024)
 #define MAX_LOAD_SIZE  (512*1024*1024)
+/* load files asynchronously from this size */
+#define MIN_ASYNC_LOAD_SIZE  (1024*1024)
+#define SO_LONG_THRESHOLD    4000
 
 #define MAX_PAGE_SIZE  4096
 //#define MAX_PAGE_SIZE 16
 
-#define NB_LOGS_MAX     100000  /* need better way to limit undo information */
+#define NB_LOGS_MAX     100000  /* maximum number of undo records */
+#define UNDO_OUTER_LIMIT  (32*1024*1024)  /* default undo log byte budget */
 
 #define PG_READ_ONLY    0x0001 /* the page is read only */
 #define PG_VALID_POS    0x0002 /* set if the nb_lines / col fields are up to date */
@@ -1006,7 +1078,10 @@ typedef void (*ColorizeFunc)(QEColorizeContext *cp,
 typedef struct Page {   /* should pack this */
     int size;     /* data size */
     int flags;
-    u8 *data;
+    u8 *data;     /* size + gap_size bytes, gap_size bytes unused at gap */
+    int gap;      /* offset of the gap in the page data */
+    int gap_size; /* free space at gap, always 0 for read only pages */
+    struct PageShared *shared; /* owner of the data of read only pages */
     /* the following are needed to handle line / column computation */
     int nb_lines; /* Number of EOL characters in data */
     int col;      /* Number of chars since the last EOL */
@@ -1014,6 +1089,65 @@ typedef struct Page {   /* should pack this */
     int nb_chars;
 } Page;
 
+#define PAGE_INDEX_DIRTY  16
+#define PAGE_INDEX_CHECKPOINTS  16
+
+/* Position of an offset relative to the start of its page, recorded
+ * by eb_get_pos() so that queries further in the same page, such as
+ * line numbers for consecutive display rows, only scan from there.
+ * A zeroed entry is the start of the page, always valid.
+ */
+typedef struct PageCheckpoint {
+    int page_index;
+    int offset;         /* offset in the page */
+    int line, col;      /* counted from the start of the page */
+} PageCheckpoint;
+
+/* Cumulative index over the page table: Fenwick trees of page sizes,
+ * line counts, column counts and char counts for logarithmic offset,
+ * line and char lookups.  Only the first nb_xxx tree nodes are valid,
+ * the others are recomputed lazily after page table changes.
+ */
+typedef struct PageIndex {
+    int alloc_size;     /* number of allocated tree nodes */
+    int nb_size;        /* number of valid nodes in size_tree */
+    int nb_pos;         /* number of valid nodes in lines_tree and col_tree */
+    int nb_char;        /* number of valid nodes in chars_tree */
+    OWNED QEOffset *size_tree;
+    OWNED QEOffset *lines_tree;
+    OWNED QEOffset *col_tree;
+    OWNED QEOffset *chars_tree;
+    /* indexed pages whose line and char counts are stale */
+    int nb_dirty;
+    int dirty[PAGE_INDEX_DIRTY];
+    /* recent positions, indexed by page_index % PAGE_INDEX_CHECKPOINTS */
+    PageCheckpoint checkpoints[PAGE_INDEX_CHECKPOINTS];
+} PageIndex;
+
+#define PAGE_SLAB_MIN        64   /* smallest page data block size */
+#define NB_PAGE_SLABS        7    /* block sizes up to MAX_PAGE_SIZE */
+#define PAGE_SLAB_CHUNK_MIN  1024
+#define PAGE_SLAB_CHUNK_MAX  (64*1024)
+
+/* Page data allocator: blocks of size PAGE_SLAB_MIN << i are carved
+ * from larger chunks and recycled through per size free lists.  The
+ * chunks are owned by the buffer and released together when it is
+ * cleared, except those holding blocks of shared pages: these are
+ * freed with their last shared block.
+ */
+typedef struct PageSlab {
+    OWNED struct PageSlabChunk **chunks;  /* sorted by address */
+    int nb_chunks;
+    int chunks_size;                /* allocated size of chunks */
+    u8 *free_list[NB_PAGE_SLABS];   /* linked through the first word */
+    int chunk_size[NB_PAGE_SLABS];  /* size of the next chunk to allocate */
+    /* statistics */
+    QEOffset chunk_bytes;           /* total size of the chunks */
+    int nb_used[NB_PAGE_SLABS];     /* number of blocks in use */
+    int nb_shared[NB_PAGE_SLABS];   /* number of blocks of shared pages */
+    int nb_free[NB_PAGE_SLABS];     /* number of blocks in the free list */
+} PageSlab;
+
 #define DIR_LTR 0
 #define DIR_RTL 1
 
@@ -1024,11 +1158,13 @@ enum LogOperation {
     LOGOP_WRITE,
     LOGOP_INSERT,
     LOGOP_DELETE,
+    LOGOP_REPLACE,  /* undo log only: grouped edits of a transaction */
 };
 
 /* Each buffer modification can be caught with this callback */
 typedef void (*EditBufferCallback)(EditBuffer *b, void *opaque, int arg,
-                                   enum LogOperation op, int offset, int size);
+                                   enum LogOperation op,
+                                   QEOffset offset, QEOffset size);
 
 typedef struct EditBufferCallbackList {
     void *opaque;
@@ -1037,11 +1173,22 @@ typedef struct EditBufferCallbackList {
     struct EditBufferCallbackList *next;
 } EditBufferCallbackList;
 
+/* offsets registered with eb_offset_callback are kept in an array and
+ * updated in place instead of going through the callback list.  Each
+ * edit walks the whole array: the offsets are fields assigned directly
+ * by their owners, so the array cannot be kept sorted by value and
+ * they cannot be shifted lazily. */
+typedef struct EditBufferOffsetRef {
+    QEOffset *offset_ptr;
+    int edge;
+} EditBufferOffsetRef;
+
 /* high level buffer type handling */
 typedef struct EditBufferDataType {
     const char *name; /* name of buffer data type (text, image, ...) */
     int (*buffer_load)(EditBuffer *b, FILE *f);
-    int (*buffer_save)(EditBuffer *b, int start, int end, const char *filename);
+    QEOffset (*buffer_save)(EditBuffer *b, QEOffset start, QEOffset end,
+                            const char *filename);
     void (*buffer_close)(EditBuffer *b);
     struct EditBufferDataType *next;
 } EditBufferDataType;
@@ -1068,18 +1215,21 @@ typedef struct EditBufferDataType {
 struct EditBuffer {
     OWNED Page *page_table;
     int nb_pages;
-    int mark;       /* current mark (moved with text) */
-    int total_size; /* total size of the buffer */
+    int page_table_size; /* number of allocated page table entries */
+    QEOffset mark;       /* current mark (moved with text) */
+    QEOffset total_size; /* total size of the buffer */
     int modified;
 
     /* page cache */
     Page *cur_page;
-    int cur_offset;
+    QEOffset cur_offset;
     int flags;
+    PageIndex page_index;   /* cumulative page sizes and counts */
+    PageSlab page_slab;     /* page data allocator */
 
     /* mmap data, including file handle if kept open */
     void *map_address;
-    int map_length;
+    QEOffset map_length;
     int map_handle;
 
     /* buffer data type (default is raw) */
@@ -1091,12 +1241,7 @@ struct EditBuffer {
     /* buffer syntax or major mode */
     ModeDef *syntax_mode;
     ColorizeFunc colorize_func; /* line colorization function */
-    unsigned short *colorize_states; /* state before line n, one per line */
-    int colorize_nb_lines;
-    int colorize_nb_valid_lines;
-    /* maximum valid offset, INT_MAX if not modified. Needed to
-     * invalidate 'colorize_states' */
-    int colorize_max_valid_offset;
+    QEColorizeCache *colorize_caches; /* states shared by the windows */
 
     /* charset handling */
     CharsetDecodeState charset_state;
@@ -1105,28 +1250,35 @@ struct EditBuffer {
 
     /* undo system */
     int save_log;    /* if true, each buffer operation is logged */
-    int log_new_index, log_current;
+    QEOffset log_start;  /* offset of the oldest record in log_buffer */
+    QEOffset log_new_index, log_current;
+    QEOffset log_packed_index;  /* records before are not packed again */
+    QEOffset log_packed_size, log_unpacked_size;  /* compressed records */
     enum LogOperation last_log;
     int last_log_char;
     int nb_logs;
     EditBuffer *log_buffer;
+    int log_transaction;  /* nesting level of eb_begin_transaction() */
+    int log_trans_modified;
+    QEOffset log_trans_start, log_trans_end;  /* span of the transaction */
+    OWNED EditBuffer *log_trans_buffer;  /* original contents of the span */
 
     /* style system */
-    EditBuffer *b_styles;
+    OWNED EditBufferStyles *b_styles;  /* run length encoded styles */
     QETermStyle cur_style;  /* current style for buffer writing APIs */
     int style_bytes;  /* 0, 1, 2, 4 or 8 bytes per char */
     int style_shift;  /* 0, 0, 1, 2 or 3 */
 
     /* modification callbacks */
     OWNED EditBufferCallbackList *first_callback;
-    OWNED QEProperty *property_list;
+    OWNED EditBufferOffsetRef *offset_refs;
+    int nb_offset_refs, offset_refs_size;
+    OWNED QEProperty *property_tree;
+    QEProperty *property_list;  /* same properties in offset order */
+    int property_shifted;  /* some offset updates are pending */
 
-#if 0
-    /* asynchronous loading/saving support */
-    struct BufferIOState *io_state;
-    /* used during loading */
-    int probed;
-#endif
+    /* asynchronous loading support */
+    OWNED struct BufferIOState *io_state;
 
     ModeDef *default_mode;
 
@@ -1141,7 +1293,7 @@ struct EditBuffer {
     OWNED QEModeData *mode_data_list;
 
     /* default mode stuff when buffer is detached from window */
-    int offset;
+    QEOffset offset;
 
     int tab_width;
     int fill_column;
@@ -1158,30 +1310,50 @@ struct EditBuffer {
      */
 };
 
+/* Buffer styles are stored as runs of chars with the same style:
+ * runs[i] covers the chars from runs[i].start to runs[i + 1].start,
+ * the last run extends to the end of the buffer.
+ */
+typedef struct QEStyleRun {
+    QEOffset start;     /* char index of the first char of the run */
+    QETermStyle style;
+} QEStyleRun;
+
+struct EditBufferStyles {
+    QEStyleRun *runs;   /* adjacent runs have different styles */
+    int nb_runs, runs_size;
+    int last_run;       /* run found by the last lookup */
+    QEOffset total;     /* number of chars */
+};
+
 /* the log buffer is used for the undo operation */
 /* header of log operation */
 typedef struct LogBuffer {
     u8 pad1, pad2;    /* for Log buffer readability */
     u8 op;
     u8 was_modified;
-    int offset;
-    int size;
+    int packed_size;  /* size of the compressed payload or 0 */
+    QEOffset offset;
+    QEOffset size;
+    QEOffset new_size;  /* LOGOP_REPLACE: size of the replacement text */
 } LogBuffer;
 
 void eb_trace_bytes(const void *buf, int size, int state);
 
 void eb_init(void);
-int eb_read_one_byte(EditBuffer *b, int offset);
-int eb_read(EditBuffer *b, int offset, void *buf, int size);
-int eb_write(EditBuffer *b, int offset, const void *buf, int size);
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size);
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size);
-int eb_delete(EditBuffer *b, int offset, int size);
-void eb_replace(EditBuffer *b, int offset, int size,
+int eb_read_one_byte(EditBuffer *b, QEOffset offset);
+int eb_read(EditBuffer *b, QEOffset offset, void *buf, int size);
+int eb_write(EditBuffer *b, QEOffset offset, const void *buf, int size);
+QEOffset eb_insert_buffer(EditBuffer *dest, QEOffset dest_offset,
+                          EditBuffer *src, QEOffset src_offset,
+                          QEOffset size);
+int eb_insert(EditBuffer *b, QEOffset offset, const void *buf, int size);
+QEOffset eb_delete(EditBuffer *b, QEOffset offset, QEOffset size);
+void eb_replace(EditBuffer *b, QEOffset offset, QEOffset size,
                 const void *buf, int size1);
 void eb_free_log_buffer(EditBuffer *b);
+void eb_begin_transaction(EditBuffer *b);
+void eb_end_transaction(EditBuffer *b);
 EditBuffer *eb_new(const char *name, int flags);
 EditBuffer *eb_scratch(const char *name, int flags);
 void eb_clear(EditBuffer *b);
@@ -1193,37 +1365,71 @@ EditState *eb_find_window(EditBuffer *b, EditState *e);
 
 void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type);
 qe__attr_nonnull((3))
-int eb_nextc(EditBuffer *b, int offset, int *next_ptr);
+int eb_nextc(EditBuffer *b, QEOffset offset, QEOffset *next_ptr);
 qe__attr_nonnull((3))
-int eb_prevc(EditBuffer *b, int offset, int *prev_ptr);
-int eb_skip_chars(EditBuffer *b, int offset, int n);
-int eb_delete_chars(EditBuffer *b, int offset, int n);
-int eb_goto_pos(EditBuffer *b, int line1, int col1);
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset);
-int eb_goto_char(EditBuffer *b, int pos);
-int eb_get_char_offset(EditBuffer *b, int offset);
-int eb_delete_range(EditBuffer *b, int p1, int p2);
-static inline int eb_at_bol(EditBuffer *b, int offset) {
+int eb_prevc(EditBuffer *b, QEOffset offset, QEOffset *prev_ptr);
+QEOffset eb_skip_chars(EditBuffer *b, QEOffset offset, QEOffset n);
+QEOffset eb_delete_chars(EditBuffer *b, QEOffset offset, QEOffset n);
+QEOffset eb_goto_pos(EditBuffer *b, int line1, int col1);
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, QEOffset offset);
+QEOffset eb_goto_char(EditBuffer *b, QEOffset pos);
+QEOffset eb_get_char_offset(EditBuffer *b, QEOffset offset);
+QEOffset eb_delete_range(EditBuffer *b, QEOffset p1, QEOffset p2);
+static inline int eb_at_bol(EditBuffer *b, QEOffset offset) {
     return eb_prevc(b, offset, &offset) == '\n';
 }
-static inline int eb_next(EditBuffer *b, int offset) {
+static inline QEOffset eb_next(EditBuffer *b, QEOffset offset) {
     eb_nextc(b, offset, &offset);
     return offset;
 }
-static inline int eb_prev(EditBuffer *b, int offset) {
+static inline QEOffset eb_prev(EditBuffer *b, QEOffset offset) {
     eb_prevc(b, offset, &offset);
     return offset;
 }
 
-//int eb_clip_offset(EditBuffer *b, int offset);
+/* Sequential character reader: decodes characters forward without a
+ * page lookup per character.  It must be reinitialized after any
+ * modification of the buffer.
+ */
+typedef struct EditBufferCursor {
+    EditBuffer *b;
+    QEOffset offset;            /* offset of the next character */
+    const u8 *ptr, *end;        /* contiguous page bytes at offset */
+    const unsigned short *table;
+} EditBufferCursor;
+
+void eb_cursor_init(EditBufferCursor *c, EditBuffer *b, QEOffset offset);
+int eb_cursor_nextc_slow(EditBufferCursor *c);
+
+/* same as eb_nextc(c->b, c->offset, &c->offset) */
+static inline int eb_cursor_nextc(EditBufferCursor *c) {
+    int ch;
+
+    if (c->ptr < c->end) {
+        /* single byte characters are decoded inline */
+        ch = c->table[*c->ptr];
+        if (ch != ESCAPE_CHAR
+        &&  ((ch != '\r' && ch != '\n') || c->b->eol_type == EOL_UNIX)) {
+            c->ptr++;
+            c->offset++;
+            return ch;
+        }
+    }
+    return eb_cursor_nextc_slow(c);
+}
+
+//QEOffset eb_clip_offset(EditBuffer *b, QEOffset offset);
 void do_undo(EditState *s);
 void do_redo(EditState *s);
 
-int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset);
+QEOffset eb_raw_buffer_load1(EditBuffer *b, FILE *f, QEOffset offset);
 int eb_mmap_buffer(EditBuffer *b, const char *filename);
 void eb_munmap_buffer(EditBuffer *b);
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename);
-int eb_save_buffer(EditBuffer *b);
+int eb_load_progress(EditBuffer *b);
+void eb_load_cancel(EditBuffer *b);
+QEOffset eb_write_buffer(EditBuffer *b, QEOffset start, QEOffset end,
+                         const char *filename);
+QEOffset eb_save_buffer(EditBuffer *b);
 
 int eb_set_buffer_name(EditBuffer *b, const char *name1);
 void eb_set_filename(EditBuffer *b, const char *filename);
@@ -1231,59 +1437,64 @@ void eb_set_filename(EditBuffer *b, const char *filename);
 int eb_add_callback(EditBuffer *b, EditBufferCallback cb, void *opaque, int arg);
 void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque);
 void eb_offset_callback(EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size);
+                        enum LogOperation op, QEOffset offset, QEOffset size);
 int eb_create_style_buffer(EditBuffer *b, int flags);
 void eb_free_style_buffer(EditBuffer *b);
-QETermStyle eb_get_style(EditBuffer *b, int offset);
+QETermStyle eb_get_style(EditBuffer *b, QEOffset offset);
+QETermStyle eb_get_style_run(EditBuffer *b, QEOffset offset,
+                             QEOffset *end_ptr);
 void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
-                  int offset, int size);
+                  QEOffset offset, QEOffset size);
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size);
-int eb_delete_uchar(EditBuffer *b, int offset);
+                       enum LogOperation op, QEOffset offset, QEOffset size);
+int eb_delete_uchar(EditBuffer *b, QEOffset offset);
 int eb_encode_uchar(EditBuffer *b, char *buf, unsigned int c);
-int eb_insert_uchar(EditBuffer *b, int offset, int c);
-int eb_replace_uchar(EditBuffer *b, int offset, int c);
-int eb_insert_uchars(EditBuffer *b, int offset, int c, int n);
-static inline int eb_insert_spaces(EditBuffer *b, int offset, int n) {
+int eb_insert_uchar(EditBuffer *b, QEOffset offset, int c);
+int eb_replace_uchar(EditBuffer *b, QEOffset offset, int c);
+int eb_insert_uchars(EditBuffer *b, QEOffset offset, int c, int n);
+static inline int eb_insert_spaces(EditBuffer *b, QEOffset offset, int n) {
     return eb_insert_uchars(b, offset, ' ', n);
 }
 
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len);
-int eb_insert_u32_buf(EditBuffer *b, int offset, const unsigned int *buf, int len);
-int eb_insert_str(EditBuffer *b, int offset, const char *str);
-int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp);
-int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp);
-int eb_match_istr(EditBuffer *b, int offset, const char *str, int *offsetp);
+int eb_insert_utf8_buf(EditBuffer *b, QEOffset offset, const char *buf, int len);
+int eb_insert_u32_buf(EditBuffer *b, QEOffset offset, const unsigned int *buf, int len);
+int eb_insert_str(EditBuffer *b, QEOffset offset, const char *str);
+int eb_match_uchar(EditBuffer *b, QEOffset offset, int c, QEOffset *offsetp);
+int eb_match_str(EditBuffer *b, QEOffset offset, const char *str,
+                 QEOffset *offsetp);
+int eb_match_istr(EditBuffer *b, QEOffset offset, const char *str,
+                  QEOffset *offsetp);
 int eb_vprintf(EditBuffer *b, const char *fmt, va_list ap) qe__attr_printf(2,0);
 int eb_printf(EditBuffer *b, const char *fmt, ...) qe__attr_printf(2,3);
 int eb_puts(EditBuffer *b, const char *s);
 int eb_putc(EditBuffer *b, int c);
 void eb_line_pad(EditBuffer *b, int n);
-int eb_get_region_content_size(EditBuffer *b, int start, int stop);
-static inline int eb_get_content_size(EditBuffer *b) {
+QEOffset eb_get_region_content_size(EditBuffer *b, QEOffset start,
+                                     QEOffset stop);
+static inline QEOffset eb_get_content_size(EditBuffer *b) {
     return eb_get_region_content_size(b, 0, b->total_size);
 }
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, QEOffset start, QEOffset stop,
                            char *buf, int buf_size);
 static inline int eb_get_contents(EditBuffer *b, char *buf, int buf_size) {
     return eb_get_region_contents(b, 0, b->total_size, buf, buf_size);
 }
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size);
+QEOffset eb_insert_buffer_convert(EditBuffer *dest, QEOffset dest_offset,
+                                  EditBuffer *src, QEOffset src_offset,
+                                  QEOffset size);
 int eb_get_line(EditBuffer *b, unsigned int *buf, int buf_size,
-                int offset, int *offset_ptr);
+                QEOffset offset, QEOffset *offset_ptr);
 int eb_fgets(EditBuffer *b, char *buf, int buf_size, 
-             int offset, int *offset_ptr);
-int eb_prev_line(EditBuffer *b, int offset);
-int eb_goto_bol(EditBuffer *b, int offset);
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp);
-int eb_goto_indentation(EditBuffer *b, int offset);
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1);
-int eb_is_blank_line1(EditBuffer *b, int offset, int *offset1);
-int eb_is_in_indentation(EditBuffer *b, int offset);
-int eb_goto_eol(EditBuffer *b, int offset);
-int eb_next_line(EditBuffer *b, int offset);
+             QEOffset offset, QEOffset *offset_ptr);
+QEOffset eb_prev_line(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_bol(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_bol2(EditBuffer *b, QEOffset offset, int *countp);
+QEOffset eb_goto_indentation(EditBuffer *b, QEOffset offset);
+int eb_is_blank_line(EditBuffer *b, QEOffset offset, QEOffset *offset1);
+int eb_is_blank_line1(EditBuffer *b, QEOffset offset, QEOffset *offset1);
+int eb_is_in_indentation(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_eol(EditBuffer *b, QEOffset offset);
+QEOffset eb_next_line(EditBuffer *b, QEOffset offset);
 
 void eb_register_data_type(EditBufferDataType *bdt);
 EditBufferDataType *eb_probe_data_type(const char *filename, int st_mode,
@@ -1293,17 +1504,23 @@ void eb_invalidate_raw_data(EditBuffer *b);
 extern EditBufferDataType raw_data_type;
 
 struct QEProperty {
-    int offset;
+    QEOffset offset;
 #define QE_PROP_FREE  1
 #define QE_PROP_TAG   3
     int type;
     void *data;
-    QEProperty *next;
+    QEProperty *next;   /* in offset order, see eb_property_list() */
+    /* private: tree ordered by offset with lazy offset updates */
+    QEProperty *prev, *left, *right;
+    QEOffset shift;     /* pending offset change of the subtrees */
+    unsigned int priority;
 };
 
-void eb_add_property(EditBuffer *b, int offset, int type, void *data);
-QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type);
-void eb_delete_properties(EditBuffer *b, int offset, int offset2);
+void eb_add_property(EditBuffer *b, QEOffset offset, int type, void *data);
+QEProperty *eb_property_list(EditBuffer *b);
+QEProperty *eb_find_property(EditBuffer *b, QEOffset offset,
+                             QEOffset offset2, int type);
+void eb_delete_properties(EditBuffer *b, QEOffset offset, QEOffset offset2);
 
 /* qe module handling */
 
@@ -1359,12 +1576,54 @@ void eb_delete_properties(EditBuffer *b, int offset, int offset2);
 /* contains all the information necessary to uniquely identify a line,
    to avoid displaying it */
 typedef struct QELineShadow {
-    uint64_t crc;
+    uint64_t hash;
     int x;
     short y;
     short height;
 } QELineShadow;
 
+/* layout positions memorized along a long line, so the display of
+   the line can start close to the visible part or the cursor: in
+   truncate mode, the marks are text fragments at increasing columns,
+   in wrap modes, they are the starts of the rows */
+typedef struct QELineMark {
+    QEOffset offset;    /* first character of the fragment or row */
+    int char_index;     /* index of the character in the line */
+    int x;              /* position relative to the start of line */
+    int y;              /* position of the row relative to the start of line */
+    int row;            /* row number in the line */
+    int word_space;     /* true if the row starts with a space */
+} QELineMark;
+
+#define LINE_MEMO_LINES   64
+#define LINE_MEMO_MARKS   1024
+
+typedef struct QELineMemo {
+    QEOffset offset;    /* start of line, -1 if unused */
+    int wrap, width, tab_width, line_numbers;  /* layout parameters */
+    int step;           /* minimum distance between marks: in pixels in
+                           truncate mode, in rows in wrap modes */
+    int height;         /* height of the wrapped line, -1 if unknown */
+    int nb_rows;        /* number of rows of the wrapped line */
+    QEOffset next_offset;  /* start of the next line, -1 at end of buffer */
+    int nb_marks;
+    OWNED QELineMark *marks;
+} QELineMemo;
+
+/* a line laid out by the last redisplay of a window.  The buffer
+   modifications, cursor moves and style changes mark the lines they
+   affect as dirty: the other lines are not laid out again as long as
+   they are displayed at the same position. */
+typedef struct QEDisplayLine {
+    QEOffset offset;       /* start of line */
+    QEOffset next_offset;  /* start of the next line, -1 at end of buffer */
+    int y, height;         /* position and height of the wrapped line */
+    int line_num, nb_rows; /* first row and number of rows */
+    int buf_line;          /* line number in the buffer, -1 if not used */
+    int colorize_state;    /* colorizer state at start of line or -1 */
+    int dirty;             /* the display of the line may have changed */
+} QEDisplayLine;
+
 enum WrapType {
     WRAP_AUTO = 0,
     WRAP_TRUNCATE,
@@ -1377,10 +1636,10 @@ enum WrapType {
 #define DIR_RTL 1
 
 struct EditState {
-    int offset;     /* offset of the cursor */
+    QEOffset offset;     /* offset of the cursor */
     /* text display state */
-    int offset_top; /* offset of first character displayed in window */
-    int offset_bottom; /* offset of first character beyond window or -1
+    QEOffset offset_top; /* offset of first character displayed in window */
+    QEOffset offset_bottom; /* offset of first character beyond window or -1
                         * if end of file displayed */
     int y_disp;    /* virtual position of the displayed text */
     int x_disp[2]; /* position for LTR and RTL text resp. */
@@ -1424,14 +1683,9 @@ struct EditState {
     ModeDef *mode;
     OWNED QEModeData *mode_data; /* mode private window based data */
 
-    /* state before line n, one short per line */
-    /* XXX: move this to buffer based mode_data */
-    unsigned short *colorize_states;
-    int colorize_nb_lines;
-    int colorize_nb_valid_lines;
-    /* maximum valid offset, INT_MAX if not modified. Needed to invalide
-       'colorize_states' */
-    int colorize_max_valid_offset;
+    /* colorizer states, shared with the other windows on the buffer */
+    QEColorizeCache *colorize_cache;
+    QETimer *colorize_timer;  /* idle time colorization */
 
     int busy; /* true if editing cannot be done if the window
                  (e.g. the parser HTML is parsing the buffer to
@@ -1470,13 +1724,21 @@ struct EditState {
     struct QEditScreen *screen; /* copy of qe_state->screen */
     /* display shadow to optimize redraw */
     char modeline_shadow[MAX_SCREEN_WIDTH];
-    OWNED QELineShadow *line_shadow; /* per window shadow CRC data */
+    OWNED QELineShadow *line_shadow; /* per window shadow hash data */
     int shadow_nb_lines;
+    OWNED unsigned int *line_buf; /* growable buffer for colorized lines */
+    int line_buf_size;
+    OWNED QELineMemo *line_memos; /* layout marks of long lines */
+    int nb_line_memos, line_memo_next;
+    OWNED QEDisplayLine *display_lines; /* lines of the last redisplay */
+    int nb_display_lines;
+    uint64_t display_key;  /* layout parameters of display_lines */
+    QEOffset display_offset, display_mark; /* cursor and mark positions */
     /* compose state for input method */
     InputMethod *input_method; /* current input method */
     InputMethod *selected_input_method; /* selected input method (used to switch) */
     int compose_len;
-    int compose_start_offset;
+    QEOffset compose_start_offset;
     unsigned int compose_buf[20];
     OWNED EditState *next_window;
 };
@@ -1490,9 +1752,11 @@ struct ModeProbeData {
     const u8 *buf;
     int buf_size;
     int line_len;
+    int max_line_len;  /* length of the longest line, estimated for a
+                          line running past the end of buf */
     int st_errno;    /* errno from the stat system call */
     int st_mode;     /* unix file mode */
-    long total_size;
+    QEOffset total_size;
     EOLType eol_type;
     CharsetDecodeState charset_state;
     QECharset *charset;
@@ -1538,8 +1802,8 @@ struct ModeDef {
     void (*display)(EditState *);
 
     /* text related functions */
-    int (*display_line)(EditState *, DisplayState *, int);
-    int (*backward_offset)(EditState *, int);
+    QEOffset (*display_line)(EditState *, DisplayState *, QEOffset);
+    QEOffset (*backward_offset)(EditState *, QEOffset);
 
     ColorizeFunc colorize_func;
     int colorize_flags;
@@ -1562,13 +1826,13 @@ struct ModeDef {
 
     /* Functions to insert and delete contents: */
     void (*write_char)(EditState *s, int c);
-    void (*delete_bytes)(EditState *s, int offset, int size);
+    void (*delete_bytes)(EditState *s, QEOffset offset, QEOffset size);
 
     EditBufferDataType *data_type; /* native buffer data type (NULL = raw) */
     void (*get_mode_line)(EditState *s, buf_t *out);
-    void (*indent_func)(EditState *s, int offset);
+    void (*indent_func)(EditState *s, QEOffset offset);
     /* Get the current directory for the window, return NULL if none */
-    char *(*get_default_path)(EditBuffer *s, int offset, 
+    char *(*get_default_path)(EditBuffer *s, QEOffset offset,
                               char *buf, int buf_size);
 
     /* mode specific key bindings */
@@ -1709,8 +1973,9 @@ struct QEmacsState {
     int ignore_spaces;  /* ignore spaces when comparing windows */
     int ignore_comments;  /* ignore comments when comparing windows */
     int hilite_region;  /* hilite the current region when selecting */
-    int mmap_threshold; /* minimum file size for mmap */
+    int mmap_threshold; /* minimum size for mapping files not loaded */
     int max_load_size;  /* maximum file size for loading in memory */
+    int async_load_threshold; /* minimum file size for background loading */
     int default_tab_width;      /* 8 */
     int default_fill_column;    /* 70 */
     EOLType default_eol_type;  /* EOL_UNIX */
@@ -1718,7 +1983,10 @@ struct QEmacsState {
     int emulation_flags;
     int backspace_is_control_h;
     int backup_inhibited;  /* prevent qemacs from backing up files */
+    int undo_outer_limit;  /* maximum size of undo log per buffer */
+    int atomic_save;    /* save files via a temporary file and rename */
     int fuzzy_search;    /* use fuzzy search for completion matcher */
+    int so_long_threshold;  /* minimum line length for so-long mode */
     const char *user_option;
 };
 
@@ -1865,9 +2133,14 @@ struct DisplayState {
     int line_numbers;   /* display line numbers if enough space */
     void *cursor_opaque;
     int (*cursor_func)(struct DisplayState *,
-                       int offset1, int offset2, int line_num,
+                       QEOffset offset1, QEOffset offset2, int line_num,
                        int x, int y, int w, int h, int hex_mode);
     int eod;            /* end of display requested */
+    int cursor_only;    /* only the cursor position is needed */
+    int visible_only;   /* only the visible rows and the cursor are needed */
+    int line_num_min;   /* rows before this one are not needed if >= 0 */
+    QEOffset row_offset;  /* start of the current row, -1 if unknown */
+    int row_word_space; /* true if the current row starts with a space */
     /* if base == RTL, then all x are equivalent to width - x */
     DirType base;
     int embedding_level_max;
@@ -1885,13 +2158,13 @@ struct DisplayState {
     /* line char (in fact glyph) buffer */
     unsigned int line_chars[MAX_SCREEN_WIDTH];
     short line_char_widths[MAX_SCREEN_WIDTH];
-    int line_offsets[MAX_SCREEN_WIDTH][2];
+    QEOffset line_offsets[MAX_SCREEN_WIDTH][2];
     unsigned char line_hex_mode[MAX_SCREEN_WIDTH];
     int line_index;
 
     /* fragment temporary buffer */
     unsigned int fragment_chars[MAX_WORD_SIZE];
-    int fragment_offsets[MAX_WORD_SIZE][2];
+    QEOffset fragment_offsets[MAX_WORD_SIZE][2];
     unsigned char fragment_hex_mode[MAX_WORD_SIZE];
     int fragment_index;
     int last_space;
@@ -1908,23 +2181,24 @@ enum DisplayType {
 
 void display_init(DisplayState *s, EditState *e, enum DisplayType do_disp,
                   int (*cursor_func)(DisplayState *,
-                                     int offset1, int offset2, int line_num,
+                                     QEOffset offset1, QEOffset offset2,
+                                     int line_num,
                                      int x, int y, int w, int h, int hex_mode),
                   void *cursor_opaque);
 void display_close(DisplayState *s);
 void display_bol(DisplayState *s);
 void display_setcursor(DisplayState *s, DirType dir);
-int display_char_bidir(DisplayState *s, int offset1, int offset2,
+int display_char_bidir(DisplayState *s, QEOffset offset1, QEOffset offset2,
                        int embedding_level, int ch);
-void display_eol(DisplayState *s, int offset1, int offset2);
+void display_eol(DisplayState *s, QEOffset offset1, QEOffset offset2);
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                     const char *fmt, ...) qe__attr_printf(4,5);
-void display_printhex(DisplayState *s, int offset1, int offset2,
+void display_printhex(DisplayState *s, QEOffset offset1, QEOffset offset2,
                       unsigned int h, int n);
 
-static inline int display_char(DisplayState *s, int offset1, int offset2,
-                               int ch)
+static inline int display_char(DisplayState *s, QEOffset offset1,
+                               QEOffset offset2, int ch)
 {
     return display_char_bidir(s, offset1, offset2, 0, ch);
 }
@@ -1975,7 +2249,7 @@ void unload_input_methods(void);
 /* the following will be suppressed */
 #define LINE_MAX_SIZE 256
 
-static inline int align(int a, int n) {
+static inline QEOffset align(QEOffset a, int n) {
     return (a / n) * n;
 }
 
@@ -2079,7 +2353,8 @@ void do_set_next_mode(EditState *s, int dir);
 
 /* loading files */
 void do_exit_qemacs(EditState *s, int argval);
-char *get_default_path(EditBuffer *b, int offset, char *buf, int buf_size);
+char *get_default_path(EditBuffer *b, QEOffset offset,
+                       char *buf, int buf_size);
 void do_find_file(EditState *s, const char *filename, int bflags);
 void do_load_from_path(EditState *s, const char *filename, int bflags);
 void do_find_file_other_window(EditState *s, const char *filename, int bflags);
@@ -2092,7 +2367,7 @@ void do_save_buffer(EditState *s);
 void do_write_file(EditState *s, const char *filename);
 void do_write_region(EditState *s, const char *filename);
 void isearch_colorize_matches(EditState *s, unsigned int *buf, int len,
-                              QETermStyle *sbuf, int offset);
+                              QETermStyle *sbuf, QEOffset offset);
 void do_isearch(EditState *s, int dir, int argval);
 void do_query_replace(EditState *s, const char *search_str,
                       const char *replace_str);
@@ -2108,13 +2383,15 @@ void qe_kill_buffer(EditBuffer *b);
 
 extern ModeDef text_mode;
 
-int text_backward_offset(EditState *s, int offset);
-int text_display_line(EditState *s, DisplayState *ds, int offset);
+int detect_binary(const u8 *buf, int size);
+QEOffset text_backward_offset(EditState *s, QEOffset offset);
+QEOffset text_display_line(EditState *s, DisplayState *ds, QEOffset offset);
 
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func);
 int generic_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
                                QETermStyle *sbuf,
-                               int offset, int *offsetp, int line_num);
+                               QEOffset offset, QEOffset *offsetp,
+                               int line_num);
 
 int do_delete_selection(EditState *s);
 void do_char(EditState *s, int key, int argval);
@@ -2131,7 +2408,7 @@ void do_delete_char(EditState *s, int argval);
 void do_tab(EditState *s, int argval);
 EditBuffer *new_yank_buffer(QEmacsState *qs, EditBuffer *base);
 void do_append_next_kill(EditState *s);
-void do_kill(EditState *s, int p1, int p2, int dir, int keep);
+void do_kill(EditState *s, QEOffset p1, QEOffset p2, int dir, int keep);
 void do_kill_region(EditState *s, int keep);
 void do_kill_line(EditState *s, int argval);
 void do_kill_beginning_of_line(EditState *s, int argval);
@@ -2144,7 +2421,7 @@ void text_move_eof(EditState *s);
 void word_right(EditState *s, int w);
 void word_left(EditState *s, int w);
 int qe_get_word(EditState *s, char *buf, int buf_size,
-                int offset, int *offset_ptr);
+                QEOffset offset, QEOffset *offset_ptr);
 void do_goto(EditState *s, const char *str, int unit);
 void do_goto_line(EditState *s, int line, int column);
 void do_up_down(EditState *s, int dir);
@@ -2170,9 +2447,9 @@ void do_eof(EditState *s);
 void do_bol(EditState *s);
 void do_eol(EditState *s);
 void do_word_right(EditState *s, int dir);
-void do_mark_region(EditState *s, int mark, int offset);
-int eb_next_paragraph(EditBuffer *b, int offset);
-int eb_start_paragraph(EditBuffer *b, int offset);
+void do_mark_region(EditState *s, QEOffset mark, QEOffset offset);
+QEOffset eb_next_paragraph(EditBuffer *b, QEOffset offset);
+QEOffset eb_start_paragraph(EditBuffer *b, QEOffset offset);
 void do_mark_paragraph(EditState *s);
 void do_backward_paragraph(EditState *s);
 void do_forward_paragraph(EditState *s);
@@ -2182,7 +2459,7 @@ void do_changecase_word(EditState *s, int up);
 void do_changecase_region(EditState *s, int up);
 void do_delete_word(EditState *s, int dir);
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                QEOffset offset1, QEOffset offset2, int line_num,
                 int x, int y, int w, int h, int hex_mode);
 // should take argval
 void do_scroll_left_right(EditState *s, int dir);
@@ -2321,7 +2598,7 @@ extern ModeDef list_mode;
 
 void list_toggle_selection(EditState *s, int dir);
 int list_get_pos(EditState *s);
-int list_get_offset(EditState *s);
+QEOffset list_get_offset(EditState *s);
 
 /* dired.c */
 
@@ -39,17 +39,18 @@
 
 struct ISearchState {
     EditState *s;
-    int saved_mark;
-    int start_offset;
+    QEOffset saved_mark;
+    QEOffset start_offset;
     int start_dir;
     int quoting;
     int dir;
     int pos;  /* position in search_u32_flags */
     int search_u32_len;
     int search_flags;
-    int found_offset, found_end;
+    QEOffset found_offset, found_end;
     unsigned int search_u32_flags[SEARCH_LENGTH];
     unsigned int search_u32[SEARCH_LENGTH];
+    QEOffset search_offsets[SEARCH_LENGTH];  /* match position for FOUND_TAG */
 };
 
 /* XXX: should store to screen */
@@ -62,13 +63,15 @@ static int last_search_u32_len = 0;
 static int last_search_u32_flags = 0;
 
 static int eb_search(EditBuffer *b, int dir, int flags,
-                     int start_offset, int end_offset,
+                     QEOffset start_offset, QEOffset end_offset,
                      const unsigned int *buf, int len,
                      CSSAbortFunc *abort_func, void *abort_opaque,
-                     int *found_offset, int *found_end)
+                     QEOffset *found_offset, QEOffset *found_end)
 {
-    int total_size = b->total_size;
-    int c, c2, offset = start_offset, offset1, offset2, offset3, pos;
+    QEOffset total_size = b->total_size;
+    QEOffset offset = start_offset, offset1, offset2, offset3;
+    EditBufferCursor cur, cur2;
+    int c, c2, pos;
 
     if (len == 0)
         return 0;
@@ -130,11 +133,13 @@ static int eb_search(EditBuffer *b, int dir, int flags,
         }
     }
 
+    eb_cursor_init(&cur, b, offset);
     for (offset1 = offset;;) {
         if (dir < 0) {
             if (offset == 0)
                 return 0;
             offset = eb_prev(b, offset);
+            eb_cursor_init(&cur, b, offset);
         } else {
             offset = offset1;
             if (offset >= end_offset)
@@ -148,10 +153,12 @@ static int eb_search(EditBuffer *b, int dir, int flags,
 
         /* CG: XXX: Should use buffer specific accelerator */
         /* Get first char separately to compute offset1 */
-        c = eb_nextc(b, offset, &offset1);
+        c = eb_cursor_nextc(&cur);
+        offset1 = cur.offset;
 
         pos = 0;
-        for (offset2 = offset1;;) {
+        for (cur2 = cur;;) {
+            offset2 = cur2.offset;
             c2 = buf[pos++];
             if (flags & SEARCH_FLAG_IGNORECASE) {
                 if (qe_toupper(c) != qe_toupper(c2))
@@ -175,7 +182,7 @@ static int eb_search(EditBuffer *b, int dir, int flags,
             }
             if (offset2 >= total_size)
                 break;
-            c = eb_nextc(b, offset2, &offset2);
+            c = eb_cursor_nextc(&cur2);
         }
     }
 }
@@ -238,7 +245,8 @@ static void isearch_run(ISearchState *is)
     buf_t outbuf, *out;
     int c, i, len, hex_nibble, max_nibble, h, hc;
     unsigned int v;
-    int search_offset, flags, dir = is->start_dir;
+    QEOffset search_offset;
+    int flags, dir = is->start_dir;
     int start_time, elapsed_time;
 
     start_time = get_clock_ms();
@@ -257,7 +265,7 @@ static void isearch_run(ISearchState *is)
         v = is->search_u32_flags[i];
         if (v & FOUND_TAG) {
             dir = (v & FOUND_REV) ? -1 : 1;
-            search_offset = v & ~(FOUND_TAG | FOUND_REV);
+            search_offset = is->search_offsets[i];
             continue;
         }
         c = v;
@@ -340,9 +348,11 @@ static void isearch_run(ISearchState *is)
     dpy_flush(s->screen);
 }
 
-static int isearch_grab(ISearchState *is, EditBuffer *b, int from, int to)
+static int isearch_grab(ISearchState *is, EditBuffer *b,
+                        QEOffset from, QEOffset to)
 {
-    int offset, c, last = is->pos;
+    QEOffset offset;
+    int c, last = is->pos;
     if (b) {
         if (to < 0 || to > b->total_size)
             to = b->total_size;
@@ -359,7 +369,8 @@ static void isearch_key(void *opaque, int ch)
     ISearchState *is = opaque;
     EditState *s = is->s;
     QEmacsState *qs = &qe_state;
-    int offset0, offset1, curdir = is->dir;
+    QEOffset offset0, offset1;
+    int curdir = is->dir;
     int emacs_behaviour = !qs->emulation_flags;
 
     if (is->quoting) {
@@ -413,14 +424,16 @@ static void isearch_key(void *opaque, int ch)
         } else
         if (is->pos < SEARCH_LENGTH) {
             /* add the match position, if any */
-            unsigned long v = (is->dir >= 0) ? FOUND_TAG : FOUND_TAG | FOUND_REV;
+            unsigned int v = (is->dir >= 0) ? FOUND_TAG : FOUND_TAG | FOUND_REV;
+            QEOffset pos = 0;
             if (is->found_offset < 0 && is->search_u32_len > 0) {
                 is->search_flags |= SEARCH_FLAG_WRAPPED;
                 if (is->dir < 0)
-                    v |= s->b->total_size;
+                    pos = s->b->total_size;
             } else {
-                v |= s->offset;
+                pos = s->offset;
             }
+            is->search_offsets[is->pos] = pos;
             is->search_u32_flags[is->pos++] = v;
         }
         break;
@@ -561,11 +574,11 @@ void do_isearch(EditState *s, int dir, int argval)
 }
 
 void isearch_colorize_matches(EditState *s, unsigned int *buf, int len,
-                              QETermStyle *sbuf, int offset_start)
+                              QETermStyle *sbuf, QEOffset offset_start)
 {
     ISearchState *is = s->isearch_state;
     EditBuffer *b = s->b;
-    int offset, char_offset, found_offset, found_end, offset_end;
+    QEOffset offset, char_offset, found_offset, found_end, offset_end;
 
     if (!is || is->search_u32_len <= 0)
         return;
@@ -644,13 +657,13 @@ static int search_to_u32(unsigned int *buf, int size,
 
 typedef struct QueryReplaceState {
     EditState *s;
-    int start_offset;
+    QEOffset start_offset;
     int search_flags;
     int replace_all;
     int nb_reps;
     int search_u32_len, replace_u32_len;
-    int found_offset, found_end;
-    int last_offset;
+    QEOffset found_offset, found_end;
+    QEOffset last_offset;
     char search_str[SEARCH_LENGTH];     /* may be in hex */
     char replace_str[SEARCH_LENGTH];    /* may be in hex */
     unsigned int search_u32[SEARCH_LENGTH];   /* code points */
@@ -676,9 +689,11 @@ static void query_replace_replace(QueryReplaceState *is)
 
     /* XXX: handle smart case replacement */
     is->nb_reps++;
+    eb_begin_transaction(s->b);
     eb_delete_range(s->b, is->found_offset, is->found_end);
     is->found_offset += eb_insert_u32_buf(s->b, is->found_offset,
         is->replace_u32, is->replace_u32_len);
+    eb_end_transaction(s->b);
 }
 
 static void query_replace_display(QueryReplaceState *is)
@@ -695,11 +710,16 @@ static void query_replace_display(QueryReplaceState *is)
                                         countof(is->replace_u32),
                                         is->replace_str, is->search_flags);
 
+    /* replace all remaining matches as a single undo record */
+    if (is->replace_all)
+        eb_begin_transaction(s->b);
     for (;;) {
         if (eb_search(s->b, 1, is->search_flags,
                       is->found_offset, s->b->total_size,
                       is->search_u32, is->search_u32_len,
                       NULL, NULL, &is->found_offset, &is->found_end) <= 0) {
+            if (is->replace_all)
+                eb_end_transaction(s->b);
             query_replace_abort(is);
             return;
         }
@@ -854,9 +874,9 @@ void do_search_string(EditState *s, const char *search_str, int dir)
 {
     unsigned int search_u32[SEARCH_LENGTH];
     int search_u32_len;
-    int found_offset, found_end;
+    QEOffset found_offset, found_end, offset;
     int flags = SEARCH_FLAG_SMARTCASE;
-    int offset, count = 0;
+    int count = 0;
 
     if (s->hex_mode) {
         if (s->unihex_mode)
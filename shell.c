@@ -56,13 +56,13 @@ typedef struct ShellState {
     /* buffer state */
     int cols, rows;
     int use_alternate_screen;
-    int alternate_screen_top;
+    QEOffset alternate_screen_top;
     int scroll_top, scroll_bottom;  /* scroll region (top included, bottom excluded) */
     int pty_fd;
     int pid; /* -1 if not launched */
     unsigned int attr, fgcolor, bgcolor, reverse;
-    int cur_offset; /* current offset at position x, y */
-    int cur_prompt; /* offset of end of prompt on current line */
+    QEOffset cur_offset; /* current offset at position x, y */
+    QEOffset cur_prompt; /* offset of end of prompt on current line */
     int save_x, save_y;
     int nb_params;
     int params[MAX_CSI_PARAMS + 1];
@@ -93,15 +93,15 @@ typedef struct ShellState {
 
 /* CG: these variables should be encapsulated in a global structure */
 static char error_buffer[MAX_BUFFERNAME_SIZE];
-static int error_offset = -1;
+static QEOffset error_offset = -1;
 static int error_line_num = -1;
 static int error_col_num = -1;
 static char error_filename[MAX_FILENAME_SIZE];
 
-static char *shell_get_curpath(EditBuffer *b, int offset,
+static char *shell_get_curpath(EditBuffer *b, QEOffset offset,
                                char *buf, int buf_size);
 
-static void set_error_offset(EditBuffer *b, int offset)
+static void set_error_offset(EditBuffer *b, QEOffset offset)
 {
     pstrcpy(error_buffer, sizeof(error_buffer), b ? b->name : "");
     error_offset = offset - 1;
@@ -477,14 +477,16 @@ static inline void qe_term_set_style(ShellState *s) {
     s->b->cur_style = QE_TERM_COMPOSITE | s->attr | composite_color;
 }
 
-static void qe_term_get_pos(ShellState *s, int destoffset,
-                            int *start, int *px, int *py)
+static void qe_term_get_pos(ShellState *s, QEOffset destoffset,
+                            QEOffset *start, int *px, int *py)
 {
-    int total_lines, col_num, offset, offset1, c;
-    int x, y, w, start_line, start_offset;
+    QEOffset offset, offset1, start_offset;
+    int total_lines, col_num, c;
+    int x, y, w, start_line;
 
     if (s->use_alternate_screen) {
-        start_offset = minp(&s->alternate_screen_top, s->b->total_size);
+        start_offset = s->alternate_screen_top =
+            min_offset(s->alternate_screen_top, s->b->total_size);
     } else {
         eb_get_pos(s->b, &total_lines, &col_num, s->b->total_size);
         if (s->cur_offset >= s->b->total_size
@@ -499,7 +501,7 @@ static void qe_term_get_pos(ShellState *s, int destoffset,
         *start = start_offset;
     }
     if (px || py) {
-        destoffset = clamp(destoffset, 0, s->b->total_size);
+        destoffset = clamp_offset(destoffset, 0, s->b->total_size);
         offset = start_offset;
         for (x = y = 0; offset < destoffset;) {
             c = eb_nextc(s->b, offset, &offset);
@@ -522,7 +524,8 @@ static void qe_term_get_pos(ShellState *s, int destoffset,
  */
 static void qe_term_goto_xy(ShellState *s, int destx, int desty, int relative)
 {
-    int x, y, w, start_offset, offset, offset1, c;
+    QEOffset start_offset, offset, offset1;
+    int x, y, w, c;
 
     if (relative) {
         qe_term_get_pos(s, s->cur_offset, &start_offset, &x, &y);
@@ -591,10 +594,10 @@ static void qe_term_goto_tab(ShellState *s, int n)
     qe_term_goto_xy(s, max(0, col_num + n * 8) & ~7, 0, 2);
 }
 
-static int qe_term_overwrite(ShellState *s, int offset,
-                             const char *buf, int len)
+static QEOffset qe_term_overwrite(ShellState *s, QEOffset offset,
+                                  const char *buf, int len)
 {
-    int offset1;
+    QEOffset offset1;
     int c1;
 
     c1 = eb_nextc(s->b, offset, &offset1);
@@ -606,7 +609,7 @@ static int qe_term_overwrite(ShellState *s, int offset,
         /* check for buffer content change is not an advisable optimisation
          * because re-writing the same character may cause color changes.
          */
-        int cur_len = offset1 - offset;
+        QEOffset cur_len = offset1 - offset;
         if (cur_len == len) {
             eb_write(s->b, offset, buf, len);
         } else {
@@ -617,7 +620,7 @@ static int qe_term_overwrite(ShellState *s, int offset,
     return offset + len;
 }
 
-static int qe_term_put_char(ShellState *s, int offset, int c, int n)
+static QEOffset qe_term_put_char(ShellState *s, QEOffset offset, int c, int n)
 {
     /* qe_term_put_char purposely ignores charset when writing chars */
     char buf[1];
@@ -630,12 +633,12 @@ static int qe_term_put_char(ShellState *s, int offset, int c, int n)
     return offset;
 }
 
-static int qe_term_erase_chars(ShellState *s, int offset, int n)
+static QEOffset qe_term_erase_chars(ShellState *s, QEOffset offset, int n)
 {
     return qe_term_put_char(s, offset, ' ', n);
 }
 
-static int qe_term_skip_lines(ShellState *s, int offset, int n)
+static QEOffset qe_term_skip_lines(ShellState *s, QEOffset offset, int n)
 {
     int i;
     for (i = 0; i < n; i++) {
@@ -644,9 +647,10 @@ static int qe_term_skip_lines(ShellState *s, int offset, int n)
     return offset;
 }
 
-static int qe_term_delete_lines(ShellState *s, int offset, int n)
+static QEOffset qe_term_delete_lines(ShellState *s, QEOffset offset, int n)
 {
-    int i, offset1;
+    QEOffset offset1;
+    int i;
 
     if (n > 0) {
         for (offset1 = offset, i = 0; i < n; i++) {
@@ -657,7 +661,7 @@ static int qe_term_delete_lines(ShellState *s, int offset, int n)
     return offset;
 }
 
-static int qe_term_insert_lines(ShellState *s, int offset, int n)
+static QEOffset qe_term_insert_lines(ShellState *s, QEOffset offset, int n)
 {
     if (n > 0) {
         offset += eb_insert_uchars(s->b, offset, '\n', n);
@@ -1018,10 +1022,10 @@ static unsigned char const sco_color[16] = {
 static void qe_term_emulate(ShellState *s, int c)
 {
     int i, n, param1, param2, len;
-    int offset, offset1, offset2;
+    QEOffset offset, offset1, offset2;
     char buf1[10];
 
-    offset = clampp(&s->cur_offset, 0, s->b->total_size);
+    offset = s->cur_offset = clamp_offset(s->cur_offset, 0, s->b->total_size);
 
     if (s->state == QE_TERM_STATE_NORM) {
         s->term_pos = 0;
@@ -1461,7 +1465,8 @@ static void qe_term_emulate(ShellState *s, int c)
             /* XXX: should just force top of window to in infinite scroll mode */
             {   /*     0: Below (default), 1: Above, 2: All, 3: Saved Lines (xterm) */
                 /* XXX: should handle eol style */
-                int offset0, bos, eos, col, row;
+                QEOffset offset0;
+                int bos, eos, col, row;
 
                 bos = eos = 0;
                 // default param is 0
@@ -1906,7 +1911,7 @@ static void shell_read_cb(void *opaque)
         }
         shell_get_curpath(b, s->cur_offset, s->curpath, sizeof(s->curpath));
     } else {
-        int pos = b->total_size;
+        QEOffset pos = b->total_size;
         int threshold = 3 << 20;    /* 3MB for large pictures */
         eb_write(b, b->total_size, buf, len);
         if (pos < threshold && pos + len >= threshold) {
@@ -2422,16 +2427,16 @@ static void shell_write_char(EditState *e, int c)
     }
 }
 
-static void shell_delete_bytes(EditState *e, int offset, int size)
+static void shell_delete_bytes(EditState *e, QEOffset offset, QEOffset size)
 {
     ShellState *s = shell_get_state(e, 1);
-    int start = offset;
-    int end = offset + size;
+    QEOffset start = offset;
+    QEOffset end = offset + size;
 
     // XXX: should deal with regions spanning current input line and
     // previous buffer contents
     if (s && !s->grab_keys && end > s->cur_prompt) {
-        int start_char, cur_char, end_char, size;
+        QEOffset start_char, cur_char, end_char, size;
         if (start < s->cur_prompt) {
             /* delete part before the interactive input */
             size = eb_delete_range(e->b, start, s->cur_prompt);
@@ -2527,7 +2532,7 @@ static void do_shell_kill_word(EditState *e, int dir)
 
     if (s && e->interactive) {
         /* copy word to the kill ring */
-        int start = e->offset;
+        QEOffset start = e->offset;
 
         text_move_word_left_right(e, dir);
         if (e->offset < s->cur_prompt) {
@@ -2545,13 +2550,13 @@ static void do_shell_kill_line(EditState *e, int argval)
 {
     ShellState *s = shell_get_state(e, 1);
     int dir = (argval == NO_ARG || argval > 0) ? 1 : -1;
-    int offset, p1 = e->offset, p2 = p1;
+    QEOffset offset, p1 = e->offset, p2 = p1;
 
     if (s && e->interactive) {
         /* ignore count argument in interactive mode */
         if (dir < 0) {
             /* kill backwards upto prompt position */
-            p2 = max(eb_goto_bol(e->b, p1), s->cur_prompt);
+            p2 = max_offset(eb_goto_bol(e->b, p1), s->cur_prompt);
             do_kill(e, p1, p2, dir, 0);
             //shell_write_char(e, KEY_META('k'));
         } else {
@@ -2611,7 +2616,7 @@ static void do_shell_yank(EditState *e)
          * large. Hard coded limit can be removed if shell input is
          * made asynchronous via an auxiliary buffer.
          */
-        int offset;
+        QEOffset offset;
         QEmacsState *qs = e->qe_state;
         EditBuffer *b = qs->yank_buffers[qs->yank_current];
 
@@ -2728,7 +2733,7 @@ static void do_shell_toggle_input(EditState *e)
 
 /* get current directory from prompt on current line */
 /* XXX: should extend behavior to handle more subtile cases */
-static char *shell_get_curpath(EditBuffer *b, int offset,
+static char *shell_get_curpath(EditBuffer *b, QEOffset offset,
                                char *buf, int buf_size)
 {
     char line[1024];
@@ -2771,7 +2776,7 @@ static char *shell_get_curpath(EditBuffer *b, int offset,
     return pstrcpy(buf, buf_size, curpath);
 }
 
-static char *shell_get_default_path(EditBuffer *b, int offset,
+static char *shell_get_default_path(EditBuffer *b, QEOffset offset,
                                     char *buf, int buf_size)
 {
     ShellState *s = qe_get_buffer_mode_data(b, &shell_mode, NULL);
@@ -2849,7 +2854,7 @@ static void do_compile_error(EditState *s, int arg, int dir)
     QEmacsState *qs = s->qe_state;
     EditState *e;
     EditBuffer *b;
-    int offset, found_offset;
+    QEOffset offset, found_offset;
     char filename[MAX_FILENAME_SIZE];
     char fullpath[MAX_FILENAME_SIZE];
     buf_t fnamebuf, *fname;
@@ -2923,7 +2928,7 @@ static void do_compile_error(EditState *s, int arg, int dir)
             line_num = line_num * 10 + c - '0';
         }
         if (c == ',' || c == ':') {
-            int offset0 = offset;
+            QEOffset offset0 = offset;
             int c0 = c;
             for (;;) {
                 c = eb_nextc(b, offset, &offset);
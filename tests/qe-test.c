@@ -0,0 +1,537 @@
+/*
+ * QEmacs, regression tests
+ *
+ * Build and run with `make test`.  qe.c is included here so the tests
+ * can reach the static mode and module initialization.
+ */
+
+#define main qe_main
+#include "../qe.c"
+#undef main
+
+static int nb_tests, nb_failed;
+
+static void test_check(int ok, const char *name, const char *msg)
+{
+    nb_tests++;
+    if (!ok) {
+        nb_failed++;
+        fprintf(stderr, "%s: FAILED: %s\n", name, msg);
+    }
+}
+
+static int test_buffer_is(EditBuffer *b, const char *str)
+{
+    char buf[256];
+    int len = strlen(str);
+
+    if (b->total_size != len || len > countof(buf))
+        return 0;
+    eb_read(b, 0, buf, len);
+    return !memcmp(buf, str, len);
+}
+
+static void test_init(void)
+{
+    QEmacsState *qs = &qe_state;
+    static QEditScreen screen;
+
+    qs->screen = &screen;
+    qs->macro_key_index = -1;
+    qs->ungot_key = -1;
+    qs->default_tab_width = 8;
+    qs->default_fill_column = 70;
+    qs->mmap_threshold = MIN_MMAP_SIZE;
+    qs->max_load_size = MAX_LOAD_SIZE;
+    qs->async_load_threshold = MIN_ASYNC_LOAD_SIZE;
+    qs->so_long_threshold = SO_LONG_THRESHOLD;
+    qs->atomic_save = 1;
+    qs->undo_outer_limit = UNDO_OUTER_LIMIT;
+
+    eb_init();
+    charset_init();
+    qe_register_mode(&text_mode, MODEF_VIEW);
+    qe_register_mode(&so_long_mode, MODEF_SYNTAX);
+    init_all_modules();
+}
+
+/* sorting a region replaces it with text of the same size: undo and
+ * redo must both restore the right text. */
+static void test_sort_undo_redo(void)
+{
+    QEmacsState *qs = &qe_state;
+    const char *name = "sort-undo-redo";
+    EditState s;
+    EditBuffer *b;
+    CmdDef *d;
+
+    b = eb_new("*test-sort*", BF_SAVELOG);
+    memset(&s, 0, sizeof(s));
+    s.b = b;
+    s.qe_state = qs;
+    eb_insert(b, 0, "cherry\nbanana\napple\n", 20);
+
+    d = qe_find_cmd("sort-buffer");
+    test_check(d != NULL, name, "sort-buffer command not found");
+    if (!d)
+        goto done;
+    d->action.ESii(&s, 0, NO_ARG);
+    test_check(test_buffer_is(b, "apple\nbanana\ncherry\n"), name,
+               "buffer not sorted");
+
+    qs->last_cmd_func = NULL;
+    do_undo(&s);
+    test_check(test_buffer_is(b, "cherry\nbanana\napple\n"), name,
+               "undo did not restore the original text");
+
+    qs->last_cmd_func = (CmdFunc)do_undo;
+    do_redo(&s);
+    test_check(test_buffer_is(b, "apple\nbanana\ncherry\n"), name,
+               "redo did not restore the sorted text");
+
+    qs->last_cmd_func = (CmdFunc)do_redo;
+    do_undo(&s);
+    test_check(test_buffer_is(b, "cherry\nbanana\napple\n"), name,
+               "second undo did not restore the original text");
+    qs->last_cmd_func = NULL;
+
+ done:
+    eb_free(&b);
+}
+
+#if defined(CONFIG_MMAP) && !defined(CONFIG_WIN32)
+static int test_file_is(const char *filename, const char *prefix,
+                        int fill, int size)
+{
+    char buf[4096];
+    int fd, len, pos, prefix_len = strlen(prefix), ok = 1;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    for (pos = 0; ok && (len = read(fd, buf, sizeof(buf))) > 0; pos += len) {
+        int i;
+        for (i = 0; i < len; i++) {
+            int c = (pos + i < prefix_len) ? prefix[pos + i] : fill;
+            if ((u8)buf[i] != c) {
+                ok = 0;
+                break;
+            }
+        }
+    }
+    close(fd);
+    return ok && pos == size;
+}
+
+static int test_make_file(const char *filename, int fill, int size)
+{
+    char buf[4096];
+    int fd, len, ok = 1;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+    memset(buf, fill, sizeof(buf));
+    for (; ok && size > 0; size -= len) {
+        len = min(size, sizeof(buf));
+        ok = write(fd, buf, len) == len;
+    }
+    return !close(fd) && ok;
+}
+
+/* a mapped buffer must be saved by renaming a new file over the old
+ * one, even with atomic-save disabled, and the temporary file must
+ * not follow a link planted at its name. */
+static void test_save_mapped(void)
+{
+    QEmacsState *qs = &qe_state;
+    const char *name = "save-mapped";
+    char dir[] = "/tmp/qe-test-XXXXXX";
+    char filename[64], tmpname[80], other[64];
+    EditBuffer *b;
+    QEOffset pos;
+    int size = 3 * MAX_PAGE_SIZE + 100;
+
+    if (!mkdtemp(dir)) {
+        test_check(0, name, "cannot create temporary directory");
+        return;
+    }
+    snprintf(filename, sizeof(filename), "%s/mapped", dir);
+    snprintf(other, sizeof(other), "%s/other", dir);
+    snprintf(tmpname, sizeof(tmpname), "%s.#qe%d", filename, (int)getpid());
+
+    b = eb_new("*test-mapped*", 0);
+    if (!test_make_file(filename, 'a', size)
+    ||  eb_mmap_buffer(b, filename) < 0) {
+        test_check(0, name, "cannot map test file");
+        goto done;
+    }
+    eb_insert(b, 0, "head\n", 5);
+
+    qs->atomic_save = 0;
+    test_check(b->data_type->buffer_save(b, 0, b->total_size,
+                                         filename) == size + 5,
+               name, "save failed");
+    qs->atomic_save = 1;
+    test_check(test_file_is(filename, "head\n", 'a', size + 5), name,
+               "saved file has the wrong contents");
+    test_check(b->total_size == size + 5 && eb_nextc(b, 5, &pos) == 'a',
+               name, "buffer changed by saving");
+
+    /* a link at the temporary name must make the save fail */
+    test_make_file(other, 'o', 10);
+    if (symlink(other, tmpname) == 0) {
+        test_check(b->data_type->buffer_save(b, 0, b->total_size,
+                                             filename) < 0,
+                   name, "save followed the temporary name link");
+        test_check(test_file_is(other, "", 'o', 10), name,
+                   "link target overwritten");
+        unlink(tmpname);
+    }
+
+ done:
+    eb_free(&b);
+    unlink(filename);
+    unlink(other);
+    rmdir(dir);
+}
+
+static void test_load_file(EditBuffer *b, const char *filename)
+{
+    FILE *f;
+
+    eb_set_filename(b, filename);
+    f = fopen(filename, "r");
+    if (f) {
+        b->data_type->buffer_load(b, f);
+        fclose(f);
+    }
+}
+
+/* files between async-load-threshold and max-load-size are read in
+ * the background, larger files are mapped, smaller files are read. */
+static void test_load_methods(void)
+{
+    QEmacsState *qs = &qe_state;
+    const char *name = "load-methods";
+    char dir[] = "/tmp/qe-test-XXXXXX";
+    char filename[64];
+    EditBuffer *b;
+    int size = 64 * 1024;
+
+    if (!mkdtemp(dir)) {
+        test_check(0, name, "cannot create temporary directory");
+        return;
+    }
+    snprintf(filename, sizeof(filename), "%s/load", dir);
+    if (!test_make_file(filename, 'l', size)) {
+        test_check(0, name, "cannot create test file");
+        goto done;
+    }
+    qs->async_load_threshold = size / 4;
+    qs->mmap_threshold = size / 2;
+
+    /* a file small enough to be loaded is loaded asynchronously, even
+       above mmap-threshold: a small file completes on the first read */
+    qs->max_load_size = size;
+    b = eb_new("*test-load*", 0);
+    test_load_file(b, filename);
+    test_check(!b->map_address && b->total_size == size
+               && !(b->flags & (BF_LOADING | BF_READONLY)),
+               name, "file not loaded in the background");
+    eb_free(&b);
+
+    /* a file above max-load-size is mapped */
+    qs->max_load_size = size / 2;
+    b = eb_new("*test-load*", 0);
+    test_load_file(b, filename);
+    test_check(b->map_address && b->total_size == size,
+               name, "large file not mapped");
+    eb_free(&b);
+
+    /* a file below both thresholds is read directly */
+    qs->async_load_threshold = qs->mmap_threshold = size * 2;
+    qs->max_load_size = size * 2;
+    b = eb_new("*test-load*", 0);
+    test_load_file(b, filename);
+    test_check(!b->map_address && b->total_size == size,
+               name, "small file not loaded");
+    eb_free(&b);
+
+ done:
+    qs->mmap_threshold = MIN_MMAP_SIZE;
+    qs->max_load_size = MAX_LOAD_SIZE;
+    qs->async_load_threshold = MIN_ASYNC_LOAD_SIZE;
+    unlink(filename);
+    rmdir(dir);
+}
+#endif
+
+static ModeDef *test_probe(EditBuffer *b, const char *filename,
+                           const u8 *buf, int len, QEOffset total_size)
+{
+    EditState s;
+    ModeDef *mode = NULL;
+    int score = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.b = b;
+    s.qe_state = &qe_state;
+    probe_mode(&s, b, &mode, 1, &score, 2, filename, 0, S_IFREG,
+               total_size, buf, len, &charset_utf8, EOL_UNIX);
+    return mode;
+}
+
+/* the mode probe only sees the first 4096 bytes of a file: an overlong
+ * line after a short header line must still select so-long mode. */
+static void test_so_long_probe(void)
+{
+    const char *name = "so-long-probe";
+    static const char header[] = "/*! minified bundle v1.2.3 | (c) 2024"
+        " example.org | released under the MIT license, see LICENSE */\n";
+    u8 buf[4097];
+    EditBuffer *b;
+    int i, len = sizeof(buf) - 1;
+
+    b = eb_new("*test-probe*", 0);
+
+    /* header line, then a line filling the rest of the sample */
+    memset(buf, 'x', len);
+    memcpy(buf, header, sizeof(header) - 1);
+    buf[len] = '\0';
+    test_check(test_probe(b, "app.min.js", buf, len, 100000) == &so_long_mode,
+               name, "overlong line after a header not detected");
+
+    /* the same sample is the whole file: the line is short enough */
+    test_check(test_probe(b, "app.min.js", buf, len, len) != &so_long_mode,
+               name, "short line detected as overlong");
+
+    /* ordinary lines in a partial sample */
+    for (i = 0; i < len; i++)
+        buf[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+    test_check(test_probe(b, "notes.txt", buf, len, 100000) != &so_long_mode,
+               name, "short lines detected as overlong");
+
+    eb_free(&b);
+}
+
+/* colorizing the line after an overlong line propagates the state
+ * through the whole overlong line, the window line buffer must not
+ * keep its size afterwards. */
+static void test_colorize_long_line(void)
+{
+    const char *name = "colorize-long-line";
+    static unsigned int buf[COLORED_MAX_LINE_SIZE];
+    static QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
+    EditState s;
+    EditBuffer *b;
+    ModeDef *m;
+    QEOffset offset;
+    int i, len;
+
+    m = qe_find_mode("C", 0);
+    test_check(m && m->colorize_func, name, "C mode not found");
+    if (!m || !m->colorize_func)
+        return;
+
+    b = eb_new("*test-colorize*", 0);
+    eb_insert(b, 0, "/* ", 3);
+    for (i = 0; i < 50000; i++)
+        eb_insert(b, b->total_size, "xxxx", 4);
+    eb_insert(b, b->total_size, "\nint y; */ z\n", 13);
+
+    memset(&s, 0, sizeof(s));
+    s.b = b;
+    s.mode = m;
+    s.qe_state = &qe_state;
+    set_colorize_func(&s, m->colorize_func);
+    offset = eb_goto_pos(b, 1, 0);
+    len = s.get_colorized_line(&s, buf, countof(buf), sbuf, offset,
+                               &offset, 1);
+    test_check(len == 11 && buf[0] == 'i' && sbuf[0] == QE_STYLE_COMMENT,
+               name, "comment state not propagated");
+    test_check(s.line_buf_size <= COLORIZED_LINE_KEEP_SIZE, name,
+               "line buffer not shrunk");
+
+    set_colorize_func(&s, NULL);
+    qe_free(&s.line_buf);
+    eb_free(&b);
+}
+
+static int test_slab_shared(EditBuffer *b)
+{
+    int i, n = 0;
+
+    for (i = 0; i < NB_PAGE_SLABS; i++)
+        n += b->page_slab.nb_shared[i];
+    return n;
+}
+
+/* sharing pages hands their slab blocks over without copying them, the
+ * blocks outlive the source buffer and return to its free lists when
+ * it is still there. */
+static void test_share_pages(void)
+{
+    const char *name = "share-pages";
+    static u8 text[4 * MAX_PAGE_SIZE], check[4 * MAX_PAGE_SIZE];
+    EditBuffer *b, *src;
+    u8 *data;
+    int i, size = countof(text);
+
+    for (i = 0; i < size; i++)
+        text[i] = (i % 61 == 60) ? '\n' : 'a' + i % 26;
+
+    src = eb_new("*test-share-src*", 0);
+    b = eb_new("*test-share*", 0);
+    eb_insert(src, 0, text, size);
+    data = src->page_table[0].data;
+    eb_insert_buffer(b, 0, src, 0, size);
+    test_check(b->page_table[0].data == data, name, "page data copied");
+    test_check(test_slab_shared(src) == src->nb_pages, name,
+               "shared blocks not accounted");
+    eb_delete(b, 0, size);
+    eb_delete(src, 0, size);
+    test_check(test_slab_shared(src) == 0, name,
+               "shared blocks not returned to the slab");
+
+    eb_insert(src, 0, text, size);
+    eb_insert_buffer(b, 0, src, 0, size);
+    eb_free(&src);
+    test_check(eb_read(b, 0, check, size) == size
+               && !memcmp(check, text, size), name,
+               "shared pages lost with their source buffer");
+    eb_free(&b);
+}
+
+#ifdef __linux__
+#include <sys/resource.h>
+
+#define OOM_SHADOW_SIZE  (16 << 20)
+
+/* insertions failing for lack of memory must leave the buffer, its
+ * page index, its page allocator and its undo log as they were.
+ * Memory is exhausted by limiting the address space of the process.
+ * Insertions from another buffer share its pages. */
+static void test_insert_out_of_memory(void)
+{
+    QEmacsState *qs = &qe_state;
+    static u8 shadow[OOM_SHADOW_SIZE], chunk[2 * MAX_PAGE_SIZE];
+    static u8 check[8192], text[4 * MAX_PAGE_SIZE];
+    const char *name = "insert-out-of-memory";
+    struct rlimit rl, rl0;
+    long vm_pages = 0;
+    QEOffset offset, last_offset = 0;
+    EditState s;
+    EditBuffer *b, *src;
+    FILE *f;
+    unsigned int seed = 1;
+    int i, n, len, size, last_len = 0, nb_lines, line, col, failed = 0;
+    int nb_used;
+
+    f = fopen("/proc/self/statm", "r");
+    if (!f || fscanf(f, "%ld", &vm_pages) != 1 || getrlimit(RLIMIT_AS, &rl0)) {
+        if (f)
+            fclose(f);
+        return;
+    }
+    fclose(f);
+
+    b = eb_new("*test-oom*", BF_SAVELOG);
+    memset(&s, 0, sizeof(s));
+    s.b = b;
+    s.qe_state = qs;
+    src = eb_new("*test-oom-src*", 0);
+    for (i = 0; i < countof(text); i++)
+        text[i] = (i % 61 == 60) ? '\n' : 'A' + i % 26;
+    eb_insert(src, 0, text, countof(text));
+
+    rl = rl0;
+    rl.rlim_cur = vm_pages * sysconf(_SC_PAGESIZE) + (4 << 20);
+    if (setrlimit(RLIMIT_AS, &rl)) {
+        eb_free(&b);
+        eb_free(&src);
+        return;
+    }
+    size = 0;
+    while (!failed && size < OOM_SHADOW_SIZE - (int)sizeof(chunk)) {
+        seed = seed * 1103515245 + 12345;
+        offset = size ? (seed >> 4) % (size + 1) : 0;
+        b->last_log = 0;
+        if (seed % 3 == 0) {
+            len = 1 + (seed >> 8) % sizeof(chunk);
+            i = (seed >> 12) % (countof(text) - len);
+            memcpy(chunk, text + i, len);
+            n = eb_insert_buffer(b, offset, src, i, len);
+        } else {
+            len = 1 + (seed >> 8) % 8192;
+            for (i = 0; i < len; i++)
+                chunk[i] = (i % 50 == 49) ? '\n' : 'a' + (seed + i) % 26;
+            n = eb_insert(b, offset, chunk, len);
+        }
+        if (n == 0) {
+            failed = 1;
+            break;
+        }
+        memmove(shadow + offset + len, shadow + offset, size - offset);
+        memcpy(shadow + offset, chunk, len);
+        size += len;
+        last_offset = offset;
+        last_len = len;
+    }
+    setrlimit(RLIMIT_AS, &rl0);
+
+    test_check(b->total_size == size, name, "buffer size out of sync");
+    for (offset = 0; offset < size; offset += len) {
+        len = eb_read(b, offset, check, sizeof(check));
+        if (len <= 0 || memcmp(check, shadow + offset, len))
+            break;
+    }
+    test_check(offset == size, name, "buffer contents out of sync");
+    for (i = nb_lines = 0; i < size; i++)
+        nb_lines += (shadow[i] == '\n');
+    eb_get_pos(b, &line, &col, size);
+    test_check(line == nb_lines, name, "page index out of sync");
+    for (i = nb_used = 0; i < NB_PAGE_SLABS; i++)
+        nb_used += b->page_slab.nb_used[i];
+    for (i = 0; i < b->nb_pages; i++)
+        nb_used -= !(b->page_table[i].flags & PG_READ_ONLY);
+    test_check(nb_used == 0, name, "page data blocks lost");
+
+    if (failed && last_len > 0) {
+        /* the failed insertion must not be in the undo log */
+        qs->last_cmd_func = NULL;
+        do_undo(&s);
+        memmove(shadow + last_offset, shadow + last_offset + last_len,
+                size - last_offset - last_len);
+        size -= last_len;
+        test_check(b->total_size == size, name,
+                   "undo did not remove the last insertion");
+        len = min(size - last_offset, sizeof(check));
+        test_check(eb_read(b, last_offset, check, len) == len
+                   && !memcmp(check, shadow + last_offset, len),
+                   name, "undo did not remove the last insertion");
+    }
+    eb_free(&b);
+    eb_free(&src);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    test_init();
+
+    test_sort_undo_redo();
+#if defined(CONFIG_MMAP) && !defined(CONFIG_WIN32)
+    test_save_mapped();
+    test_load_methods();
+#endif
+    test_so_long_probe();
+    test_colorize_long_line();
+    test_share_pages();
+#ifdef __linux__
+    test_insert_out_of_memory();
+#endif
+
+    printf("%d tests, %d failed\n", nb_tests, nb_failed);
+    return nb_failed != 0;
+}
@@ -2499,3 +2499,166 @@ void qe_qsort_r(void *base, size_t nmemb, size_t size, void *thunk,
         }
     }
 }
+
+/*---------------- LZ compression ----------------*/
+
+/* Byte oriented LZ77 format in the spirit of LZ4: a sequence is a
+ * token byte with the literal count in the high nibble and the match
+ * length minus LZ_MIN_MATCH in the low nibble, nibbles equal to 15 are
+ * extended with bytes added until one is not 255, then the literals,
+ * then a little endian 16 bit match distance.  The last sequence only
+ * has literals.  Blocks are compressed independently.
+ */
+
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  12
+
+static inline uint32_t lz_read32(const u8 *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline int lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static u8 *lz_put_length(u8 *op, const u8 *op_end, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= op_end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= op_end)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+static u8 *lz_put_sequence(u8 *op, const u8 *op_end, const u8 *lit,
+                           int nlit, int dist, int mlen)
+{
+    u8 *token;
+
+    if (op >= op_end)
+        return NULL;
+    token = op++;
+    *token = min(nlit, 15) << 4;
+    if (nlit >= 15 && !(op = lz_put_length(op, op_end, nlit - 15)))
+        return NULL;
+    if (nlit > op_end - op)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        mlen -= LZ_MIN_MATCH;
+        if (op_end - op < 2)
+            return NULL;
+        *op++ = dist & 0xff;
+        *op++ = dist >> 8;
+        *token |= min(mlen, 15);
+        if (mlen >= 15 && !(op = lz_put_length(op, op_end, mlen - 15)))
+            return NULL;
+    }
+    return op;
+}
+
+/* compress len bytes from src into dst, len must not exceed
+ * LZ_BLOCK_MAX.  Return the compressed size or -1 if it does not fit
+ * in dst_size bytes.
+ */
+int lz_compress(u8 *dst, int dst_size, const u8 *src, int len)
+{
+    int table[1 << LZ_HASH_BITS];
+    const u8 *ip, *anchor, *ref, *ip_end, *match_end;
+    u8 *op, *op_end;
+    int h, mlen;
+
+    memset(table, 0, sizeof(table));
+    op = dst;
+    op_end = dst + dst_size;
+    ip = anchor = src;
+    ip_end = src + len;
+    match_end = ip_end - LZ_MIN_MATCH;
+    while (ip <= match_end) {
+        h = lz_hash(lz_read32(ip));
+        /* table entries are offsets + 1, 0 means empty */
+        ref = src + table[h] - 1;
+        table[h] = ip - src + 1;
+        if (ref < src || ip - ref > 65535
+        ||  lz_read32(ref) != lz_read32(ip)) {
+            ip++;
+            continue;
+        }
+        for (mlen = LZ_MIN_MATCH; ip + mlen < ip_end && ref[mlen] == ip[mlen];)
+            mlen++;
+        op = lz_put_sequence(op, op_end, anchor, ip - anchor, ip - ref, mlen);
+        if (!op)
+            return -1;
+        ip += mlen;
+        anchor = ip;
+    }
+    op = lz_put_sequence(op, op_end, anchor, ip_end - anchor, 0, 0);
+    if (!op)
+        return -1;
+    return op - dst;
+}
+
+static const u8 *lz_get_length(const u8 *ip, const u8 *ip_end, int *len)
+{
+    int c;
+
+    do {
+        if (ip >= ip_end)
+            return NULL;
+        c = *ip++;
+        *len += c;
+    } while (c == 255);
+    return ip;
+}
+
+/* decompress len bytes from src into dst, return the decompressed
+ * size or -1 if the data is corrupt or does not fit in dst_size bytes.
+ */
+int lz_decompress(u8 *dst, int dst_size, const u8 *src, int len)
+{
+    const u8 *ip, *ip_end, *ref;
+    u8 *op, *op_end;
+    int token, nlit, mlen, dist;
+
+    ip = src;
+    ip_end = src + len;
+    op = dst;
+    op_end = dst + dst_size;
+    while (ip < ip_end) {
+        token = *ip++;
+        nlit = token >> 4;
+        if (nlit == 15 && !(ip = lz_get_length(ip, ip_end, &nlit)))
+            return -1;
+        if (nlit > ip_end - ip || nlit > op_end - op)
+            return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip >= ip_end)
+            break;
+        /* match */
+        if (ip_end - ip < 2)
+            return -1;
+        dist = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15 && !(ip = lz_get_length(ip, ip_end, &mlen)))
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (dist == 0 || dist > op - dst || mlen > op_end - op)
+            return -1;
+        /* byte copy: the match may overlap the output */
+        for (ref = op - dist; mlen-- > 0;)
+            *op++ = *ref++;
+    }
+    return op - dst;
+}
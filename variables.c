@@ -45,11 +45,15 @@ static VarDef var_table[] = {
     S_VAR( "hilite-region", hilite_region, VAR_NUMBER, VAR_RW_SAVE )
     S_VAR( "mmap-threshold", mmap_threshold, VAR_NUMBER, VAR_RW_SAVE )
     S_VAR( "max-load-size", max_load_size, VAR_NUMBER, VAR_RW_SAVE )
+    S_VAR( "async-load-threshold", async_load_threshold, VAR_NUMBER, VAR_RW_SAVE )
     S_VAR( "show-unicode", show_unicode, VAR_NUMBER, VAR_RW_SAVE )
     S_VAR( "default-tab-width", default_tab_width, VAR_NUMBER, VAR_RW_SAVE )
     S_VAR( "default-fill-column", default_fill_column, VAR_NUMBER, VAR_RW_SAVE )
     S_VAR( "backup-inhibited", backup_inhibited, VAR_NUMBER, VAR_RW_SAVE )
+    S_VAR( "undo-outer-limit", undo_outer_limit, VAR_NUMBER, VAR_RW_SAVE )
+    S_VAR( "atomic-save", atomic_save, VAR_NUMBER, VAR_RW_SAVE )
     S_VAR( "fuzzy-search", fuzzy_search, VAR_NUMBER, VAR_RW_SAVE )
+    S_VAR( "so-long-threshold", so_long_threshold, VAR_NUMBER, VAR_RW_SAVE )
 
     //B_VAR( "screen-charset", charset, VAR_NUMBER, VAR_RW )
 
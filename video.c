@@ -86,8 +86,8 @@ static int video_buffer_load(EditBuffer *b, FILE *f)
     return 0;
 }
 
-static int video_buffer_save(EditBuffer *b, int start, int end,
-                             const char *filename)
+static QEOffset video_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                  const char *filename)
 {
     /* cannot save anything */
     return -1;